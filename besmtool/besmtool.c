@@ -6,11 +6,15 @@
  *	besmtool zero <disk-number> [<options>...]
  *	besmtool dump <disk-number> [<options>...] [--to-file=<filename>]
  *	besmtool write <disk-number> [<options>...]
+ *	besmtool commit <disk-number> --overlay=<dir>
+ *	besmtool discard <disk-number> --overlay=<dir>
+ *	besmtool convert <disk-number>
  *
  * Options:
  * 	--start=<zone>
  *	--last=<zone>
  *	--length=<nzones>
+ *	--overlay=<dir>
  *
  * Write options:
  *	--from-file=<filename>
@@ -32,6 +36,7 @@
 #include <getopt.h>
 #include "config.h"
 #include "besmtool.h"
+#include "disk.h"
 
 enum {
 	OPT_START,
@@ -43,6 +48,7 @@ enum {
 	OPT_FROM_START,
 	OPT_TO_FILE,
 	OPT_ENCODING,
+	OPT_OVERLAY,
 };
 
 /* Table of options. */
@@ -59,6 +65,7 @@ static struct option longopts[] = {
 	{ "from-start",		1,	0,	OPT_FROM_START	},
 	{ "to-file",		1,	0,	OPT_TO_FILE	},
 	{ "encoding",		1,	0,	OPT_ENCODING	},
+	{ "overlay",		1,	0,	OPT_OVERLAY	},
 	{ 0,			0,	0,	0		},
 };
 
@@ -78,11 +85,15 @@ usage ()
 	fprintf (stderr, "\tbesmtool view <disk-number> [<options>...] [--encoding=g,k,t,i]\n");
 	fprintf (stderr, "\tbesmtool dump <disk-number> [<options>...] [--to-file=<filename>]\n");
 	fprintf (stderr, "\tbesmtool write <disk-number> [<options>...]\n");
+	fprintf (stderr, "\tbesmtool commit <disk-number> --overlay=<dir>\n");
+	fprintf (stderr, "\tbesmtool discard <disk-number> --overlay=<dir>\n");
+	fprintf (stderr, "\tbesmtool convert <disk-number> (rewrite an old chained image as a physical one)\n");
 
 	fprintf (stderr, "Options:\n");
 	fprintf (stderr, "\t--start=<zone>\n");
 	fprintf (stderr, "\t--last=<zone>\n");
 	fprintf (stderr, "\t--length=<nzones>\n");
+	fprintf (stderr, "\t--overlay=<dir> (see the disks with the changes made in dir)\n");
 
 	fprintf (stderr, "View options:\n");
 	fprintf (stderr, "\t--encoding=g,k,t,i (default g,k)\n");
@@ -146,6 +157,9 @@ main (int argc, char **argv)
 		case OPT_ENCODING:
 			view_encoding = optarg;
 			break;
+		case OPT_OVERLAY:
+			disk_overlays = optarg;
+			break;
 		}
 	}
 	argc -= optind;
@@ -193,6 +207,18 @@ main (int argc, char **argv)
 				dump_disk (diskno, start, length);
 			return 0;
 		}
+		if (strcmp ("commit", argv[0]) == 0) {
+			overlay_commit (diskno);
+			return 0;
+		}
+		if (strcmp ("discard", argv[0]) == 0) {
+			overlay_discard (diskno);
+			return 0;
+		}
+		if (strcmp ("convert", argv[0]) == 0) {
+			convert_disk (diskno);
+			return 0;
+		}
 		if (strcmp ("check", argv[0]) == 0) {
 			check_disk (diskno, start, length);
 			return 0;
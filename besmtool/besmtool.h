@@ -5,6 +5,9 @@ void list_all_disks (void);
 void list_disk (unsigned diskno);
 void passports (unsigned diskno, unsigned start);
 void erase_disk (unsigned diskno, unsigned start, unsigned length, int format);
+void overlay_commit (unsigned diskno);
+void overlay_discard (unsigned diskno);
+void convert_disk (unsigned diskno);
 void view_disk (unsigned diskno, unsigned start, unsigned length, char *encoding);
 void dump_disk (unsigned diskno, unsigned start, unsigned length);
 void check_disk (unsigned diskno, unsigned start, unsigned length);
@@ -0,0 +1,19 @@
+#include <stdio.h>
+#include "besmtool.h"
+#include "disk.h"
+
+void
+convert_disk (unsigned diskno)
+{
+	disk_convstat_t st;
+
+	if (disk_convert (diskno, &st) != DISK_IO_OK) {
+		fprintf (stderr, "Cannot convert disk %d\n", diskno);
+		return;
+	}
+	printf ("Converted disk %d: %u zones, %u holes formatted\n",
+		diskno, st.cs_zones, st.cs_holes);
+	printf ("Extents: %u -> 1, size: %ld -> %ld kbytes\n",
+		st.cs_extents, (long) (st.cs_before / 1024),
+		(long) (st.cs_after / 1024));
+}
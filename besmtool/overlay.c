@@ -0,0 +1,33 @@
+#include <stdio.h>
+#include "besmtool.h"
+#include "disk.h"
+
+void
+overlay_commit (unsigned diskno)
+{
+	int n;
+
+	if (! disk_overlays) {
+		fprintf (stderr, "Which overlay? Use --overlay=<dir>\n");
+		return;
+	}
+	n = disk_commit (diskno);
+	if (n < 0) {
+		fprintf (stderr, "Cannot commit %s/%d to disk %d\n",
+			disk_overlays, diskno, diskno);
+		return;
+	}
+	printf ("Committed %d zones (%d kbytes) to disk %d\n",
+		n, n * 6, diskno);
+}
+
+void
+overlay_discard (unsigned diskno)
+{
+	if (! disk_overlays) {
+		fprintf (stderr, "Which overlay? Use --overlay=<dir>\n");
+		return;
+	}
+	if (disk_discard (diskno) == 0)
+		printf ("Discarded changes to disk %d\n", diskno);
+}
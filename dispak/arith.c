@@ -13,6 +13,22 @@
 #include <math.h>
 #include "defs.h"
 
+#ifdef FAST_ALU
+/*
+ * Here the names refer to the original routines, see defs.h.
+ */
+#undef add
+#undef mul
+#undef b6div
+#undef asx
+#undef norm
+int add (void);
+int mul (void);
+int b6div (void);
+int asx (void);
+int norm (void);
+#endif
+
 /*
  * 64-bit floating-point value in format of standard IEEE 754.
  */
@@ -113,6 +129,209 @@ add()
 	return E_SUCCESS;
 }
 
+/*
+ * Normalize and round the result of an arithmetic instruction,
+ * then pack the accumulator and its extension.
+ */
+int
+norm()
+{
+	uint    rr = 0;
+	ushort  cnt, r;
+	int     i;
+
+	switch ((acc.ml >> 16) & 3) {
+	case 2:
+	case 1:
+		rnd_rq |= acc.mr & 1;
+		accex.mr = (accex.mr >> 1) | (accex.ml << 23);
+		accex.ml = (accex.ml >> 1) | (acc.mr << 15);
+		acc.mr = (acc.mr >> 1) | (acc.ml << 23);
+		acc.ml >>= 1;
+		++acc.o;
+		goto chk_rnd;
+	}
+
+	if (dis_norm)
+		goto chk_rnd;
+	if (!(i = (acc.ml >> 15) & 3)) {
+		if ((r = acc.ml & 0xffff)) {
+			for (cnt = 0; (r & 0x8000) == 0;
+						++cnt, r <<= 1);
+			acc.ml = (r & 0xffff) |
+					(acc.mr >> (24 - cnt));
+			acc.mr = (acc.mr << cnt) |
+					(rr = accex.ml >> (16 - cnt));
+			accex.ml = (accex.ml << cnt) |
+					(accex.mr >> (24 - cnt));
+			accex.mr <<= cnt;
+			acc.o -= cnt;
+			goto chk_zero;
+		}
+		if ((r = acc.mr >> 16)) {
+			int     fcnt;
+			for (cnt = 0; (r & 0x80) == 0;
+						++cnt, r <<= 1);
+			acc.ml = acc.mr >> (8 - cnt);
+			acc.mr = (acc.mr << (fcnt = 16 + cnt)) |
+					(accex.ml << cnt) |
+					(accex.mr >> (24 - cnt));
+			accex.mr <<= fcnt;
+			acc.o -= fcnt;
+			rr = acc.r & ((1l << fcnt) - 1);
+			goto chk_zero;
+		}
+		if ((r = acc.mr & 0xffff)) {
+			for (cnt = 0; (r & 0x8000) == 0;
+						++cnt, r <<= 1);
+			acc.ml = (r & 0xffff) |
+					(accex.ml >> (16 - cnt));
+			acc.mr = (accex.ml << (8 + cnt)) |
+					(accex.mr >> (16 - cnt));
+			accex.ml = accex.mr << cnt;
+			accex.mr = 0;
+			acc.o -= 24 + cnt;
+			rr = (acc.ml & ((1 << cnt) - 1)) | acc.mr;
+			goto chk_zero;
+		}
+		if ((r = accex.ml & 0xffff)) {
+			rr = accex.ml | accex.mr;
+			for (cnt = 0; (r & 0x8000) == 0;
+						++cnt, r <<= 1);
+			acc.ml = (r & 0xffff) |
+					(accex.mr >> (24 - cnt));
+			acc.mr = (accex.mr << cnt);
+			accex.ml = accex.mr = 0;
+			acc.o -= 40 + cnt;
+			goto chk_zero;
+		}
+		if ((r = accex.mr >> 16)) {
+			rr = accex.ml | accex.mr;
+			for (cnt = 0; (r & 0x80) == 0;
+						++cnt, r <<= 1);
+			acc.ml = accex.mr >> (8 - cnt);
+			acc.mr = accex.mr << (16 + cnt);
+			accex.ml = accex.mr = 0;
+			acc.o -= 56 + cnt;
+			goto chk_zero;
+		}
+		if ((r = accex.mr & 0xffff)) {
+			rr = accex.ml | accex.mr;
+			for (cnt = 0; (r & 0x8000) == 0;
+						++cnt, r <<= 1);
+			acc.ml = (r & 0xffff);
+			acc.mr = accex.ml = accex.mr = 0;
+			acc.o -= 64 + cnt;
+			goto chk_zero;
+		}
+		goto zero;
+	} else if (i == 3) {
+		if ((r = ~acc.ml & 0xffff)) {
+			for (cnt = 0; (r & 0x8000) == 0;
+						++cnt, r = (r << 1) | 1);
+			acc.ml = 0x10000 | (~r & 0xffff) |
+					(acc.mr >> (24 - cnt));
+			acc.mr = (acc.mr << cnt) |
+					(rr = accex.ml >> (16 - cnt));
+			accex.ml = ((accex.ml << cnt) |
+					(accex.mr >> (24 - cnt)))
+					& 0xffff;
+			accex.mr <<= cnt;
+			acc.o -= cnt;
+			goto chk_zero;
+		}
+		if ((r = (~acc.mr >> 16) & 0xff)) {
+			int     fcnt;
+			for (cnt = 0; (r & 0x80) == 0;
+						++cnt, r = (r << 1) | 1);
+			acc.ml = 0x10000 | (acc.mr >> (8 - cnt));
+			acc.mr = (acc.mr << (fcnt = 16 + cnt)) |
+					(accex.ml << cnt) |
+					(accex.mr >> (24 - cnt));
+			accex.ml = ((accex.ml << fcnt) |
+					(accex.mr >> (8 - cnt)))
+					& 0xffff;
+			accex.mr <<= fcnt;
+			acc.o -= fcnt;
+			rr = acc.r & ((1l << fcnt) - 1);
+			goto chk_zero;
+		}
+		if ((r = ~acc.mr & 0xffff)) {
+			for (cnt = 0; (r & 0x8000) == 0;
+						++cnt, r = (r << 1) | 1);
+			acc.ml = 0x10000 | (~r & 0xffff) |
+					(accex.ml >> (16 - cnt));
+			acc.mr = (accex.ml << (8 + cnt)) |
+					(accex.mr >> (16 - cnt));
+			accex.ml = (accex.mr << cnt) & 0xffff;
+			accex.mr = 0;
+			acc.o -= 24 + cnt;
+			rr = (acc.ml & ((1 << cnt) - 1)) | acc.mr;
+			goto chk_zero;
+		}
+		if ((r = ~accex.ml & 0xffff)) {
+			rr = accex.ml | accex.mr;
+			for (cnt = 0; (r & 0x8000) == 0;
+						++cnt, r = (r << 1) | 1);
+			acc.ml = 0x10000 | (~r & 0xffff) |
+					(accex.mr >> (24 - cnt));
+			acc.mr = (accex.mr << cnt);
+			accex.ml = accex.mr = 0;
+			acc.o -= 40 + cnt;
+			goto chk_zero;
+		}
+		if ((r = (~accex.mr >> 16) & 0xff)) {
+			rr = accex.ml | accex.mr;
+			for (cnt = 0; (r & 0x80) == 0;
+						++cnt, r = (r << 1) | 1);
+			acc.ml = 0x10000 | (accex.mr >> (8 - cnt));
+			acc.mr = accex.mr << (16 + cnt);
+			accex.ml = accex.mr = 0;
+			acc.o -= 56 + cnt;
+			goto chk_zero;
+		}
+		if ((r = ~accex.mr & 0xffff)) {
+			rr = accex.ml | accex.mr;
+			for (cnt = 0; (r & 0x8000) == 0;
+						++cnt, r = (r << 1) | 1);
+			acc.ml = 0x10000 | (~r & 0xffff);
+			acc.mr = accex.ml = accex.mr = 0;
+			acc.o -= 64 + cnt;
+			goto chk_zero;
+		} else {
+			rr = 1;
+			acc.ml = 0x10000;
+			acc.mr = accex.ml = accex.mr = 0;
+			acc.o -= 80;
+			goto chk_zero;
+		}
+	}
+chk_zero:
+	rnd_rq = rnd_rq && !rr;
+chk_rnd:
+	if (acc.o & 0x8000)
+		goto zero;
+	if (acc.o & 0x80) {
+		acc.o = 0;
+		if (!dis_exc)
+			return E_OVFL;
+	}
+	if (!dis_round && rnd_rq)
+		acc.mr |= 1;
+
+	if (!acc.ml && !acc.mr && !dis_norm) {
+zero:
+		acc.l = acc.r = accex.l = accex.r = 0;
+		return E_SUCCESS;
+	}
+	acc.l = ((uint) (acc.o & 0x7f) << 17) | (acc.ml & 0x1ffff);
+	acc.r = acc.mr & 0xffffff;
+
+	accex.l = ((uint) (accex.o & 0x7f) << 17) | (accex.ml & 0x1ffff);
+	accex.r = accex.mr & 0xffffff;
+	return E_SUCCESS;
+}
+
 int
 aax()
 {
@@ -704,7 +923,7 @@ asx()
 			accex.r = (acc.r << i) & 0xffffff;
 			acc.l = acc.r = 0;
 		} else if (i > -96) {
-			accex.l = (acc.r << i) & 0xffffff;
+			accex.l = (acc.r << (-i - 72)) & 0xffffff;
 			acc.l = acc.r = 0;
 		} else
 			acc.l = acc.r = 0;
@@ -749,3 +968,567 @@ fetch_real (int addr)
 
 	return mantissa * exponent.d;
 }
+
+#ifdef FAST_ALU
+/*
+ * 64-bit arithmetic core.  Mantissas are handled as single 64-bit
+ * integers rather than 16- and 24-bit halves, and leading zeros are
+ * counted with one instruction instead of a bit loop.  The results,
+ * unnormalized and overflowing ones included, are bit-for-bit those
+ * of the routines above; alu_check() is there to keep it so.
+ */
+#define M24     0xffffffULL
+#define M40     0xffffffffffULL
+#define M42     0x3ffffffffffULL
+#define M48     0xffffffffffffULL
+
+#ifdef __GNUC__
+#define CLZ64(x)        __builtin_clzll(x)
+#else
+static int
+clz64(uint64_t x)
+{
+	int     n;
+
+	for (n = 0; !(x >> 63); ++n)
+		x <<= 1;
+	return n;
+}
+#define CLZ64(x)        clz64(x)
+#endif
+
+/* 42-bit mantissa of an unpacked register, sign-extended */
+#define MANT(R)         ((int64_t) (((uint64_t) (R).ml << 24 | (R).mr) << 22) >> 22)
+
+int
+add64()
+{
+	alureg_t        *a1, *a2;
+	int             diff;
+	int64_t         m;
+	uint64_t        x;
+
+	diff = acc.o - enreg.o;
+	if (diff < 0) {
+		diff = -diff;
+		a1 = &acc;
+		a2 = &enreg;
+	} else {
+		a1 = &enreg;
+		a2 = &acc;
+	}
+	m = MANT(*a1);
+	if (diff) {
+		if (diff <= 40) {
+			x = ((uint64_t) m << (40 - diff)) & M40;
+			rnd_rq = x != 0;
+			m >>= diff;
+		} else {
+			rnd_rq = m != 0;
+			if (diff <= 80)
+				x = (uint64_t) (m >> (diff - 40)) & M40;
+			else
+				x = (uint64_t) (m >> 63) & M40;
+			m >>= 63;
+		}
+		accex.ml = x >> 24;
+		accex.mr = x & M24;
+		if (m < 0 && diff > 56 && diff <= 80)
+			accex.ml = 0x3ffff;
+	}
+	x = ((uint64_t) m & M42) + ((uint64_t) a2->ml << 24 | a2->mr);
+	acc.o = a2->o;
+	acc.ml = x >> 24;
+	acc.mr = x & M24;
+	return E_SUCCESS;
+}
+
+int
+mul64()
+{
+	uchar           neg = 0;
+	alureg_t        a, b;
+	uint64_t        ma, mb, lo, hi;
+
+	a = acc;
+	b = enreg;
+
+	if ((!a.l && !a.r) || (!b.l && !b.r)) {
+		/* multiplication by zero is zero */
+		acc.l = acc.r = acc.o = acc.ml =
+		accex.l = accex.r = accex.o = accex.ml = 0;
+		rnd_rq = 0;
+		return E_SUCCESS;
+	}
+
+	if (NEGATIVE(a)) {
+		neg = 1;
+		NEGATE(a);
+	}
+	if (NEGATIVE(b)) {
+		neg ^= 1;
+		NEGATE(b);
+	}
+	acc.o = a.o + b.o - 64;
+
+	ma = (uint64_t) (a.ml & 0xffff) << 24 | a.mr;
+	mb = (uint64_t) (b.ml & 0xffff) << 24 | b.mr;
+
+	/* 80-bit product as two 40-bit halves */
+	lo = ma * (mb & M24);
+	hi = (lo >> 24) + ma * (mb >> 24);
+	lo = (hi & 0xffff) << 24 | (lo & M24);
+	hi >>= 16;
+	if (neg) {
+		hi = (~hi + !lo) & M40;
+		lo = -lo & M40;
+	}
+
+	acc.ml = hi >> 24;
+	if (neg)
+		acc.ml |= 0x30000;
+	acc.mr = hi & M24;
+	accex.ml = lo >> 24;
+	accex.mr = lo & M24;
+
+	rnd_rq = lo != 0;
+
+	return E_SUCCESS;
+}
+
+int
+b6div64()
+{
+#ifdef DIV_NATIVE
+	int             neg, o, e, bias, halve;
+	uint64_t        na, nb;
+	int64_t         n, d, q, bit;
+
+	accex.o = accex.ml = accex.mr = 0;
+	neg = NEGATIVE(acc) != NEGATIVE(enreg);
+	if (NEGATIVE(acc))
+		NEGATE(acc);
+	if (NEGATIVE(enreg))
+		NEGATE(enreg);
+	if ((enreg.ml & 0x8000) == 0)
+		return E_ZERODIV;
+	na = (uint64_t) acc.ml << 24 | acc.mr;
+	if (!na) {
+qzero:
+		acc = zeroword;
+		return E_SUCCESS;
+	}
+	bias = CLZ64(na) - 24;
+	na <<= bias;
+	nb = (uint64_t) enreg.ml << 24 | enreg.mr;
+
+	/*
+	 * nrdiv() on integers scaled by 2^41: the same 40 steps,
+	 * the same digits, no trips through libm.
+	 */
+	halve = na >= nb;
+	n = halve ? na : na << 1;
+	d = nb << 1;
+	q = 0;
+	for (bit = 1LL << 39; bit && n; bit >>= 1) {
+		if (n < (1LL << 39) && n > -(1LL << 39))
+			n *= 2;
+		else if (n < 0) {
+			q -= bit;
+			n = 2 * n + d;
+		} else {
+			q += bit;
+			n = 2 * n - d;
+		}
+	}
+	e = 63 - CLZ64(q);
+
+	o = acc.o - bias - enreg.o + halve + e + 25;
+	if (o < 0)
+		goto qzero;
+	acc.o = o & 0x7f;
+	q <<= 39 - e;
+	acc.ml = q >> 24;
+	acc.mr = q & M24;
+	if (neg)
+		NEGATE(acc);
+	if ((o > 0x7f) && !dis_exc)
+		return E_OVFL;
+	return E_SUCCESS;
+#else
+	return b6div();
+#endif
+}
+
+int
+asx64()
+{
+	uint64_t        a, x = 0;
+	int             i;
+
+	accex.l = accex.r = 0;
+	if (!(i = enreg.o - 64))
+		return E_SUCCESS;
+	a = (uint64_t) acc.l << 24 | acc.r;
+	if (i > 0) {
+		if (i < 48) {
+			x = (a << (48 - i)) & M48;
+			a >>= i;
+		} else {
+			if (i < 96)
+				x = a >> (i - 48);
+			a = 0;
+		}
+	} else {
+		i = -i;
+		if (i < 48) {
+			x = a >> (48 - i);
+			a = (a << i) & M48;
+		} else {
+			if (i < 96)
+				x = (a << (i - 48)) & M48;
+			a = 0;
+		}
+	}
+	acc.l = a >> 24;
+	acc.r = a & M24;
+	accex.l = x >> 24;
+	accex.r = x & M24;
+
+	return E_SUCCESS;
+}
+
+/*
+ * Same as norm(): one count of leading zeros over the 80-bit
+ * accumulator:extension finds the shift, then the halves are moved
+ * exactly as the bit loops there would leave them.
+ */
+int
+norm64()
+{
+	uint            rr = 0;
+	int             s, cnt;
+	uint64_t        x, y;
+
+	switch ((acc.ml >> 16) & 3) {
+	case 2:
+	case 1:
+		rnd_rq |= acc.mr & 1;
+		accex.mr = (accex.mr >> 1) | (accex.ml << 23);
+		accex.ml = (accex.ml >> 1) | (acc.mr << 15);
+		acc.mr = (acc.mr >> 1) | (acc.ml << 23);
+		acc.ml >>= 1;
+		++acc.o;
+		goto chk_rnd;
+	}
+
+	if (dis_norm)
+		goto chk_rnd;
+	switch ((acc.ml >> 15) & 3) {
+	case 0:
+		x = (uint64_t) (acc.ml & 0xffff) << 24 | acc.mr;
+		y = (uint64_t) (accex.ml & 0xffff) << 24 | accex.mr;
+		s = x ? CLZ64(x) - 24 : y ? CLZ64(y) + 16 : 80;
+		if (s < 16) {
+			cnt = s;
+			acc.ml = ((acc.ml << cnt) & 0xffff) |
+					(acc.mr >> (24 - cnt));
+			acc.mr = (acc.mr << cnt) |
+					(rr = accex.ml >> (16 - cnt));
+			accex.ml = (accex.ml << cnt) |
+					(accex.mr >> (24 - cnt));
+			accex.mr <<= cnt;
+		} else if (s < 24) {
+			cnt = s - 16;
+			acc.ml = acc.mr >> (8 - cnt);
+			acc.mr = (acc.mr << s) | (accex.ml << cnt) |
+					(accex.mr >> (24 - cnt));
+			accex.mr <<= s;
+			rr = acc.r & ((1l << s) - 1);
+		} else if (s < 40) {
+			cnt = s - 24;
+			acc.ml = ((acc.mr << cnt) & 0xffff) |
+					(accex.ml >> (16 - cnt));
+			acc.mr = (accex.ml << (8 + cnt)) |
+					(accex.mr >> (16 - cnt));
+			accex.ml = accex.mr << cnt;
+			accex.mr = 0;
+			rr = (acc.ml & ((1 << cnt) - 1)) | acc.mr;
+		} else if (s < 80) {
+			rr = accex.ml | accex.mr;
+			if (s < 56) {
+				cnt = s - 40;
+				acc.ml = ((accex.ml << cnt) & 0xffff) |
+						(accex.mr >> (24 - cnt));
+				acc.mr = accex.mr << cnt;
+			} else if (s < 64) {
+				cnt = s - 56;
+				acc.ml = accex.mr >> (8 - cnt);
+				acc.mr = accex.mr << (16 + cnt);
+			} else {
+				acc.ml = (accex.mr << (s - 64)) & 0xffff;
+				acc.mr = 0;
+			}
+			accex.ml = accex.mr = 0;
+		} else
+			goto zero;
+		acc.o -= s;
+		break;
+	case 3:
+		x = (uint64_t) (~acc.ml & 0xffff) << 24 | (~acc.mr & M24);
+		y = (uint64_t) (~accex.ml & 0xffff) << 24 | (~accex.mr & M24);
+		s = x ? CLZ64(x) - 24 : y ? CLZ64(y) + 16 : 80;
+		if (s < 16) {
+			cnt = s;
+			acc.ml = 0x10000 | ((acc.ml << cnt) & 0xffff) |
+					(acc.mr >> (24 - cnt));
+			acc.mr = (acc.mr << cnt) |
+					(rr = accex.ml >> (16 - cnt));
+			accex.ml = ((accex.ml << cnt) |
+					(accex.mr >> (24 - cnt))) & 0xffff;
+			accex.mr <<= cnt;
+		} else if (s < 24) {
+			cnt = s - 16;
+			acc.ml = 0x10000 | (acc.mr >> (8 - cnt));
+			acc.mr = (acc.mr << s) | (accex.ml << cnt) |
+					(accex.mr >> (24 - cnt));
+			accex.ml = ((accex.ml << s) |
+					(accex.mr >> (8 - cnt))) & 0xffff;
+			accex.mr <<= s;
+			rr = acc.r & ((1l << s) - 1);
+		} else if (s < 40) {
+			cnt = s - 24;
+			acc.ml = 0x10000 | ((acc.mr << cnt) & 0xffff) |
+					(accex.ml >> (16 - cnt));
+			acc.mr = (accex.ml << (8 + cnt)) |
+					(accex.mr >> (16 - cnt));
+			accex.ml = (accex.mr << cnt) & 0xffff;
+			accex.mr = 0;
+			rr = (acc.ml & ((1 << cnt) - 1)) | acc.mr;
+		} else if (s < 80) {
+			rr = accex.ml | accex.mr;
+			if (s < 56) {
+				cnt = s - 40;
+				acc.ml = 0x10000 | ((accex.ml << cnt) & 0xffff) |
+						(accex.mr >> (24 - cnt));
+				acc.mr = accex.mr << cnt;
+			} else if (s < 64) {
+				cnt = s - 56;
+				acc.ml = 0x10000 | (accex.mr >> (8 - cnt));
+				acc.mr = accex.mr << (16 + cnt);
+			} else {
+				acc.ml = 0x10000 |
+					((accex.mr << (s - 64)) & 0xffff);
+				acc.mr = 0;
+			}
+			accex.ml = accex.mr = 0;
+		} else {
+			rr = 1;
+			acc.ml = 0x10000;
+			acc.mr = accex.ml = accex.mr = 0;
+		}
+		acc.o -= s;
+		break;
+	}
+	rnd_rq = rnd_rq && !rr;
+chk_rnd:
+	if (acc.o & 0x8000)
+		goto zero;
+	if (acc.o & 0x80) {
+		acc.o = 0;
+		if (!dis_exc)
+			return E_OVFL;
+	}
+	if (!dis_round && rnd_rq)
+		acc.mr |= 1;
+
+	if (!acc.ml && !acc.mr && !dis_norm) {
+zero:
+		acc.l = acc.r = accex.l = accex.r = 0;
+		return E_SUCCESS;
+	}
+	acc.l = ((uint) (acc.o & 0x7f) << 17) | (acc.ml & 0x1ffff);
+	acc.r = acc.mr & 0xffffff;
+
+	accex.l = ((uint) (accex.o & 0x7f) << 17) | (accex.ml & 0x1ffff);
+	accex.r = accex.mr & 0xffffff;
+	return E_SUCCESS;
+}
+
+/*
+ * Cross-check of the 64-bit core against the original routines.
+ */
+enum { A_ADD, A_SUB, A_RSUB, A_ASUB, A_MUL, A_DIV, A_EPX, A_EMX, A_ASX,
+	A_NOPS };
+
+static char *alu_name[A_NOPS] = {
+	"a+x", "a-x", "x-a", "amx", "a*x", "a/x", "e+x", "e-x", "asx",
+};
+
+static uint64_t alu_seed = 0x2545f4914f6cdd1dULL;
+
+static uint64_t
+alu_rand()
+{
+	alu_seed ^= alu_seed << 13;
+	alu_seed ^= alu_seed >> 7;
+	alu_seed ^= alu_seed << 17;
+	return alu_seed;
+}
+
+/*
+ * A random word; more often than not one that exercises the
+ * alignment and normalization paths: close to another word,
+ * nearly cancelling it, or with a long run of sign bits.
+ */
+static uint64_t
+alu_word(uint64_t other)
+{
+	uint64_t        w = alu_rand(), r = alu_rand();
+	int64_t         m;
+
+	switch (r & 7) {
+	case 0:
+		/* same value, a few low bits differ */
+		return (other ^ (w & ((1ULL << (r >> 3) % 42) - 1))) & M48;
+	case 1:
+		/* about minus the other one */
+		m = -(int64_t) (other & 0x1ffffffffffULL) + (int64_t) (w & 0xff) - 0x80;
+		return (other & ~0x1ffffffffffULL & M48) | (m & 0x1ffffffffffULL);
+	case 2:
+		/* exponent nearby */
+		return ((other + (((r >> 3) % 9 - 4) << 41)) & (M48 & ~0x1ffffffffffULL)) |
+			(w & 0x1ffffffffffULL);
+	case 3:
+	case 4:
+		/* long run of sign bits */
+		m = (int64_t) (w << 23) >> (23 + (r >> 3) % 42);
+		return (r >> 16 & 0x7f) << 41 | (m & 0x1ffffffffffULL);
+	default:
+		return w & M48;
+	}
+}
+
+#define ALU_SAME(a,b)   ((a).l == (b).l && (a).r == (b).r && \
+			(a).o == (b).o && (a).ml == (b).ml)
+
+static int
+alu_run(int k, int fast)
+{
+	int     err;
+
+	if (k == A_ASX) {
+		UNPCK(enreg);
+		return fast ? asx64() : asx();
+	}
+	accex = zeroword;
+	UNPCK(enreg);
+	UNPCK(acc);
+	switch (k) {
+	case A_SUB:
+		NEGATE(enreg);
+		break;
+	case A_RSUB:
+		NEGATE(acc);
+		break;
+	case A_ASUB:
+		if (NEGATIVE(acc))
+			NEGATE(acc);
+		if (!NEGATIVE(enreg))
+			NEGATE(enreg);
+		break;
+	}
+	switch (k) {
+	case A_MUL:
+		err = fast ? mul64() : mul();
+		break;
+	case A_DIV:
+		err = fast ? b6div64() : b6div();
+		break;
+	case A_EPX:
+		err = epx();
+		break;
+	case A_EMX:
+		err = emx();
+		break;
+	default:
+		err = fast ? add64() : add();
+		break;
+	}
+	if (!err)
+		err = fast ? norm64() : norm();
+	return err;
+}
+
+/*
+ * Run n random operations through both implementations and
+ * report the differences.  Returns nonzero if there were any.
+ */
+int
+alu_check(unsigned long n)
+{
+	alureg_t        a0, e0, a1, x1, e1;
+	uint64_t        w;
+	uchar           r0, r1, sexc = dis_exc, sround = dis_round,
+			snorm = dis_norm;
+	int             k, err1, err2;
+	unsigned long   t, nbad = 0, nops[A_NOPS] = { 0 },
+			nerr[A_NOPS] = { 0 };
+
+	for (t = 0; t < n; ++t) {
+		k = alu_rand() % A_NOPS;
+		w = alu_word(alu_rand() & M48);
+		a0 = e0 = zeroword;
+		a0.l = w >> 24;
+		a0.r = w & M24;
+		w = alu_word(w);
+		e0.l = w >> 24;
+		e0.r = w & M24;
+		w = alu_rand();
+		dis_exc = (w & 7) == 0;
+		dis_round = (w & 070) == 0;
+		dis_norm = (w & 0700) == 0;
+		r0 = (w & 07000) == 0;
+
+		acc = a0;
+		enreg = e0;
+		accex = zeroword;
+		rnd_rq = r0;
+		err1 = alu_run(k, 0);
+		a1 = acc;
+		x1 = accex;
+		e1 = enreg;
+		r1 = rnd_rq;
+
+		acc = a0;
+		enreg = e0;
+		accex = zeroword;
+		rnd_rq = r0;
+		err2 = alu_run(k, 1);
+
+		++nops[k];
+		if (err1 == err2 && r1 == rnd_rq && ALU_SAME(a1, acc) &&
+		    ALU_SAME(x1, accex) && ALU_SAME(e1, enreg))
+			continue;
+		++nerr[k];
+		if (nbad++ < 20)
+			printf("%s %08o%08o %08o%08o mode %o%o%o%o: "
+				"%08o%08o/%08o%08o e%d, 64-bit %08o%08o/%08o%08o e%d\n",
+				alu_name[k], a0.l, a0.r, e0.l, e0.r,
+				dis_exc, dis_round, dis_norm, r0,
+				a1.l, a1.r, x1.l, x1.r, err1,
+				acc.l, acc.r, accex.l, accex.r, err2);
+	}
+	dis_exc = sexc;
+	dis_round = sround;
+	dis_norm = snorm;
+	acc = accex = enreg = zeroword;
+	rnd_rq = 0;
+
+	for (k = 0; k < A_NOPS; ++k)
+		printf("%s: %lu checked, %lu mismatches\n",
+			alu_name[k], nops[k], nerr[k]);
+	printf("total: %lu checked, %lu mismatches\n", n, nbad);
+	return nbad != 0;
+}
+#endif /* FAST_ALU */
@@ -0,0 +1,523 @@
+/*
+ * BESM-6 emulator, batch runner.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this program and/or modify it under the terms of
+ * the GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "COPYING" for more details.
+ */
+/* Usage:
+ *	dispak-batch [options...] task-file-or-directory...
+ *
+ * Runs every task given, and every *.b6 file of every directory given,
+ * on a machine of its own, several at a time.  The printing of a task
+ * goes to a file named after it, its punched cards, if any, to another;
+ * a line per task with the way it ended is printed once all are done.
+ * Tasks of the same name, from different directories or given twice,
+ * are told apart by a number: x, x-2, x-3 and so on.
+ *
+ * Options:
+ *	-j N, --jobs=N
+ *		run N tasks at a time (default: the number of processors)
+ *	-d dir, --output-dir=dir
+ *		put the printing and the cards in dir (default: .)
+ *	--suffix=str
+ *		name the printing file <task>str (default: .txt)
+ *	-x, --native
+ *		use native extracode E64
+ *	--path=dir1:dir2...
+ *		specify search path for disk images
+ *	--bootstrap
+ *		run in user mode only, without disk 2099
+ *	--budget=N
+ *		stop a task after N instructions
+ */
+#include <sys/stat.h>
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <getopt.h>
+#include "defs.h"
+#include "libdispak.h"
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+typedef struct {
+	char            *j_file;        /* task passport                */
+	char            *j_name;        /* file name without .b6        */
+	int             j_status;
+	unsigned long   j_count;        /* instructions run             */
+	double          j_sec;
+	char            *j_err;         /* why the task did not run     */
+} job_t;
+
+/*
+ * The jobs are dealt out to the workers in turn, each keeping its share
+ * in a queue of its own.  A worker takes from the head of its queue;
+ * once it is empty, it steals from the tail of the longest queue left,
+ * so that a few long tasks do not hold up the rest of the batch.
+ */
+typedef struct {
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_t q_lock;
+#endif
+	int             *q_job;
+	int             q_head, q_tail;
+} queue_t;
+
+static job_t    *jobs;
+static int      njobs;
+static queue_t  *queues;
+static int      nworkers;
+static char     *outdir = ".";
+static char     *suffix = ".txt";
+static unsigned long budget;
+
+enum {
+	OPT_PATH,
+	OPT_BOOTSTRAP,
+	OPT_BUDGET,
+	OPT_SUFFIX,
+};
+
+/* Table of options. */
+static struct option longopts[] = {
+	/* option	     has arg		integer code */
+	{ "help",		0,	0,	'h'		},
+	{ "version",		0,	0,	'V'		},
+	{ "jobs",		1,	0,	'j'		},
+	{ "output-dir",		1,	0,	'd'		},
+	{ "suffix",		1,	0,	OPT_SUFFIX	},
+	{ "native",		0,	0,	'x'		},
+	{ "path",		1,	0,	OPT_PATH	},
+	{ "bootstrap",		0,	0,	OPT_BOOTSTRAP	},
+	{ "budget",		1,	0,	OPT_BUDGET	},
+	{ 0,			0,	0,	0		},
+};
+
+static void
+usage ()
+{
+	fprintf (stderr, _("%s version %s, Copyright 1967-1987 USSR\n"),
+		PACKAGE_NAME, PACKAGE_VERSION);
+	fprintf (stderr, _("This is free software, covered by the GNU General Public License.\n"));
+	fprintf (stderr, "\n");
+	fprintf (stderr, _("Runs BESM-6 tasks side by side, each on a machine of its own.\n"));
+	fprintf (stderr, _("Usage:\n"));
+	fprintf (stderr, _("  dispak-batch [options] <task-file-or-dir>...\n"));
+	fprintf (stderr, _("Options:\n"));
+	fprintf (stderr, _("  -j N, --jobs=N         run N tasks at a time (default: all processors)\n"));
+	fprintf (stderr, _("  -d dir, --output-dir=dir  write the printing and the cards to dir\n"));
+	fprintf (stderr, _("  --suffix=str           name the printing <task>str (default .txt)\n"));
+	fprintf (stderr, _("  -x, --native           use native extracode E64\n"));
+	fprintf (stderr, _("  --path=dir1:dir2...    specify search path for disk images\n"));
+	fprintf (stderr, _("  --bootstrap            run without the supervisor from disk 2099\n"));
+	fprintf (stderr, _("  --budget=N             stop a task after N instructions\n"));
+
+	fprintf (stderr, _("\nReport bugs to %s\n"), PACKAGE_BUGREPORT);
+	exit (1);
+}
+
+static void
+add_job(char *file)
+{
+	static int      size;
+	char            *p;
+
+	if (njobs == size) {
+		size = size ? size * 2 : 64;
+		jobs = realloc(jobs, size * sizeof(job_t));
+		if (! jobs) {
+			perror("dispak-batch");
+			exit(1);
+		}
+	}
+	memset(&jobs[njobs], 0, sizeof(job_t));
+	jobs[njobs].j_file = file;
+	p = strrchr(file, '/');
+	jobs[njobs].j_name = strdup(p ? p + 1 : file);
+	p = strrchr(jobs[njobs].j_name, '.');
+	if (p && ! strcmp(p, ".b6"))
+		*p = 0;
+	++njobs;
+}
+
+/*
+ * Renames the jobs whose name an earlier job already has, so that no
+ * two of them write the same output files.
+ */
+static void
+unique_names(void)
+{
+	int             i, k, n;
+	char            *name;
+
+	for (i = 1; i < njobs; ++i) {
+		for (n = 1, k = 0; k < i; ++k) {
+			if (strcmp(jobs[i].j_name, jobs[k].j_name))
+				continue;
+			/* taken: try the next number, from the start */
+			name = malloc(strlen(jobs[i].j_file) + 16);
+			if (! name) {
+				perror("dispak-batch");
+				exit(1);
+			}
+			strcpy(name, jobs[i].j_name);
+			if (n > 1)
+				*strrchr(name, '-') = 0;
+			sprintf(name + strlen(name), "-%d", ++n);
+			free(jobs[i].j_name);
+			jobs[i].j_name = name;
+			k = -1;
+		}
+	}
+}
+
+static int
+namecmp(const void *a, const void *b)
+{
+	return strcmp(*(char **) a, *(char **) b);
+}
+
+/* adds the *.b6 files of the directory, in the order of their names */
+static void
+add_dir(char *dir)
+{
+	DIR             *d;
+	struct dirent   *e;
+	char            **names = 0;
+	int             n = 0, size = 0, len, i;
+
+	d = opendir(dir);
+	if (! d) {
+		perror(dir);
+		exit(1);
+	}
+	while ((e = readdir(d))) {
+		len = strlen(e->d_name);
+		if (len <= 3 || strcmp(e->d_name + len - 3, ".b6"))
+			continue;
+		if (n == size) {
+			size = size ? size * 2 : 64;
+			names = realloc(names, size * sizeof(char *));
+		}
+		if (! names || ! (names[n] = malloc(strlen(dir) + len + 2))) {
+			perror("dispak-batch");
+			exit(1);
+		}
+		sprintf(names[n++], "%s/%s", dir, e->d_name);
+	}
+	closedir(d);
+	qsort(names, n, sizeof(char *), namecmp);
+	for (i = 0; i < n; ++i)
+		add_job(names[i]);
+	free(names);
+}
+
+static char *
+slurp(char *file, size_t *len)
+{
+	FILE            *fp;
+	char            *buf;
+	struct stat     st;
+
+	fp = fopen(file, "r");
+	if (! fp)
+		return 0;
+	if (fstat(fileno(fp), &st) < 0 || ! (buf = malloc(st.st_size + 1))) {
+		fclose(fp);
+		return 0;
+	}
+	*len = fread(buf, 1, st.st_size, fp);
+	fclose(fp);
+	return buf;
+}
+
+static void
+to_file(void *arg, const char *data, size_t len)
+{
+	fwrite(data, 1, len, (FILE *) arg);
+}
+
+static char *
+out_name(job_t *j, char *sfx)
+{
+	char            *name;
+
+	name = malloc(strlen(outdir) + strlen(j->j_name) + strlen(sfx) + 2);
+	if (name)
+		sprintf(name, "%s/%s%s", outdir, j->j_name, sfx);
+	return name;
+}
+
+static void
+run_job(job_t *j)
+{
+	dispak_t        *m;
+	char            *task, *name;
+	const char      *cards;
+	size_t          len;
+	FILE            *fp, *cp;
+	struct timeval  t0, t1;
+
+	j->j_status = DISPAK_FAILED;
+	task = slurp(j->j_file, &len);
+	if (! task) {
+		j->j_err = strdup(strerror(errno));
+		return;
+	}
+	name = out_name(j, suffix);
+	fp = name ? fopen(name, "w") : 0;
+	if (! fp) {
+		j->j_err = strdup(strerror(errno));
+		free(task);
+		free(name);
+		return;
+	}
+	m = dispak_new();
+	if (! m || dispak_submit(m, task, len) < 0)
+		j->j_err = strdup(strerror(errno));
+	else {
+		dispak_printer(m, to_file, fp);
+		gettimeofday(&t0, NULL);
+		j->j_status = dispak_run(m, budget);
+		gettimeofday(&t1, NULL);
+		j->j_sec = TIMEDIFF(t0, t1);
+		j->j_count = dispak_count(m);
+
+		cards = dispak_punching(m, &len);
+		if (len) {
+			free(name);
+			name = out_name(j, ".pch");
+			cp = name ? fopen(name, "w") : 0;
+			if (! cp)
+				j->j_err = strdup(strerror(errno));
+			else {
+				fwrite(cards, 1, len, cp);
+				fclose(cp);
+			}
+		}
+	}
+	dispak_free(m);
+	free(task);
+	free(name);
+	fclose(fp);
+}
+
+#ifdef HAVE_LIBPTHREAD
+#define QLOCK(q)        pthread_mutex_lock(&(q)->q_lock)
+#define QUNLOCK(q)      pthread_mutex_unlock(&(q)->q_lock)
+#else
+#define QLOCK(q)
+#define QUNLOCK(q)
+#endif
+
+static int
+take(int w)
+{
+	queue_t         *q = &queues[w];
+	int             i = -1;
+
+	QLOCK(q);
+	if (q->q_head < q->q_tail)
+		i = q->q_job[q->q_head++];
+	QUNLOCK(q);
+	return i;
+}
+
+static int
+steal(void)
+{
+	queue_t         *q;
+	int             w, n, victim, most, i = -1;
+
+	do {
+		victim = -1;
+		most = 0;
+		for (w = 0; w < nworkers; ++w) {
+			q = &queues[w];
+			QLOCK(q);
+			n = q->q_tail - q->q_head;
+			QUNLOCK(q);
+			if (n > most) {
+				most = n;
+				victim = w;
+			}
+		}
+		if (victim < 0)
+			return -1;
+		/* it may have been emptied since: look again */
+		q = &queues[victim];
+		QLOCK(q);
+		if (q->q_head < q->q_tail)
+			i = q->q_job[--q->q_tail];
+		QUNLOCK(q);
+	} while (i < 0);
+	return i;
+}
+
+static void *
+worker(void *arg)
+{
+	int             w = (long) arg;
+	int             i;
+
+	while ((i = take(w)) >= 0 || (i = steal()) >= 0)
+		run_job(&jobs[i]);
+	return 0;
+}
+
+static void
+run_all(void)
+{
+	int             w, i;
+#ifdef HAVE_LIBPTHREAD
+	pthread_t       *t;
+#endif
+
+#ifndef HAVE_LIBPTHREAD
+	/* no threads: the process has a single machine at a time */
+	nworkers = 1;
+#endif
+	if (nworkers > njobs)
+		nworkers = njobs;
+	queues = calloc(nworkers, sizeof(queue_t));
+	if (! queues) {
+		perror("dispak-batch");
+		exit(1);
+	}
+	for (w = 0; w < nworkers; ++w) {
+		queues[w].q_job = malloc((njobs / nworkers + 1) * sizeof(int));
+		if (! queues[w].q_job) {
+			perror("dispak-batch");
+			exit(1);
+		}
+#ifdef HAVE_LIBPTHREAD
+		pthread_mutex_init(&queues[w].q_lock, 0);
+#endif
+	}
+	for (i = 0; i < njobs; ++i) {
+		w = i % nworkers;
+		queues[w].q_job[queues[w].q_tail++] = i;
+	}
+#ifdef HAVE_LIBPTHREAD
+	t = malloc(nworkers * sizeof(pthread_t));
+	if (! t) {
+		perror("dispak-batch");
+		exit(1);
+	}
+	for (w = 0; w < nworkers; ++w)
+		if (pthread_create(&t[w], 0, worker, (void *) (long) w) != 0) {
+			perror("dispak-batch");
+			exit(1);
+		}
+	for (w = 0; w < nworkers; ++w)
+		pthread_join(t[w], 0);
+	free(t);
+#else
+	worker(0);
+#endif
+}
+
+/*
+ * Prints a line per task: how it ended, the instructions run, and the
+ * time taken.  Returns the number of tasks that did not end normally.
+ */
+static int
+summary(void)
+{
+	job_t           *j;
+	int             failed = 0;
+
+	for (j = jobs; j < jobs + njobs; ++j) {
+		printf("%-24s %3d %12lu %8.2f ", j->j_name, j->j_status,
+			j->j_count, j->j_sec);
+		printf("%s\n", j->j_err ? j->j_err :
+			dispak_message(j->j_status));
+		if (j->j_status != DISPAK_END || j->j_err)
+			++failed;
+	}
+	printf(_("%d tasks, %d failed\n"), njobs, failed);
+	return failed;
+}
+
+int
+main(int argc, char **argv)
+{
+	int             i;
+	struct stat     st;
+
+	/* Set locale and message catalogs. */
+	setlocale (LC_ALL, "");
+	bindtextdomain (PACKAGE_NAME, "/usr/local/share/locale");
+	textdomain (PACKAGE_NAME);
+
+	nworkers = sysconf(_SC_NPROCESSORS_ONLN);
+	for (;;) {
+		i = getopt_long (argc, argv, "hVj:d:x", longopts, 0);
+		if (i < 0)
+			break;
+		switch (i) {
+		case 'h':
+			usage ();
+			break;
+		case 'V':
+			printf ("Version: %s\n", PACKAGE_VERSION);
+			return 0;
+		case 'j':		/* tasks at a time */
+			nworkers = strtol (optarg, 0, 0);
+			break;
+		case 'd':		/* where the output goes */
+			outdir = optarg;
+			break;
+		case OPT_SUFFIX:	/* of the printing files */
+			suffix = optarg;
+			break;
+		case 'x':		/* native xcodes */
+			dispak_native (1);
+			break;
+		case OPT_PATH:		/* set disk search path */
+			dispak_path (optarg);
+			break;
+		case OPT_BOOTSTRAP:	/* no supervisor */
+			dispak_bootstrap (1);
+			break;
+		case OPT_BUDGET:	/* instructions per task */
+			budget = strtoul (optarg, 0, 0);
+			break;
+		default:
+			usage ();
+		}
+	}
+	if (optind >= argc)
+		usage ();
+	if (nworkers < 1)
+		nworkers = 1;
+
+	for (i = optind; i < argc; ++i) {
+		if (stat (argv[i], &st) < 0) {
+			perror (argv[i]);
+			exit (1);
+		}
+		if (S_ISDIR (st.st_mode))
+			add_dir (argv[i]);
+		else
+			add_job (argv[i]);
+	}
+	if (! njobs) {
+		fprintf (stderr, _("dispak-batch: no tasks\n"));
+		exit (1);
+	}
+
+	unique_names ();
+	run_all ();
+	return summary () ? 1 : 0;
+}
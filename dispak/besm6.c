@@ -78,7 +78,7 @@ static struct   {
 };
 
 char		*punchfile = NULL;
-ulong           icnt;
+__thread ulong  icnt;
 
 static char     *pout_raw = NULL;
 static FILE	*input_fd;
@@ -212,6 +212,8 @@ main(int argc, char **argv)
 	setlocale (LC_ALL, "");
 	bindtextdomain (PACKAGE_NAME, "/usr/local/share/locale");
 	textdomain (PACKAGE_NAME);
+	if (core_map(-1) < 0)
+		exit(1);
 
 	for (;;) {
 		i = getopt_long (argc, argv, "hVlbvtspqxo:c:", longopts, 0);
@@ -320,7 +322,7 @@ main(int argc, char **argv)
 			perror(ifile);
 			exit(1);
 		}
-		i = vsinput(cget, diag, 1);
+		i = vsinput(cget, diag, 1, 1);
 		if (i < 0)
 			exit(1);
 		fclose (input_fd);
@@ -397,7 +399,7 @@ catchsig (int sig)
 		longjmp (top, 1);
 }
 
-static struct timeval   stopped;
+static __thread struct timeval stopped;
 
 void
 stopwatch(void)
@@ -0,0 +1,333 @@
+/*
+ * BESM-6 emulator, test of libdispak against the dispak command.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this program and/or modify it under the terms of
+ * the GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "COPYING" for more details.
+ */
+/* Usage:
+ *	check-libdispak [--bootstrap] [task-file...]
+ *
+ * Runs each task through dispak_run() and through ./dispak, and checks
+ * that the printing is the same; then runs all of them again at once,
+ * each on a thread of its own, and checks it once more.  Without task
+ * files, the tasks are the batch examples of the source tree.  The
+ * disks are looked for in $BESM6_PATH, else in its disks directory.
+ * Exits with 77, for a skipped test, if there is no disk 2053 or 2099
+ * there (the supervisor is not needed with --bootstrap).  A task that
+ * prints nothing through ./dispak fails, as it tests nothing.  With
+ * the blocks translated into machine code, the bootstrap tasks of
+ * jit_tasks are also run with and without that, and must print the
+ * same.
+ */
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "defs.h"
+#include "libdispak.h"
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+typedef struct {
+	char            *t_file;
+	char            *t_text;        /* the passport                 */
+	size_t          t_len;
+	char            *t_want;        /* the printing of ./dispak     */
+	size_t          t_wantlen;
+	int             t_bad;
+} task_t;
+
+static task_t   *tasks;
+static int      ntasks;
+static char     *path;
+static int      bootstrap_only;
+
+static char *
+slurp(FILE *fp, size_t *len)
+{
+	char            *buf = 0;
+	size_t          size = 0, n;
+
+	*len = 0;
+	do {
+		if (*len == size) {
+			size = size ? size * 2 : 65536;
+			if (! (buf = realloc(buf, size))) {
+				perror("check-libdispak");
+				exit(1);
+			}
+		}
+		n = fread(buf + *len, 1, size - *len, fp);
+		*len += n;
+	} while (n > 0);
+	return buf;
+}
+
+static void
+read_task(task_t *t, char *file)
+{
+	FILE            *fp;
+
+	if (! (fp = fopen(file, "r"))) {
+		perror(file);
+		exit(1);
+	}
+	memset(t, 0, sizeof(*t));
+	t->t_file = file;
+	t->t_text = slurp(fp, &t->t_len);
+	fclose(fp);
+}
+
+static void
+add_task(char *file)
+{
+	tasks = realloc(tasks, (ntasks + 1) * sizeof(task_t));
+	if (! tasks) {
+		perror(file);
+		exit(1);
+	}
+	read_task(&tasks[ntasks++], file);
+}
+
+/* the batch tasks of examples/Makefile, which need no terminal */
+static char *examples[] = {
+	"algol-besm6.b6", "algol-gdr.b6", "autocode-itm.b6", "bemsh-auto.b6",
+	"bemsh.b6", "dtran.b6", "forex.b6", "fortran-dubna.b6",
+	"fortran-gdr.b6", "madlen.b6", "monitor80.b6", "pascal.b6",
+	"pascal-pretty.b6", "punchtest.b6", "whetstone.b6", 0,
+};
+
+#ifdef JIT
+/* bootstrap tasks the translated blocks once ran otherwise than run() */
+static char *jit_tasks[] = {
+	"check-jit-utc.b6", 0,
+};
+
+#define JIT_BUDGET      1000000         /* instructions, for a block gone astray */
+#endif
+
+/* the printing of the task by the dispak command */
+static void
+run_command(task_t *t)
+{
+	static char     fmt[] = "%s%s --path='%s' --input-encoding=utf8 '%s' </dev/null 2>/dev/null";
+	char            *cmd, *dispak, *boot;
+	FILE            *fp;
+	int             n;
+
+	dispak = getenv("DISPAK");
+	if (! dispak)
+		dispak = "./dispak";
+	boot = bootstrap_only ? " --bootstrap" : "";
+	n = snprintf(0, 0, fmt, dispak, boot, path, t->t_file);
+	cmd = malloc(n + 1);
+	if (! cmd) {
+		perror("check-libdispak");
+		exit(1);
+	}
+	sprintf(cmd, fmt, dispak, boot, path, t->t_file);
+	fp = popen(cmd, "r");
+	if (! fp) {
+		perror(cmd);
+		exit(1);
+	}
+	t->t_want = slurp(fp, &t->t_wantlen);
+	pclose(fp);
+	free(cmd);
+}
+
+/* runs the task through the library and compares the printing */
+static void *
+run_library(void *arg)
+{
+	task_t          *t = arg;
+	dispak_t        *m;
+	const char      *out;
+	size_t          len;
+
+	m = dispak_new();
+	if (! m || dispak_submit(m, t->t_text, t->t_len) < 0) {
+		perror(t->t_file);
+		t->t_bad = 1;
+		dispak_free(m);
+		return 0;
+	}
+	dispak_run(m, 0);
+	out = dispak_printing(m, &len);
+	t->t_bad = ! t->t_wantlen || len != t->t_wantlen ||
+		memcmp(out, t->t_want, len) != 0;
+	dispak_free(m);
+	return 0;
+}
+
+/* whether the disk is there to be read */
+static int
+have_disk(int n)
+{
+	char            *name;
+	int             ok;
+
+	name = malloc(strlen(path) + 16);
+	if (! name) {
+		perror("check-libdispak");
+		exit(1);
+	}
+	sprintf(name, "%s/%d", path, n);
+	ok = access(name, R_OK) == 0;
+	free(name);
+	return ok;
+}
+
+#ifdef JIT
+/* the printing of the task through the library, within JIT_BUDGET */
+static char *
+run_budget(task_t *t, size_t *len)
+{
+	dispak_t        *m;
+	const char      *out;
+	char            *copy;
+
+	m = dispak_new();
+	if (! m || dispak_submit(m, t->t_text, t->t_len) < 0) {
+		perror(t->t_file);
+		exit(1);
+	}
+	dispak_run(m, JIT_BUDGET);
+	out = dispak_printing(m, len);
+	copy = malloc(*len + 1);
+	if (! copy) {
+		perror("check-libdispak");
+		exit(1);
+	}
+	memcpy(copy, out, *len);
+	dispak_free(m);
+	return copy;
+}
+
+/* runs the tasks of jit_tasks with hot blocks translated and without */
+static int
+check_jit(char *srcdir)
+{
+	task_t          t;
+	char            *name, *out, **e;
+	size_t          len;
+	int             failed = 0;
+
+	dispak_bootstrap(1);
+	for (e = jit_tasks; *e; ++e) {
+		name = malloc(strlen(srcdir) + strlen(*e) + 2);
+		sprintf(name, "%s/%s", srcdir, *e);
+		read_task(&t, name);
+		no_jit = 1;
+		t.t_want = run_budget(&t, &t.t_wantlen);
+		no_jit = 0;
+		out = run_budget(&t, &len);
+		if (! t.t_wantlen || len != t.t_wantlen ||
+		    memcmp(out, t.t_want, len) != 0) {
+			printf("translated: %s: %s\n", name, t.t_wantlen ?
+				"the printing differs" : "no printing");
+			++failed;
+		}
+		free(out);
+		free(t.t_want);
+		free(t.t_text);
+		free(name);
+	}
+	dispak_bootstrap(bootstrap_only);
+	return failed;
+}
+#endif
+
+static int
+report(char *how)
+{
+	int             i, failed = 0;
+
+	for (i = 0; i < ntasks; ++i) {
+		if (! tasks[i].t_bad)
+			continue;
+		printf("%s: %s: %s\n", how, tasks[i].t_file,
+			tasks[i].t_wantlen ? "the printing differs" :
+			"no printing from dispak");
+		++failed;
+	}
+	return failed;
+}
+
+int
+main(int argc, char **argv)
+{
+	char            *srcdir, *name, **e;
+	int             i, failed;
+#ifdef HAVE_LIBPTHREAD
+	pthread_t       *thr;
+#endif
+
+	srcdir = getenv("srcdir");
+	if (! srcdir)
+		srcdir = ".";
+	i = 1;
+	if (i < argc && ! strcmp(argv[i], "--bootstrap")) {
+		bootstrap_only = 1;
+		++i;
+	}
+	path = getenv("BESM6_PATH");
+	if (! path) {
+		path = malloc(strlen(srcdir) + 16);
+		sprintf(path, "%s/../disks", srcdir);
+	}
+	/* without 2053 there is nothing printed to compare */
+	if (! have_disk(2053) || (! bootstrap_only && ! have_disk(2099))) {
+		printf("check-libdispak: no disk %d in %s, skipped\n",
+			have_disk(2053) ? 2099 : 2053, path);
+		return 77;
+	}
+	dispak_path(path);
+	dispak_bootstrap(bootstrap_only);
+
+	if (i == argc)
+		for (e = examples; *e; ++e) {
+			name = malloc(strlen(srcdir) + strlen(*e) + 16);
+			sprintf(name, "%s/../examples/%s", srcdir, *e);
+			add_task(name);
+		}
+	for (; i < argc; ++i)
+		add_task(argv[i]);
+
+	for (i = 0; i < ntasks; ++i) {
+		run_command(&tasks[i]);
+		run_library(&tasks[i]);
+	}
+	failed = report("one at a time");
+
+#ifdef HAVE_LIBPTHREAD
+	thr = malloc(ntasks * sizeof(pthread_t));
+	if (! thr) {
+		perror("check-libdispak");
+		exit(1);
+	}
+	for (i = 0; i < ntasks; ++i)
+		if (pthread_create(&thr[i], 0, run_library, &tasks[i]) != 0) {
+			perror("check-libdispak");
+			exit(1);
+		}
+	for (i = 0; i < ntasks; ++i)
+		pthread_join(thr[i], 0);
+	free(thr);
+	failed += report("side by side");
+#endif
+#ifdef JIT
+	failed += check_jit(srcdir);
+#endif
+
+	printf("check-libdispak: %d tasks, %d mismatches\n", ntasks, failed);
+	return failed != 0;
+}
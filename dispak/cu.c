@@ -12,10 +12,15 @@
  * See the accompanying file "COPYING" for more details.
  */
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
 #define EXTERN                          /* to allocate common data      */
 #include "defs.h"
 #include "optab.h"
 #include "encoding.h"
+#include "disk.h"
 
 long aumodes[] = {
 	0,
@@ -24,22 +29,271 @@ long aumodes[] = {
 	0x010000,       /* AG */
 };
 
-extern ulong icnt;
+/*
+ * Instruction dispatch.  With THREADED_CODE every unpacked half-word
+ * carries the offset of its handler label from L_default inside the
+ * instruction loop, so the dispatch costs a single indirect jump; the
+ * instructions implemented in arith.c get labels of their own and are
+ * called directly.  An offset rather than the label address keeps
+ * uinstr_t at 8 bytes, and the shadow entry of a word at 24.
+ */
+#ifdef THREADED_CODE
+#define DISPATCH        goto *(&&L_default + ui.i_handler);
+#define CASE(l)         L_##l
+#define DEFAULT         L_default
+#define IMPL(f)         L_##f: GET_IMPL_OP; \
+			if ((err = f())) ABORT(err); BREAK;
+
+extern int      aax(), aex(), arx(), avx(), aox(), b6div(), mul(),
+		apx(), aux(), acx(), anx(), epx(), emx(), asx(), priv();
+
+static int      nohandlers[0120];
+static __thread int *dispatch = nohandlers; /* opcode -> handler offset */
+static __thread int dispatch_abs[0120]; /* same, register 0 in a block  */
+static __thread int dispatch_fuse[0120][0120]; /* opcode pairs -> fused */
+static __thread int (*fusing)[0120];    /* dispatch_fuse if run_fast    */
+static __thread int bound;              /* variant shadow[] is bound to */
+#else
+#define DISPATCH        switch (op.o_inline)
+#define CASE(l)         case l
+#define DEFAULT         default
+#endif
+#define BREAK           goto _break
+
+/*
+ * Basic block cache.  A block is a run of unpacked half-words from
+ * the left half of a word up to the first transfer of control (jump,
+ * extracode, stop or return), at most BLOCK_WORDS words long; its
+ * length is kept in the shadow entry of the word it starts at.
+ * Only entry points reached BLOCK_HOT times get a block, so code run
+ * once never pays for building one.
+ * While run() stays inside a cached block, the unpack, convolution
+ * and debugger checks are done once per word instead of once per
+ * half-word.  The instructions are read from shadow[] itself, next
+ * to the flags checked, so a word of a block costs one entry.
+ * With THREADED_CODE, the common memory instructions without an index
+ * register are bound to handlers that skip indexing, stack and trace
+ * handling, and a right half to the pair it makes with the left half
+ * of the next word.
+ * A write into the page of a covered word makes it stale, which
+ * sends run() back to the slow path; unpacking the word again to
+ * something else drops every block that covers it.
+ * With JIT, a block of user code that stays hot is translated into
+ * host code in turn, see jit.c.
+ */
+#define BLOCK_WORDS     32              /* longest block, in words      */
+#define BLOCK_HOT       8               /* entries before building one  */
+#define SAME_INSN(a, b) ((a).i_reg == (b).i_reg && \
+			 (a).i_opcode == (b).i_opcode && (a).i_addr == (b).i_addr)
+
+static void
+block_flush(pc)
+	ushort  pc;
+{
+	ushort          s = pc;
+	int             i;
+
+	for (i = 0; i < BLOCK_WORDS; ++i, --s) {
+		if ((shadow[s].s_blen + 1) / 2 > i) {
+			shadow[s].s_blen = 0;
+			shadow[s].s_heat = 0;
+#ifdef JIT
+			shadow[s].s_jit = 0;
+#endif
+		}
+		if (!ADDR(s))
+			break;
+	}
+	shadow[pc].s_flags &= ~C_BLOCK;
+}
+
+static int
+block_end(ip)
+	uinstr_t        *ip;
+{
+	switch (optab[ip->i_opcode].o_inline) {
+	case I_UJ:
+	case I_VJM:
+	case I_VZM:
+	case I_VLM:
+	case I_UZA:
+	case I_UIA:
+	case I_IRET:
+	case I_TRAP:
+	case I_STOP:
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Build the block starting at pcm, whose first word has already
+ * been checked and unpacked by run(); returns its length.
+ */
+static ushort
+block_build(pcm)
+	reg_t   pcm;
+{
+	unsigned        w = pcm, last;
+	int             n = 0;
+#ifdef THREADED_CODE
+	int             i;
+#endif
+
+	for (;;) {
+		++n;
+		if (block_end(&shadow[w].s_insn[0]))
+			break;
+		++n;
+		if (block_end(&shadow[w].s_insn[1]) || n == BLOCK_WORDS * 2 ||
+		    !ADDR(w + 1))
+			break;
+		++w;
+		if ((shadow[w].s_flags & (C_BPT | C_NEXT)) ||
+		    (!no_insn_check && (shadow[w].s_convol & CV_NUMBER))) {
+			--w;
+			break;
+		}
+		if (PAGE_STALE(w))
+			page_sync(w);
+		if (!(shadow[w].s_flags & C_UNPACKED))
+			unpack(w);
+	}
+#ifdef THREADED_CODE
+	for (i = 1; i < n; ++i) {
+		uinstr_t        *ip = &shadow[pcm + i / 2].s_insn[i & 1];
+		uinstr_t        *next = &shadow[pcm + i / 2 + 1].s_insn[0];
+
+		if (i & 1) {
+			/* an earlier block may have paired it with another word */
+			ip->i_handler = dispatch[ip->i_opcode];
+			if (i + 1 < n && fusing[ip->i_opcode][next->i_opcode]) {
+				ip->i_handler =
+					fusing[ip->i_opcode][next->i_opcode];
+				continue;
+			}
+		} else if (ip->i_handler != dispatch[ip->i_opcode])
+			continue;               /* fused by unpack() */
+		if (!ip->i_reg && dispatch_abs[ip->i_opcode])
+			ip->i_handler = dispatch_abs[ip->i_opcode];
+	}
+#endif
+	for (last = pcm + (n - 1) / 2, w = pcm; w <= last; ++w)
+		shadow[w].s_flags |= C_BLOCK;
+	return shadow[pcm].s_blen = n;
+}
+
+#ifdef THREADED_CODE
+/*
+ * Bind the left half of a word to the fused handler for the pair
+ * it makes with the right half, if run_fast() has one.
+ */
+static void
+fuse(pc)
+	ushort  pc;
+{
+	uinstr_t        *ip = shadow[pc].s_insn;
+
+	if (fusing && fusing[ip[0].i_opcode][ip[1].i_opcode])
+		ip[0].i_handler = fusing[ip[0].i_opcode][ip[1].i_opcode];
+}
+#endif
 
 void
 unpack(pc)
 	ushort  pc;
 {
 	word_t         *wp = &core[pc];
-	uinstr_t       *ip = uicore[pc];
+	uinstr_t       *ip = shadow[pc].s_insn;
+	uinstr_t        was[2];
+
+	was[0] = ip[0];
+	was[1] = ip[1];
 	ip->i_reg = Lreg(*wp);
 	ip->i_opcode = Lopcode(*wp);
 	ip->i_addr = Laddr(*wp);
+#ifdef THREADED_CODE
+	ip->i_handler = dispatch[ip->i_opcode];
+#endif
 	++ip;
 	ip->i_reg = Rreg(*wp);
 	ip->i_opcode = Ropcode(*wp);
 	ip->i_addr = Raddr(*wp);
-	cflags[pc] |= C_UNPACKED;
+#ifdef THREADED_CODE
+	ip->i_handler = dispatch[ip->i_opcode];
+	fuse(pc);
+#endif
+	/* a page dropped as a whole may still hold the same code */
+	if ((shadow[pc].s_flags & C_BLOCK) &&
+	    (!SAME_INSN(was[0], ip[-1]) || !SAME_INSN(was[1], ip[0])))
+		block_flush(pc);
+	shadow[pc].s_flags |= C_UNPACKED;
+}
+
+/*
+ * The page of pc has been written since its words were unpacked:
+ * have them unpacked again as they are reached, and count the drop
+ * towards PAGE_PRECISE.
+ */
+void
+page_sync(pc)
+	unsigned        pc;
+{
+	unsigned        p = PAGE(pc), w;
+
+	codegen[p] = pagegen[p];
+	if (pagedrops[p] < PAGE_PRECISE)
+		++pagedrops[p];
+	for (w = p << PAGESHIFT; w < (p + 1) << PAGESHIFT; ++w)
+		shadow[w].s_flags &= ~C_UNPACKED;
+}
+
+/*
+ * Mark n words from addr as written, after a transfer into memory
+ * not done through STORE.
+ */
+void
+pages_written(addr, n)
+	unsigned        addr, n;
+{
+	unsigned        w, end;
+
+	for (w = addr; w < addr + n; w = end) {
+		end = (PAGE(w) + 1) << PAGESHIFT;
+		if (end > addr + n)
+			end = addr + n;
+		if (pagedrops[PAGE(w)] < PAGE_PRECISE)
+			++pagegen[PAGE(w)];
+		else
+			for (; w < end; ++w)
+				shadow[w].s_flags &= ~C_UNPACKED;
+	}
+}
+
+/*
+ * Copy the convolution of n words from addr out to buf, one byte a
+ * word as the disk layer keeps it, or back in from buf.
+ */
+void
+convol_get(addr, buf, n)
+	unsigned        addr, n;
+	char            *buf;
+{
+	unsigned        i;
+
+	for (i = 0; i < n; ++i)
+		buf[i] = shadow[addr + i].s_convol;
+}
+
+void
+convol_put(addr, buf, n)
+	unsigned        addr, n;
+	const char      *buf;
+{
+	unsigned        i;
+
+	for (i = 0; i < n; ++i)
+		shadow[addr + i].s_convol = buf[i];
 }
 
 int
@@ -60,815 +314,294 @@ _abort(err) {
 		return(err);
 }
 
-#define CHK_STACK       \
-	if (!addr && (ui.i_reg == STACKREG))    \
-		reg[STACKREG] = ADDR(reg[STACKREG] - 1);        \
-	else
-#define GET_OP  {\
-		LOAD(enreg, XADDR(addr + reg[ui.i_reg]));\
-		if (op.o_flags & F_AR) {\
-			accex = zeroword;\
-			UNPCK(enreg);\
-			UNPCK(acc);\
-		} else if (op.o_flags & F_AROP) {\
-			UNPCK(enreg);\
-		}\
+/*
+ * Instructions that can start a fused pair.  Their own handlers and
+ * the fused ones share these bodies; the handler still has to end
+ * with NEXT or BREAK as before.
+ */
+#define DO_STX          {\
+	STORE(acc, XADDR(addr + reg[ui.i_reg]));\
+	if (TRACING)\
+		fprintf(stderr, "       %05o: store %08o%08o\n",\
+			XADDR(addr + reg[ui.i_reg]), acc.l, acc.r);\
+	STK_POP;\
+}
+#define DO_XTS          {\
+	STK_PUSH;\
+	GET_OP;\
+	acc = enreg;\
+}
+#define DO_XTA          {\
+	CHK_STACK;\
+	GET_OP;\
+	acc = enreg;\
+}
+#define DO_ITA          {\
+	acc.l = 0;\
+	acc.r = reg[(addr + reg[ui.i_reg]) & (supmode ? 0x1f : 0xf)];\
+}
+#define DO_VTM          {\
+	reg[ui.i_reg] = addr;\
+	reg[0] = 0;\
+	if (supmode && ui.i_reg == 0) {\
+		reg[PSREG] &= ~02003;\
+		reg[PSREG] |= addr & 02003;\
+		sup_mmap = (addr & 1) << 15;\
+	}\
 }
-#define GET_NAI_OP      {\
-	enreg.o = (addr + reg[ui.i_reg]) & 0x7f;\
-	enreg.ml = enreg.mr = 0;\
-	if (op.o_flags & F_AR) {\
-		accex = zeroword;\
-		UNPCK(acc);\
-	};\
+#define DO_UTM          {\
+	reg[ui.i_reg] = ADDR(addr + reg[ui.i_reg]);\
+	reg[0] = 0;\
+	if (supmode && ui.i_reg == 0) {\
+		reg[PSREG] &= ~02003;\
+		reg[PSREG] |= addr & 02003;\
+		sup_mmap = (addr & 1) << 15;\
+	}\
 }
-#define STK_PUSH        {\
-	STORE(acc, reg[STACKREG] | (supmode & sup_mmap));\
-	reg[STACKREG] = ADDR(reg[STACKREG] + 1);\
+#define DO_UTC          {\
+	reg[MODREG] = ADDR(addr + reg[ui.i_reg]);\
+	addrmod = 1;\
 }
-#define STK_POP         {\
-	reg[STACKREG] = ADDR(reg[STACKREG] - 1);\
-	LOAD(acc, reg[STACKREG] | (supmode & sup_mmap));\
+#define DO_WTC          {\
+	CHK_STACK;\
+	GET_OP;\
+	reg[MODREG] = ADDR(enreg.r);\
+	addrmod = 1;\
 }
 
+#ifdef THREADED_CODE
+/*
+ * Fused pairs.  Where two instructions of a frequent pair follow each
+ * other, in one word or across a word boundary inside a cached block,
+ * the first one gets a handler that runs both: its own body, the mode
+ * change BREAK would have made, then the steps of the loop head for
+ * the next instruction and a direct jump to the second handler.
+ * Across a word boundary the checks of the block path are repeated,
+ * and the loop head takes over if any of them fails.
+ */
+#define FUSED(a, b)     L_##a##_##b: DO_##a;\
+	if ((i = op.o_flags & F_GRP))\
+		augroup.gl_au = aumodes[i];\
+	FUSE(L_I_##b);
+#define FUSE(lbl)       {\
+	if (right) {\
+		if (breakflg)\
+			NEXT;\
+		if (bi < blen && ((pcm << 1) | 1) == bstart + bi)\
+			++bi;\
+		ui = shadow[pcm].s_insn[1];\
+	} else {\
+		pcm = pc | supmode;\
+		if (bi >= blen || (pcm << 1) != bstart + bi || goahead ||\
+		    breakflg || PAGE_STALE(pcm) ||\
+		    !(shadow[pcm].s_flags & C_UNPACKED))\
+			NEXT;\
+		nextpc = ADDR(pc + 1);\
+		cf = shadow[pcm].s_flags;\
+		ui = shadow[pcm].s_insn[0];\
+		++bi;\
+	}\
+	mem = 0;\
+	op = optab[ui.i_opcode];\
+	icnt = ++icount;\
+	abpc = pc;\
+	abright = right;\
+	pc = ADDR(pc + right);\
+	right ^= 1;\
+	if (addrmod) {\
+		addrmod = 0;\
+		addr = ADDR(ui.i_addr + reg[MODREG]);\
+	} else\
+		addr = ui.i_addr;\
+	goto lbl;\
+}
+#endif
+
 static inline uint64_t
 rdtsc(void)
 {
-#ifdef i386
-	uint64_t rv;
+#ifdef TICK_TSC
+	unsigned        lo, hi;
+
+	asm volatile("rdtsc" : "=a" (lo), "=d" (hi));
+	return (uint64_t) hi << 32 | lo;
+#else
+	struct timespec ts;
 
-	asm volatile(".byte 0x0f, 0x31" : "=A" (rv));
-	return (rv);
+#ifdef CLOCK_MONOTONIC_RAW
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
 #else
-	return 0ull;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+	return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
 #endif
 }
 
-ulong   run() {
-	optab_t        op;
-	ushort         addr;
-	ushort                  cf;
-	uinstr_t                ui;
-	reg_t                   nextpc, pcm;
-	ushort                  cnt, r, err = 0;
-	int                     i;
-	ulong                   icount = 0;
-	uchar                   mem;
-	uchar                   last_op = 0;
-	uint64_t		tsc = rdtsc();
-
-FOREVER
-
-	if (goahead && !right) {
-		goahead = 0;
-		STORE(acc, ehandler - 11);
-		enreg.o = 0;
-		if (dis_exc)
-			enreg.o = 040;
-		if (G_LOG)
-			enreg.o |= 004;
-		if (G_MUL)
-			enreg.o |= 010;
-		if (G_ADD)
-			enreg.o |= 020;
-		if (dis_round)
-			enreg.o |= 002;
-		if (dis_norm)
-			enreg.o |= 001;
-		enreg.l = (long) enreg.o << 17;
-		enreg.r = 0;
-		STORE(enreg, ehandler - 10);
-		STORE(accex, ehandler - 9);
-		enreg.l = 0;
-		enreg.r = pc;
-		STORE(enreg, ehandler - 8);
-		enreg.r = reg[TRAPRETREG];
-		STORE(enreg, ehandler - 7);
-		enreg.r = (addrmod << 1) | right;
-		STORE(enreg, ehandler - 6);
-		enreg.r = reg[MODREG];
-		STORE(enreg, ehandler - 5);
-		enreg.r = reg[017];
-		STORE(enreg, ehandler - 4);
-		enreg.r = reg[016];
-		STORE(enreg, ehandler - 3);
-		enreg.r = reg[015];
-		STORE(enreg, ehandler - 2);
-		enreg.r = 0;
-		STORE(enreg, ehandler - 1);
-
-		eenab = 0;
-		reg[016] = pc = ehandler;
-		right = 0;
-		acc.l = emask;
-		acc.r = events;
-		events = 0;
-	}
-	nextpc = ADDR(pc + 1);
-	pcm = pc | supmode;
-	mem = 0;
-
-	cf = cflags[pcm];
-	if (!(cf & C_UNPACKED) && !right)
-		unpack(pcm);
-
-	if (!pcm || (!no_insn_check && (convol[pcm] & CV_NUMBER)))
-		ABORT(E_CHECK);
+/*
+ * The instruction loop comes in two variants built from run.h:
+ * run_fast() for batch work and run_debug() with the debugger, trace
+ * and statistics hooks.  run() starts the one that is needed and
+ * switches when the debugger is entered or left, or when an extracode
+ * turns tracing or statistics on or off.
+ */
+#define V_FAST          -1
+#define V_DEBUG         -2
 
-	ui = uicore[pcm][right];
-	op = optab[ui.i_opcode];
+static __thread int bpts;              /* breakpoints are set          */
 
-	if ((cf & (C_NEXT|C_BPT) && !right) | (stepflg == 1) | breakflg) {
-dbg:
-		pcm_dbg = pcm;
-		stepflg = breakflg = quitflg = 0;
-		cflags[pcm] &= ~C_NEXT;
-		where();
-		for (cmdflg = 1; cmdflg; command());
-		if (quitflg) STOP;
-	} else if (stepflg)
-		 --stepflg;
-	icnt = ++icount;
-
-	if (stats) {
-		++optab[ui.i_opcode].o_count;
-		tsc += optab[last_op].o_ticks += rdtsc() - tsc;
-		last_op = ui.i_opcode;
-	} else
-		tsc = rdtsc();
+static int
+breakpoints()
+{
+	int     i;
 
-	abpc = pc;
-	abright = right;
-	pc = ADDR(pc + right);
-	right ^= 1;
+	for (i = 0; i < CORESZ * 2; ++i)
+		if (shadow[i].s_flags & (C_BPT | C_NEXT))
+			return 1;
+	return 0;
+}
 
-	if (addrmod) {
-		addrmod = 0;
-		addr = ADDR(ui.i_addr + reg[MODREG]);
-	} else
-		addr = ui.i_addr;
-
-	if (trace >= 2) {
-		char str [40] = "";
-		LOAD(enreg, XADDR(addr + reg[ui.i_reg]));
-		fprintf(stderr, "%05o: %-4s", abpc, op.o_name);
-		if (addr >= 077700) {
-			if (ui.i_reg)
-				sprintf (str, "-%o(%o)", (addr ^ 077777) + 1, ui.i_reg);
-			else
-				sprintf (str, "-%o", (addr ^ 077777) + 1);
-		} else if (addr) {
-			if (ui.i_reg)
-				sprintf (str, "%o(%o)", addr, ui.i_reg);
-			else
-				sprintf (str, "%o", addr);
-		} else {
-			if (ui.i_reg) {
-				sprintf (str, "(%o)", ui.i_reg);
-			}
-		}
-		fprintf(stderr, "%-16s (=%08o%08o) acc=%08o%08o",
-			str, (uint)enreg.l, (uint)enreg.r,
-			(uint)acc.l, (uint)acc.r);
-		if (ui.i_reg)
-			fprintf(stderr, " r[%o]=%05o",
-				ui.i_reg, reg[ui.i_reg]);
-		fprintf(stderr, "\n");
-		fflush(stderr);
-	}
+static int
+need_debug()
+{
+	return bpts || stepflg || breakflg || stats || stats_file ||
+		trace >= 2 || ecode_intr;
+}
 
-	switch (op.o_inline) {
-	case I_ATX:
-		STORE(acc, XADDR(addr + reg[ui.i_reg]));
-		if (trace >= 2)
-			fprintf(stderr, "       %05o: store %08o%08o\n",
-				XADDR(addr + reg[ui.i_reg]), acc.l, acc.r);
-		if (!addr && (ui.i_reg == STACKREG))
-			reg[STACKREG] = ADDR(reg[STACKREG] + 1);
-		NEXT;
-	case I_STX:
-		STORE(acc, XADDR(addr + reg[ui.i_reg]));
-		if (trace >= 2)
-			fprintf(stderr, "       %05o: store %08o%08o\n",
-				XADDR(addr + reg[ui.i_reg]), acc.l, acc.r);
-		STK_POP;
-		break;
-	case I_XTS: /* Major ISA change: swapping next 2 lines */
-		STK_PUSH;
-		GET_OP;
-		acc = enreg;
-		break;
-	case I_XTA:
-		CHK_STACK;
-		GET_OP;
-		acc = enreg;
-		break;
-	case I_VTM:
-		reg[ui.i_reg] = addr;
-		reg[0] = 0;
-		if (supmode && ui.i_reg == 0) {
-			reg[PSREG] &= ~02003;
-			reg[PSREG] |= addr & 02003;
-			sup_mmap = (addr & 1) << 15;
-		}
-		NEXT;
-	case I_UTM:
-		reg[ui.i_reg] = ADDR(addr + reg[ui.i_reg]);
-		reg[0] = 0;
-		if (supmode && ui.i_reg == 0) {
-			reg[PSREG] &= ~02003;
-			reg[PSREG] |= addr & 02003;
-			sup_mmap = (addr & 1) << 15;
-		}
-		NEXT;
-	case I_VLM:
-		if (!reg[ui.i_reg])
-			break;
-		reg[ui.i_reg] = ADDR(reg[ui.i_reg] + 1);
-		JMP(addr);
-		NEXT;
-	case I_UJ:
-		JMP(ADDR(addr + reg[ui.i_reg]));
-		NEXT;
-	case I_STOP:
-		if (!(cf & C_STOPPED)) {
-			cf |= C_STOPPED;
-			pc = abpc;
-			pcm = pc | supmode;
-			right = abright;
-			goto dbg;
-		}
-		NEXT;
-	case I_ITS:
-		STK_PUSH;
-		/*      fall    thru    */
-	case I_ITA:
-		acc.l = 0;
-		acc.r = reg[(addr + reg[ui.i_reg]) & (supmode ? 0x1f : 0xf)];
-		break;
-	case I_XTR:
-		CHK_STACK;
-		GET_OP;
-set_mode:
-		dis_exc = (enreg.o & 040) != 0;
-		G_ADD = (enreg.o & 020) != 0;
-		G_MUL = (enreg.o & 010) != 0;
-		G_LOG = (enreg.o & 004) != 0;
-		dis_round = (enreg.o & 002) != 0;
-		dis_norm = (enreg.o & 001) != 0;
-		NEXT;
-	case I_NTR:
-		GET_NAI_OP;
-		goto set_mode;
-	case I_RTE:
-		GET_NAI_OP;
-		acc.o = 0;
-		if (dis_exc)
-			acc.o = 040;
-		if (G_LOG)
-			acc.o |= 004;
-		if (G_MUL)
-			acc.o |= 010;
-		if (G_ADD)
-			acc.o |= 020;
-		if (dis_round)
-			acc.o |= 002;
-		if (dis_norm)
-			acc.o |= 001;
-		acc.l = (long) (acc.o & enreg.o) << 17;
-		acc.r = 0;
-		break;
-	case I_ASUB:
-		CHK_STACK;
-		GET_OP;
-		if (NEGATIVE(acc))
-			NEGATE(acc);
-		if (!NEGATIVE(enreg))
-			NEGATE(enreg);
-		err = add();
-		if (err)
-			ABORT(err);
-		break;
-	case I_RSUB:
-		CHK_STACK;
-		GET_OP;
-		NEGATE(acc);
-		err = add();
-		if (err)
-			ABORT(err);
-		break;
-	case I_SUB:
-		CHK_STACK;
-		GET_OP;
-		NEGATE(enreg);
-		err = add();
-		if (err)
-			ABORT(err);
-		break;
-	case I_ADD:
-		CHK_STACK;
-		GET_OP;
-		err = add();
-		if (err)
-			ABORT(err);
-		break;
-	case I_YTA:
-		if (G_LOG) {
-			acc = accex;
-			break;
-		}
-		UNPCK(accex);
-		UNPCK(acc);
-		acc.mr = accex.mr;
-		acc.ml = accex.ml & 0xffff;
-		acc.o += ((addr + reg[ui.i_reg]) & 0x7f) - 64;
-		op.o_flags |= F_AR;
-		enreg = accex;
-		accex = zeroword;
-		PACK(enreg);
-		break;
-	case I_UZA:
-		accex = acc;
-		if (G_ADD) {
-			if (acc.l & 0x10000)
-					NEXT;
-		} else if (G_MUL) {
-			if (!(acc.l & 0x800000))
-					NEXT;
-		} else if (G_LOG) {
-			if (acc.l | acc.r)
-					NEXT;
-		} else
-			NEXT;
-		JMP(ADDR(addr + reg[ui.i_reg]));
-		NEXT;
-	case I_UIA:
-		accex = acc;
-		if (G_ADD) {
-			if (!(acc.l & 0x10000))
-					NEXT;
-		} else if (G_MUL) {
-			if (acc.l & 0x800000)
-					NEXT;
-		} else if (G_LOG) {
-			if (!(acc.l | acc.r))
-					NEXT;
-		} else
-			/* fall thru, i.e. branch */;
-		JMP(ADDR(addr + reg[ui.i_reg]));
-		NEXT;
-	case I_UTC:
-		reg[MODREG] = ADDR(addr + reg[ui.i_reg]);
-		addrmod = 1;
-		NEXT;
-	case I_WTC:
-		CHK_STACK;
-		GET_OP;
-		reg[MODREG] = ADDR(enreg.r);
-		addrmod = 1;
-		NEXT;
-	case I_VZM:
-		if (ui.i_opcode == 0115) {
-			if (reg[ui.i_reg]) {
-				JMP(addr);
-			}
-		} else {
-			if (!reg[ui.i_reg]) {
-				JMP(addr);
-			}
-		}
-		NEXT;
-	case I_VJM:
-		reg[ui.i_reg] = nextpc;
-		reg[0] = 0;
-		JMP(addr);
-		NEXT;
-	case I_ATI:
-		if (supmode) {
-			reg[i = (addr + reg[ui.i_reg]) & 0x1f] = ADDR(acc.r);
-			if (i == PSREG)
-				sup_mmap = (reg[PSREG] & 1) << 15;
-		} else
-			reg[(addr + reg[ui.i_reg]) & 0xf] = ADDR(acc.r);
-		reg[0] = 0;
-		NEXT;
-	case I_STI: {
-		uchar   rg = (addr + reg[ui.i_reg]) & (supmode ? 0x1f : 0xf);
-		ushort  ad = ADDR(acc.r);
-
-		reg[rg] = ad;
-		reg[0] = 0;
-		if (rg != STACKREG)
-			reg[STACKREG] = ADDR(reg[STACKREG] - 1);
-		LOAD(acc, reg[STACKREG] | (supmode & sup_mmap));
-		if (rg == PSREG)
-			sup_mmap = (reg[PSREG] & 1) << 15;
-		break;
-	}
-	case I_MTJ:
-		if (supmode) {
-mtj:
-			reg[addr & 0x1f] = reg[ui.i_reg];
-			if ((addr & 0x1f) == PSREG)
-				sup_mmap = (reg[PSREG] & 1) << 15;
-		} else
-			reg[addr & 0xf] = reg[ui.i_reg];
-		reg[0] = 0;
-		NEXT;
-	case I_MPJ:
-		i = addr & 0xf;
-		if (i & 020 && supmode)
-			goto mtj;
-		reg[i] = ADDR(reg[i] + reg[ui.i_reg]);
-		reg[0] = 0;
-		NEXT;
-	case I_MOD:
-		if (supmode)
-			NEXT;
-		else
-			ABORT(E_PRIV);
-	case I_IRET:
-		if (!supmode)
-			ABORT(E_PRIV);
-		if (ui.i_reg == 016) {
-			err = emu_call();
-			if (err) {
-				ninter = 0;     /* can't be intercepted */
-				ABORT(err);
-			}
-			NEXT;
-		}
-		reg[PSREG] = reg[PSSREG] & 02003;
-		JMP(reg[(ui.i_reg & 3) | 030]);
-		right = !!(reg[PSSREG] & 0400);
-		sup_mmap = reg[PSSREG] & 1 ? 0100000 : 0;
-		supmode = reg[PSSREG] & 014 ? 0100000 : 0;
-		abpc = pc;
-		abright = right;
-		pcm = pc | supmode;
-		spec = spec_saved | supmode;
-		err = reg[TRAPNREG];
-		reg[TRAPNREG] = 0;
-		if (err)
-			ABORT(err);
-		NEXT;
-	case I_TRAP:
-		reg[TRAPRETREG] = nextpc;
-		if (!(cf & C_STOPPED) &&
-				((1 << (ui.i_opcode - 050)) & ecode_intr)) {
-			cf |= C_STOPPED;
-			pc = abpc;
-			right = abright;
-			goto dbg;
-		}
-		JMP(nextpc);
-		reg[016] = ADDR(addr + reg[ui.i_reg]);
-		reg[TRAPNREG] = ui.i_opcode - 050;
-		stopwatch();
-		if (trace == 1 && (ui.i_opcode != 075 || reg[016] < 2)) {
-			/* Do not trace e75, it's too verbose. */
-			LOAD(enreg, reg[016] | (supmode & sup_mmap));
-			fprintf(stderr, "%05o: %-4s%-5o (=%08o%08o) acc=%08o%08o\n",
-				abpc, op.o_name, reg[016], (uint)enreg.l, (uint)enreg.r,
-				(uint)acc.l, (uint)acc.r);
-			fflush(stderr);
-		}
-		switch (ui.i_opcode) {
-		case 050:
-			err = e50();
-			goto errchk;
-		case 051:
-			err = e51();
-			goto errchk;
-		case 052:
-			err = elfun(EF_COS);
-			goto errchk;
-		case 053:
-			err = e53();
-			goto errchk;
-		case 054:
-			err = elfun(EF_ARCSIN);
-			goto errchk;
-		case 055:
-			err = elfun (EF_ALOG);
-			goto errchk;
-		case 056:
-			err = elfun (EF_EXP);
-			goto errchk;
-		case 057:
-			err = elfun(EF_ENTIER);
-			goto errchk;
-		case 060:
-			err = e60();
-			goto errchk;
-		case 061:
-			err = e61();
-			goto errchk;
-		case 062:
-			err = e62();
-			if (err == E_TERM)
-				STOP;
-			goto errchk;
-		case 063:
-			err = e63();
-			goto errchk;
-		case 064:
-			err = print();
-			goto errchk;
-		case 065:
-			err = physaddr();
-			goto errchk;
-		case 067:
-			err = deb();
-			goto errchk;
-		case 070:
-			err = ddio();
-			goto errchk;
-		case 071:
-			err = term();
-			goto errchk;
-		case 072:
-			err = resources();
-			goto errchk;
-		case 074:
-			if ((acc.l == 0x737973) &&      /* "syscal" */
-					(acc.r = 0x63616c)) {
-				err = usyscall();
-				goto errchk;
-			}
-			if ((accex.l == 0x737973) &&      /* "syscal" */
-					(accex.r = 0x63616c)) {
-				accex = zeroword;
-				err = emu_call();
-				goto errchk;
-			}
-			err = eexit();
-			if (err == E_TERM)
-				STOP;
-			goto errchk;
-		case 075:
-			STORE(acc, reg[016]);
-			convol[reg[016]] &= ~CV_NUMBER;
-			switch (reg[016]) {
-			/* undocumented trick (ВРЕМЕННО ФИРСОВ) */
-			case 0: spec = 1; break;
-			case 1: spec = 0; break;
-			}
-			break;
-		default:
-			err = E_UNIMP;
-errchk:
-			if (err == E_UNIMP) {
-				/* try the supervisor then */
-				spec_saved = spec;
-				reg[PSSREG] = reg[PSREG] & 02003;
-				if (supmode)
-					reg[PSSREG] |= 014;
-				supmode = 0100000;
-				sup_mmap = 0100000;
-				reg[PSREG] = 02007;
- 				/* words formed by the kernel in user memory can be instructions */
-				spec = 1;
-				JMP(XCODE_ENTRYPT);
-			} else if (err) {
-				startwatch();
-				ABORT(err);
-			}
-			break;
-		}
-		startwatch();
-		NEXT;
-	default:
-		if (!addr && (ui.i_reg == STACKREG) && (op.o_flags & F_STACK))
-			reg[STACKREG] = ADDR(reg[STACKREG] - 1);
-
-		if (op.o_flags & F_OP) {
-			GET_OP;
-		} else if (op.o_flags & F_NAI)
-			GET_NAI_OP;
-
-		err = (*op.o_impl)();
-		if (err)
-			ABORT(err);
-		break;
-	}
+#define RUN_NAME        run_fast
+#define RUN_DEBUG       0
+#include "run.h"
+#undef RUN_NAME
+#undef RUN_DEBUG
 
-	if ((i = op.o_flags & F_GRP))
-		augroup.gl_au = aumodes[i];
-
-	if (op.o_flags & F_AR) {
-		uint    rr = 0;
-		switch ((acc.ml >> 16) & 3) {
-		case 2:
-		case 1:
-			rnd_rq |= acc.mr & 1;
-			accex.mr = (accex.mr >> 1) | (accex.ml << 23);
-			accex.ml = (accex.ml >> 1) | (acc.mr << 15);
-			acc.mr = (acc.mr >> 1) | (acc.ml << 23);
-			acc.ml >>= 1;
-			++acc.o;
-			goto chk_rnd;
-		}
+#define RUN_NAME        run_debug
+#define RUN_DEBUG       1
+#include "run.h"
+#undef RUN_NAME
+#undef RUN_DEBUG
 
-		if (dis_norm)
-			goto chk_rnd;
-		if (!(i = (acc.ml >> 15) & 3)) {
-			if ((r = acc.ml & 0xffff)) {
-				for (cnt = 0; (r & 0x8000) == 0;
-							++cnt, r <<= 1);
-				acc.ml = (r & 0xffff) |
-						(acc.mr >> (24 - cnt));
-				acc.mr = (acc.mr << cnt) |
-						(rr = accex.ml >> (16 - cnt));
-				accex.ml = (accex.ml << cnt) |
-						(accex.mr >> (24 - cnt));
-				accex.mr <<= cnt;
-				acc.o -= cnt;
-				goto chk_zero;
-			}
-			if ((r = acc.mr >> 16)) {
-				int     fcnt;
-				for (cnt = 0; (r & 0x80) == 0;
-							++cnt, r <<= 1);
-				acc.ml = acc.mr >> (8 - cnt);
-				acc.mr = (acc.mr << (fcnt = 16 + cnt)) |
-						(accex.ml << cnt) |
-						(accex.mr >> (24 - cnt));
-				accex.mr <<= fcnt;
-				acc.o -= fcnt;
-				rr = acc.r & ((1l << fcnt) - 1);
-				goto chk_zero;
-			}
-			if ((r = acc.mr & 0xffff)) {
-				for (cnt = 0; (r & 0x8000) == 0;
-							++cnt, r <<= 1);
-				acc.ml = (r & 0xffff) |
-						(accex.ml >> (16 - cnt));
-				acc.mr = (accex.ml << (8 + cnt)) |
-						(accex.mr >> (16 - cnt));
-				accex.ml = accex.mr << cnt;
-				accex.mr = 0;
-				acc.o -= 24 + cnt;
-				rr = (acc.ml & ((1 << cnt) - 1)) | acc.mr;
-				goto chk_zero;
-			}
-			if ((r = accex.ml & 0xffff)) {
-				rr = accex.ml | accex.mr;
-				for (cnt = 0; (r & 0x8000) == 0;
-							++cnt, r <<= 1);
-				acc.ml = (r & 0xffff) |
-						(accex.mr >> (24 - cnt));
-				acc.mr = (accex.mr << cnt);
-				accex.ml = accex.mr = 0;
-				acc.o -= 40 + cnt;
-				goto chk_zero;
-			}
-			if ((r = accex.mr >> 16)) {
-				rr = accex.ml | accex.mr;
-				for (cnt = 0; (r & 0x80) == 0;
-							++cnt, r <<= 1);
-				acc.ml = accex.mr >> (8 - cnt);
-				acc.mr = accex.mr << (16 + cnt);
-				accex.ml = accex.mr = 0;
-				acc.o -= 56 + cnt;
-				goto chk_zero;
-			}
-			if ((r = accex.mr & 0xffff)) {
-				rr = accex.ml | accex.mr;
-				for (cnt = 0; (r & 0x8000) == 0;
-							++cnt, r <<= 1);
-				acc.ml = (r & 0xffff);
-				acc.mr = accex.ml = accex.mr = 0;
-				acc.o -= 64 + cnt;
-				goto chk_zero;
-			}
-			goto zero;
-		} else if (i == 3) {
-			if ((r = ~acc.ml & 0xffff)) {
-				for (cnt = 0; (r & 0x8000) == 0;
-							++cnt, r = (r << 1) | 1);
-				acc.ml = 0x10000 | (~r & 0xffff) |
-						(acc.mr >> (24 - cnt));
-				acc.mr = (acc.mr << cnt) |
-						(rr = accex.ml >> (16 - cnt));
-				accex.ml = ((accex.ml << cnt) |
-						(accex.mr >> (24 - cnt)))
-						& 0xffff;
-				accex.mr <<= cnt;
-				acc.o -= cnt;
-				goto chk_zero;
-			}
-			if ((r = (~acc.mr >> 16) & 0xff)) {
-				int     fcnt;
-				for (cnt = 0; (r & 0x80) == 0;
-							++cnt, r = (r << 1) | 1);
-				acc.ml = 0x10000 | (acc.mr >> (8 - cnt));
-				acc.mr = (acc.mr << (fcnt = 16 + cnt)) |
-						(accex.ml << cnt) |
-						(accex.mr >> (24 - cnt));
-				accex.ml = ((accex.ml << fcnt) |
-						(accex.mr >> (8 - cnt)))
-						& 0xffff;
-				accex.mr <<= fcnt;
-				acc.o -= fcnt;
-				rr = acc.r & ((1l << fcnt) - 1);
-				goto chk_zero;
-			}
-			if ((r = ~acc.mr & 0xffff)) {
-				for (cnt = 0; (r & 0x8000) == 0;
-							++cnt, r = (r << 1) | 1);
-				acc.ml = 0x10000 | (~r & 0xffff) |
-						(accex.ml >> (16 - cnt));
-				acc.mr = (accex.ml << (8 + cnt)) |
-						(accex.mr >> (16 - cnt));
-				accex.ml = (accex.mr << cnt) & 0xffff;
-				accex.mr = 0;
-				acc.o -= 24 + cnt;
-				rr = (acc.ml & ((1 << cnt) - 1)) | acc.mr;
-				goto chk_zero;
-			}
-			if ((r = ~accex.ml & 0xffff)) {
-				rr = accex.ml | accex.mr;
-				for (cnt = 0; (r & 0x8000) == 0;
-							++cnt, r = (r << 1) | 1);
-				acc.ml = 0x10000 | (~r & 0xffff) |
-						(accex.mr >> (24 - cnt));
-				acc.mr = (accex.mr << cnt);
-				accex.ml = accex.mr = 0;
-				acc.o -= 40 + cnt;
-				goto chk_zero;
-			}
-			if ((r = (~accex.mr >> 16) & 0xff)) {
-				rr = accex.ml | accex.mr;
-				for (cnt = 0; (r & 0x80) == 0;
-							++cnt, r = (r << 1) | 1);
-				acc.ml = 0x10000 | (accex.mr >> (8 - cnt));
-				acc.mr = accex.mr << (16 + cnt);
-				accex.ml = accex.mr = 0;
-				acc.o -= 56 + cnt;
-				goto chk_zero;
-			}
-			if ((r = ~accex.mr & 0xffff)) {
-				rr = accex.ml | accex.mr;
-				for (cnt = 0; (r & 0x8000) == 0;
-							++cnt, r = (r << 1) | 1);
-				acc.ml = 0x10000 | (~r & 0xffff);
-				acc.mr = accex.ml = accex.mr = 0;
-				acc.o -= 64 + cnt;
-				goto chk_zero;
-			} else {
-				rr = 1;
-				acc.ml = 0x10000;
-				acc.mr = accex.ml = accex.mr = 0;
-				acc.o -= 80;
-				goto chk_zero;
-			}
-		}
-chk_zero:
-		rnd_rq = rnd_rq && !rr;
-chk_rnd:
-		if (acc.o & 0x8000)
-			goto zero;
-		if (acc.o & 0x80) {
-			acc.o = 0;
-			if (!dis_exc)
-				ABORT(E_OVFL);
-		}
-		if (!dis_round && rnd_rq)
-			acc.mr |= 1;
+ulong   run(void) {
+	ulong                   icount = 0;
+	int                     err;
 
-		if (!acc.ml && !acc.mr && !dis_norm) {
-zero:
-			acc.l = acc.r = accex.l = accex.r = 0;
-			goto done;
-		}
-		acc.l = ((uint) (acc.o & 0x7f) << 17) | (acc.ml & 0x1ffff);
-		acc.r = acc.mr & 0xffffff;
-
-		accex.l = ((uint) (accex.o & 0x7f) << 17) | (accex.ml & 0x1ffff);
-		accex.r = accex.mr & 0xffffff;
-done:
-		if (op.o_inline == I_YTA)
-			accex = enreg;
-		rnd_rq = 0;
-	}
+	bpts = breakpoints();
+	err = need_debug() ? V_DEBUG : V_FAST;
+	while (err < 0)
+		err = err == V_DEBUG ? run_debug(&icount) : run_fast(&icount);
 
-ENDFOREVER
 	if (pout_enable && xnative)
 		pout_decode(pout_file);
 	pc = abpc;
 	right = abright;
-	pcm_dbg = pcm;
+	stoperr = err;
 	if (pout_enable || err != 1) {
 /*		printf("Error %d\n", err);     */
-		utf8_puts(_(errtxt[err]), stdout);
-		putc('\n', stdout);
+		utf8_puts(_(errtxt[err]), LPOUT);
+		putc('\n', LPOUT);
 		where();
 	}
 	return icount;
 
 }
 
+/*
+ * Memory of the machine: core[] and shadow[] live in one private
+ * mapping per machine, which costs only the pages it touches, rather
+ * than in thread-local storage that every thread carries in full.
+ * With fd >= 0, the supervisor half of both comes from an image made
+ * by core_image(), mapped copy-on-write: machines that share it keep
+ * one copy of the decoded supervisor, and only a page the supervisor
+ * writes into is copied.  The memory the machine had is let go;
+ * returns -1, keeping it, if there is no memory to map.
+ */
+int
+core_map(fd)
+	int             fd;
+{
+	char            *m;
+
+	m = mmap(0, CORE_BYTES + SHADOW_BYTES, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m == MAP_FAILED) {
+		perror("core_map");
+		return -1;
+	}
+	if (fd >= 0 && (mmap(m + CORE_BYTES / 2, CORE_BYTES / 2,
+	    PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) ==
+	    MAP_FAILED || mmap(m + CORE_BYTES + SHADOW_BYTES / 2,
+	    SHADOW_BYTES / 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+	    fd, CORE_BYTES / 2) == MAP_FAILED)) {
+		perror("core_map");
+		munmap(m, CORE_BYTES + SHADOW_BYTES);
+		return -1;
+	}
+	core_unmap();
+	core = (word_t *) m;
+	shadow = (shadow_t *) (m + CORE_BYTES);
+	memset(pagegen, 0, sizeof(pagegen));
+	memset(codegen, 0, sizeof(codegen));
+	memset(pagedrops, 0, sizeof(pagedrops));
+#ifdef THREADED_CODE
+	/* the image is bound for run_fast(), fresh memory to nothing */
+	bound = V_FAST;
+#endif
+	return 0;
+}
+
+void
+core_unmap(void)
+{
+	if (core)
+		munmap(core, CORE_BYTES + SHADOW_BYTES);
+	core = 0;
+	shadow = 0;
+#ifdef JIT
+	jit_free();
+#endif
+}
+
+/*
+ * Unpack n words of supervisor code from addr, and build a block at
+ * each of them, bound for run_fast(): running the code then finds
+ * everything in place and writes nothing into shadow[].
+ */
+void
+core_decode(addr, n)
+	unsigned        addr, n;
+{
+	unsigned        w;
+
+	run_fast(0);
+	for (w = addr; w < addr + n; ++w)
+		if (!(shadow[w].s_flags & C_UNPACKED))
+			unpack(w);
+	for (w = addr; w < addr + n; ++w)
+		if (!shadow[w].s_blen)
+			block_build(w);
+}
+
+/*
+ * Write the supervisor half of core[] and shadow[] to a temporary
+ * file for core_map(); returns its descriptor, or -1.
+ */
+int
+core_image(void)
+{
+	FILE            *fp;
+	int             fd = -1;
+
+	fp = tmpfile();
+	if (! fp) {
+		perror("core_image");
+		return -1;
+	}
+	if (fwrite(core + CORESZ, CORE_BYTES / 2, 1, fp) != 1 ||
+	    fwrite(shadow + CORESZ, SHADOW_BYTES / 2, 1, fp) != 1 ||
+	    fflush(fp) != 0 || (fd = dup(fileno(fp))) < 0)
+		perror("core_image");
+	fclose(fp);
+	return fd;
+}
+
 int
 priv() {
 	return E_PRIV;
@@ -20,6 +20,7 @@
 #include "defs.h"
 #include "optab.h"
 #include "encoding.h"
+#include "disk.h"
 
 #define PROMPT "- "
 
@@ -197,7 +198,7 @@ command:        /* void */
 	|       'i' octal '=' octal
 			{ if ($2 &= 017) reg[$2] = ADDR($4); }
 	|       octal '=' word
-			{ STORE(wd, $1);  convol[$1] &= ~CV_NUMBER; }
+			{ STORE(wd, $1);  shadow[$1].s_convol &= ~CV_NUMBER; }
 	|       jhb
 			{
 				int     i;
@@ -221,7 +222,7 @@ command:        /* void */
 			LOAD(wd, pc);
 			if ((! right && (wd.l & 03700000) == 03100000) ||
 			    (right && (wd.r & 03700000) == 03100000)) {
-				cflags[pc+1] |= C_NEXT;
+				shadow[pc+1].s_flags |= C_NEXT;
 			} else {
 				stepflg = 1;
 			}
@@ -337,9 +338,15 @@ command ()
 {
 	char line [128], *np;
 
+	if (sync_rq) {
+		sync_rq = 0;
+		disk_sync();
+	}
 	printf (PROMPT);
-	if (!fgets(line, 128, stdin))
+	if (!fgets(line, 128, stdin)) {
+		terminate();
 		exit(0);
+	}
 	if ((np = strchr(line, '\n')))
 		*np = 0;
 	lineptr = line;
@@ -370,14 +377,14 @@ help ()
 
 void
 breakpoint (int addr) {
-	printf ("%s breakpoint on %05o\n", (cflags[addr] ^= C_BPT) & C_BPT ?
+	printf ("%s breakpoint on %05o\n", (shadow[addr].s_flags ^= C_BPT) & C_BPT ?
 			"set" : "clear", addr);
 }
 
 void
 bpw (int addr) {
 	printf ("%s break on data write to%05o\n",
-			(cflags[addr] ^= C_BPW) & C_BPW ?
+			(shadow[addr].s_flags ^= C_BPW) & C_BPW ?
 			"set" : "clear", addr);
 }
 
@@ -388,50 +395,50 @@ okno (int trace)
 	int     i;
 
 	wp = &core[pcm_dbg];
-	printf ("%c%05o%c", pcm_dbg & 0x8000 ? 'S' : ' ',
+	fprintf (LPOUT, "%c%05o%c", pcm_dbg & 0x8000 ? 'S' : ' ',
 				ADDR(pcm_dbg), right ? ' ' : ':');
 	if (right)
 		if (Rstruct(*wp))
-			printf (" %02o %02o %05o\t%s\n", i = Rreg(*wp),
+			fprintf (LPOUT, " %02o %02o %05o\t%s\n", i = Rreg(*wp),
 				Rop1(*wp) | 020, Raddr1(*wp),
 				optab[Ropcode(*wp)].o_name);
 		else
-			printf (" %02o %03o %04o\t%s\n", i = Rreg(*wp),
+			fprintf (LPOUT, " %02o %03o %04o\t%s\n", i = Rreg(*wp),
 				Rop2(*wp) | (Rexp(*wp) ? 0100 : 0),
 				Raddr2(*wp), optab[Ropcode(*wp)].o_name);
 	else
 		if (Lstruct(*wp))
-			printf (" %02o %02o %05o\t%s\n", i = Lreg(*wp),
+			fprintf (LPOUT, " %02o %02o %05o\t%s\n", i = Lreg(*wp),
 				Lop1(*wp) | 020, Laddr1(*wp),
 				optab[Lopcode(*wp)].o_name);
 		else
-			printf (" %02o %03o %04o\t%s\n", i = Lreg(*wp),
+			fprintf (LPOUT, " %02o %03o %04o\t%s\n", i = Lreg(*wp),
 				Lop2(*wp) | (Lexp(*wp) ? 0100 : 0),
 				Laddr2(*wp), optab[Lopcode(*wp)].o_name);
 	if (trace < 2)
 		return;
 
-	printf ("  acc = %08o%08o", acc.l, acc.r);
-	printf (" Y = %08o%08o", accex.l, accex.r);
-	printf (" R = %01o%01o%01o%01o%01o%01o", dis_exc, G_MUL,
+	fprintf (LPOUT, "  acc = %08o%08o", acc.l, acc.r);
+	fprintf (LPOUT, " Y = %08o%08o", accex.l, accex.r);
+	fprintf (LPOUT, " R = %01o%01o%01o%01o%01o%01o", dis_exc, G_MUL,
 		G_ADD, G_LOG, dis_round, dis_norm);
 	if (addrmod)
-		printf (" c=%05o", reg[MODREG]);
+		fprintf (LPOUT, " c=%05o", reg[MODREG]);
 	else
-		printf ("        ");
+		fprintf (LPOUT, "        ");
 	if (i)
-		printf (" i=%05o", reg[i]);
-	putchar('\n');
+		fprintf (LPOUT, " i=%05o", reg[i]);
+	putc('\n', LPOUT);
 	if (trace < 3)
 		return;
 
-	printf ("      ");
+	fprintf (LPOUT, "      ");
 	for (i=1; i<=8; i++)
-		printf (" %05o", reg[i]);
-	printf ("\n      ");
+		fprintf (LPOUT, " %05o", reg[i]);
+	fprintf (LPOUT, "\n      ");
 	for (i=9; i<=15; i++)
-		printf (" %05o", reg[i]);
-	printf ("\n");
+		fprintf (LPOUT, " %05o", reg[i]);
+	fprintf (LPOUT, "\n");
 }
 
 static void
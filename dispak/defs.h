@@ -2,6 +2,9 @@
 #define defs_h                          /* to avoid multiple inclusions */
 
 #include "config.h"
+#if defined(JIT) && !defined(__x86_64__)
+#undef JIT                              /* it makes x86-64 code only    */
+#endif
 #include <sys/types.h>
 #include <locale.h>
 #include "gettext.h"
@@ -38,6 +41,7 @@ typedef unsigned int    uint;
 #include <sys/times.h>
 #include <sys/time.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
 
 #define DIV_NATIVE
@@ -48,6 +52,13 @@ typedef unsigned int    uint;
 #define EXTERN  extern
 #endif
 
+/*
+ * The state of the machine is thread-local, so that each thread of a
+ * process can run a machine of its own; the settings made once by the
+ * options are EXTERN alone and shared by all of them.
+ */
+#define MACHINE EXTERN __thread
+
 #define _(string)	gettext(string)
 
 #define JHBSZ   16
@@ -124,6 +135,53 @@ typedef struct  {                       /* pointer to a byte            */
 #define w_lhalf(w)      ((((w).w_sm << 16) | (w).w_sl) & HALFW)
 #define w_hhalf(w)      (((long)(w).w_sh << 8) | (w).w_b[2])
 
+/*
+ *      Whole word access.  Words stay 6 bytes, most significant first,
+ *      as the drum, disks and text extracodes see them; these move
+ *      all 48 bits at once, in the low bits of a uint64_t.
+ */
+static inline uint64_t
+word_get(const word_t *wp)
+{
+	uint    hi;
+	ushort  lo;
+
+	memcpy(&hi, wp->w_b, 4);
+	memcpy(&lo, wp->w_b + 4, 2);
+#if !defined(WORDS_BIGENDIAN) && defined(__GNUC__)
+	hi = __builtin_bswap32(hi);
+	lo = __builtin_bswap16(lo);
+#elif !defined(WORDS_BIGENDIAN)
+	hi = wp->w_b[0] << 24 | wp->w_b[1] << 16 | wp->w_b[2] << 8 | wp->w_b[3];
+	lo = wp->w_b[4] << 8 | wp->w_b[5];
+#endif
+	return (uint64_t) hi << 16 | lo;
+}
+
+static inline void
+word_put(word_t *wp, uint64_t w)
+{
+	uint    hi = w >> 16;
+	ushort  lo = w;
+
+#if !defined(WORDS_BIGENDIAN) && defined(__GNUC__)
+	hi = __builtin_bswap32(hi);
+	lo = __builtin_bswap16(lo);
+	memcpy(wp->w_b, &hi, 4);
+	memcpy(wp->w_b + 4, &lo, 2);
+#elif !defined(WORDS_BIGENDIAN)
+	wp->w_b[0] = hi >> 24;
+	wp->w_b[1] = hi >> 16;
+	wp->w_b[2] = hi >> 8;
+	wp->w_b[3] = hi;
+	wp->w_b[4] = lo >> 8;
+	wp->w_b[5] = lo;
+#else
+	memcpy(wp->w_b, &hi, 4);
+	memcpy(wp->w_b + 4, &lo, 2);
+#endif
+}
+
 	/* access to instruction fields */
 
 #ifndef WORDS_BIGENDIAN
@@ -199,49 +257,95 @@ typedef struct  {
 	uchar   i_reg;                  /* register #                   */
 	uchar   i_opcode;               /* opcode                       */
 	ushort  i_addr;                 /* address field                */
+#ifdef THREADED_CODE
+	int     i_handler;              /* opcode label, from L_default */
+#endif
 }       uinstr_t;                       /* unpacked instruction         */
 
-EXTERN uinstr_t uicore[CORESZ * 2][2];
+/*
+ * What run() needs of a word besides the word itself, kept together
+ * so that fetching an unpacked word, in a cached block or not, reads
+ * one entry instead of a line of each of five arrays.  The words stay
+ * in core[], which the drum and disk I/O move as a whole; the disk
+ * layer takes the convolution bytes through convol_get/convol_put.
+ */
+typedef struct  {
+	uinstr_t s_insn[2];             /* left and right instruction   */
+	uchar   s_flags;                /* core flags                   */
+	uchar   s_convol;               /* convolution of the word      */
+	uchar   s_heat;                 /* entries without a block      */
+	ushort  s_blen;                 /* half-words of the block here */
+#ifdef JIT
+	ushort  s_jit;                  /* its translation, see jit.c   */
+#endif
+}       shadow_t;
 
-EXTERN uchar    cflags[CORESZ * 2];     /* core flags                   */
+MACHINE shadow_t *shadow;               /* CORESZ * 2, see core_map()   */
 
 #define C_UNPACKED      1               /* instructions are unpacked    */
 #define C_BPT           2               /* breakpoint here              */
 #define C_BPW           4               /* break on write               */
 #define C_STOPPED       8               /* stopped on op33              */
 #define C_NEXT		16		/* breakpoint here once		*/
+#define C_BLOCK         32              /* covered by a cached block    */
+
+/*
+ * Writes into memory only bump the generation of their page; the
+ * unpacked instructions of a page are dropped when code is next
+ * fetched from it and the generation has moved since they were made.
+ * A page that keeps going stale under running code mixes code and
+ * data; after PAGE_PRECISE drops it goes back to clearing C_UNPACKED
+ * of each word written, so that its code is not unpacked over and over.
+ */
+#define PAGESHIFT       10                      /* 1K words per page    */
+#define NPAGES          (CORESZ * 2 >> PAGESHIFT)
+#define PAGE(a)         ((a) >> PAGESHIFT)
+#define PAGE_PRECISE    16
+#define PAGE_STALE(a)   (pagegen[PAGE(a)] != codegen[PAGE(a)])
+#define PAGE_WRITTEN(a) { \
+	if (pagedrops[PAGE(a)] < PAGE_PRECISE) \
+		++pagegen[PAGE(a)]; \
+	else \
+		shadow[a].s_flags &= ~C_UNPACKED; \
+}
+
+MACHINE ulong   pagegen[NPAGES];        /* bumped on every write        */
+MACHINE ulong   codegen[NPAGES];        /* pagegen when last unpacked   */
+MACHINE uchar   pagedrops[NPAGES];      /* times unpacked code dropped  */
 /*
  *      "hardware" objects
  */
 
 #define XCODE_ENTRYPT   011
 
-EXTERN word_t   core[CORESZ * 2];       /* main memory                  */
+MACHINE word_t  *core;                  /* main memory, CORESZ * 2      */
+
+#define CORE_BYTES      (CORESZ * 2 * sizeof(word_t))
+#define SHADOW_BYTES    (CORESZ * 2 * sizeof(shadow_t))
 
-#define CV_NUMBER	1
-EXTERN uchar	convol[CORESZ * 2];	/* convolution of memory */
+#define CV_NUMBER	1		/* s_convol: a number, not code */
 
-EXTERN reg_t    reg[NREGS];             /* registers                    */
+MACHINE reg_t   reg[NREGS];             /* registers                    */
 
-EXTERN reg_t    pc;                     /* program counter              */
-EXTERN reg_t    pcm_dbg;                /* program counter for debugger */
-EXTERN uint     right;                  /* right halfword instruction   */
-EXTERN uchar    addrmod;                /* address modification needed  */
-EXTERN alureg_t acc;                    /* accumulator                  */
-EXTERN alureg_t accex;                  /* accumulator extension        */
-EXTERN alureg_t enreg;                  /* "entry" register             */
-EXTERN uchar    rnd_rq;                 /* rounding request             */
-EXTERN reg_t    supmode;                /* 0100000 - supervisor mode    */
-EXTERN reg_t    sup_mmap;               /* 0100000 - supervisor mem map */
+MACHINE reg_t   pc;                     /* program counter              */
+MACHINE reg_t   pcm_dbg;                /* program counter for debugger */
+MACHINE uint    right;                  /* right halfword instruction   */
+MACHINE uchar   addrmod;                /* address modification needed  */
+MACHINE alureg_t acc;                    /* accumulator                  */
+MACHINE alureg_t accex;                  /* accumulator extension        */
+MACHINE alureg_t enreg;                  /* "entry" register             */
+MACHINE uchar   rnd_rq;                 /* rounding request             */
+MACHINE reg_t   supmode;                /* 0100000 - supervisor mode    */
+MACHINE reg_t   sup_mmap;               /* 0100000 - supervisor mem map */
 
-EXTERN union    {
+MACHINE union   {
 	uchar   gc_au[1];               /* arith cond jump modes        */
 	uint    gl_au;
 }       augroup;
 
-EXTERN uchar    dis_exc;                /* disable arith exceptions     */
-EXTERN uchar    dis_round;              /* disable rounding             */
-EXTERN uchar    dis_norm;               /* disable normalization        */
+MACHINE uchar   dis_exc;                /* disable arith exceptions     */
+MACHINE uchar   dis_round;              /* disable rounding             */
+MACHINE uchar   dis_norm;               /* disable normalization        */
 
 #ifndef WORDS_BIGENDIAN
 #define G_LOG   (augroup.gc_au[0])      /* logical jump mode            */
@@ -276,29 +380,22 @@ EXTERN uchar    dis_norm;               /* disable normalization        */
 
 #define LOAD(reg,addr) \
 { \
-	uchar *_cp = core[addr].w_b; \
-	(reg).l = ((long) _cp[0] << 16) | (_cp[1] << 8) | _cp[2]; \
-	(reg).r = ((long) _cp[3] << 16) | (_cp[4] << 8) | _cp[5]; \
+	uint64_t _w = word_get(&core[addr]); \
+	(reg).l = _w >> 24; \
+	(reg).r = _w & 0xffffff; \
 }
 
 #define STORE(reg,addr) \
 	if (addr) { \
-		uchar *_cp = core[addr].w_b; \
-		unsigned long _l; \
-		if (C_BPW & cflags[addr]) {\
+		if (C_BPW & shadow[addr].s_flags) {\
 			where();\
 			for (cmdflg = 1; cmdflg; command());\
 		}\
-		_l = (reg).l; \
-		_cp[0] = _l >> 16; \
-		_cp[1] = _l >> 8; \
-		_cp[2] = _l; \
-		_l = (reg).r; \
-		_cp[3] = _l >> 16; \
-		_cp[4] = _l >> 8; \
-		_cp[5] = _l; \
-		cflags[addr] &= ~C_UNPACKED; \
-		if (spec) convol[addr] &= ~CV_NUMBER; else convol[addr] |= CV_NUMBER; \
+		word_put(&core[addr], (uint64_t) ((reg).l & 0xffffff) << 24 | \
+			((reg).r & 0xffffff)); \
+		PAGE_WRITTEN(addr); \
+		if (!(shadow[addr].s_convol & CV_NUMBER) == !spec) \
+			shadow[addr].s_convol ^= CV_NUMBER; \
 	} else
 
 #define UNPCK(R)        { \
@@ -327,6 +424,49 @@ EXTERN uchar    dis_norm;               /* disable normalization        */
 		(R).ml |= 0x20000; \
 }
 
+/*
+ * Operand fetch and stack of run(), on addr, ui and op of the
+ * instruction; jit.c uses them for the instructions it calls out for.
+ */
+#define CHK_STACK       \
+	if (!addr && (ui.i_reg == STACKREG))    \
+		reg[STACKREG] = ADDR(reg[STACKREG] - 1);        \
+	else
+#define GET_OP  {\
+		LOAD(enreg, XADDR(addr + reg[ui.i_reg]));\
+		if (op.o_flags & F_AR) {\
+			accex = zeroword;\
+			UNPCK(enreg);\
+			UNPCK(acc);\
+		} else if (op.o_flags & F_AROP) {\
+			UNPCK(enreg);\
+		}\
+}
+#define GET_NAI_OP      {\
+	enreg.o = (addr + reg[ui.i_reg]) & 0x7f;\
+	enreg.ml = enreg.mr = 0;\
+	if (op.o_flags & F_AR) {\
+		accex = zeroword;\
+		UNPCK(acc);\
+	};\
+}
+#define GET_IMPL_OP     {\
+	if (!addr && (ui.i_reg == STACKREG) && (op.o_flags & F_STACK))\
+		reg[STACKREG] = ADDR(reg[STACKREG] - 1);\
+	if (op.o_flags & F_OP)\
+		GET_OP\
+	else if (op.o_flags & F_NAI)\
+		GET_NAI_OP;\
+}
+#define STK_PUSH        {\
+	STORE(acc, reg[STACKREG] | (supmode & sup_mmap));\
+	reg[STACKREG] = ADDR(reg[STACKREG] + 1);\
+}
+#define STK_POP         {\
+	reg[STACKREG] = ADDR(reg[STACKREG] - 1);\
+	LOAD(acc, reg[STACKREG] | (supmode & sup_mmap));\
+}
+
 #define EF_SQRT         0
 #define EF_SIN          1
 #define EF_COS          2
@@ -354,52 +494,86 @@ EXTERN uchar    dis_norm;               /* disable normalization        */
 
 EXTERN alureg_t         zeroword;
 EXTERN int              visual;         /* print registers before entering co */
-EXTERN int              breakflg;       /* break on next command */
-EXTERN int              notty;
-EXTERN int		spec, spec_saved; /* store insns store executable words */
+MACHINE int             breakflg;       /* break on next command */
+EXTERN volatile sig_atomic_t sync_rq;   /* SIGTERM: write the disks back */
+MACHINE int             notty;
+MACHINE int		spec, spec_saved; /* store insns store executable words */
 EXTERN int		no_insn_check;	/* ignore number mode except addr 0 */
-EXTERN int              stepflg;        /* "step" command flag */
-EXTERN int              cmdflg;         /* command  loop  flag */
-EXTERN int		quitflg;	/* "quit" command flag */
+EXTERN int              no_jit;         /* do not translate hot blocks  */
+MACHINE int             stepflg;        /* "step" command flag */
+MACHINE int             cmdflg;         /* command  loop  flag */
+MACHINE int		quitflg;	/* "quit" command flag */
 EXTERN int              trace;          /* trace flag */
 EXTERN int              trace_e64;	/* trace extracode 064 */
 EXTERN int              stats;          /* gather statistics flag */
-EXTERN char             *lineptr;
+EXTERN char             *stats_file;    /* --stats-file, CSV report */
+EXTERN uint             op_pairs[0120 * 0120];         /* opcode pairs seen, -s */
+EXTERN uint             op_triples[0120 * 0120 * 0120]; /* same, triples */
+EXTERN ulong            ecode_count[040];       /* extracodes 050-077 called */
+EXTERN ulong            ecode_ticks[040];       /* same, time to return */
+EXTERN ulong            addr_count[CORESZ * 2]; /* by pc | supmode */
+EXTERN ulong            addr_ticks[CORESZ * 2];
+
+/*
+ * The statistics count time in time stamp counter ticks where there is
+ * one, in nanoseconds of the monotonic clock elsewhere.  The counter
+ * runs at the reference clock, not the core clock, so these are not
+ * core cycles when the processor scales its frequency.
+ */
+#if defined(__x86_64__) || defined(__i386__)
+#define TICK_TSC
+#define TICK_UNIT       "ref-cycles"
+#else
+#define TICK_UNIT       "ns"
+#endif
+MACHINE char            *lineptr;
 EXTERN char		*punchfile;	/* card puncher file */
+MACHINE FILE		*punchout;	/* card puncher, open */
+MACHINE FILE		*lpout;		/* printing, if not on stdout */
+#define LPOUT		(lpout ? lpout : stdout)
 EXTERN uchar		punch_binary;	/* punch in binary format */
 EXTERN char             *ifile;         /* source code  */
-EXTERN jmp_buf          top;
-EXTERN ddisk_t          disks[NDISKS];  /* disks & drums        */
-EXTERN void             *drumh;         /* our drums            */
-EXTERN unsigned         lpbufh;         /* lpr buffer handle    */
-EXTERN ushort           abpc;
-EXTERN uchar            abright;
-EXTERN uchar            pout_enable;	/* e64 printing allowed */
-EXTERN uchar            pout_disable;	/* e64 printing suppressed */
+EXTERN char             *input_queue;   /* --input-queue, input buffers */
+MACHINE jmp_buf         top;
+MACHINE ddisk_t         disks[NDISKS];  /* disks & drums        */
+MACHINE void            *drumh;         /* our drums            */
+MACHINE unsigned        lpbufh;         /* lpr buffer handle    */
+MACHINE ushort          abpc;
+MACHINE uchar           abright;
+MACHINE uchar           pout_enable;	/* e64 printing allowed */
+MACHINE uchar           pout_disable;	/* e64 printing suppressed */
 EXTERN char		*pout_file;	/* e64 output file name */
 EXTERN uchar            xnative;        /* native xcodes */
 EXTERN uchar		bootstrap;	/* run without disk 2099 */
-EXTERN ushort           lasterr;
-EXTERN ushort           intercept;
-EXTERN ushort           ninter;
-EXTERN ushort           exitaddr;
-EXTERN alureg_t         user;           /* job id               */
-EXTERN struct timeval   start_time, stop_time;
-EXTERN double           excuse;
-EXTERN ushort           phdrum;
-EXTERN uint             jhbuf[JHBSZ];
-EXTERN int              jhbi;
-EXTERN uint             ecode_intr;
-
-EXTERN ushort           ehandler;
-EXTERN uint             events, emask;
-EXTERN uchar            eenab, goahead;
+MACHINE ushort          lasterr;
+MACHINE ushort          stoperr;        /* what run() stopped with */
+MACHINE ulong           ilimit;         /* instructions to run, 0 - any */
+MACHINE ulong           icnt;           /* instructions run */
+MACHINE ushort          intercept;
+MACHINE ushort          ninter;
+MACHINE ushort          exitaddr;
+MACHINE alureg_t        user;           /* job id               */
+MACHINE struct timeval   start_time, stop_time;
+MACHINE double          excuse;
+MACHINE ushort          phdrum;
+MACHINE uint            jhbuf[JHBSZ];
+MACHINE int             jhbi;
+MACHINE uint            ecode_intr;
+
+MACHINE ushort          ehandler;
+MACHINE uint            events, emask;
+MACHINE uchar           eenab, goahead;
 
 extern uchar            ctext[];
 
 extern void     stopwatch(void), startwatch(void);
 extern uchar    eraise(uint newev);
 extern void     alrm_handler(int sig);
+extern void     alarm_set(ulong usec), alarm_release(void);
+extern int      alarm_pending(void);
+#ifndef HAVE_LIBPTHREAD
+#define pthread_sigmask sigprocmask    /* one thread, one machine */
+#endif
 extern uint     to_2_10(uint src);
 extern uint	ticks_since_midnight();
 extern uint64_t	userid();
@@ -424,6 +598,7 @@ extern uint64_t	userid();
 #define E_SQRT		53		/* sqrt(x), x < 0 */
 #define E_ALOG		54		/* log(x), x <= 0 */
 #define E_EXP		55		/* exp(x), x > 44 */
+#define E_TIME          38              /* out of instructions  */
 #define E_TERM          1               /* normal termination   */
 #define E_MAX           81
 
@@ -445,8 +620,24 @@ int e62 (void);
 int e63 (void);
 
 /* arith.c */
+#ifdef FAST_ALU
+/*
+ * The 64-bit core takes over the arithmetic entry points; the original
+ * routines stay in arith.c under their own names as the reference for
+ * alu_check().
+ */
+#define add     add64
+#define mul     mul64
+#define b6div   b6div64
+#define asx     asx64
+#define norm    norm64
+int alu_check (unsigned long);
+#endif
 int add (void);
+int mul (void);
+int b6div (void);
 int asx (void);
+int norm (void);
 int elfun (int);
 int print (void);
 int physaddr (void);
@@ -464,7 +655,22 @@ void bpw (int);
 void okno (int);
 
 /* cu.c */
+ulong run (void);
 void unpack (ushort);
+void page_sync (unsigned);
+void pages_written (unsigned, unsigned);
+void convol_get (unsigned, char *, unsigned);
+void convol_put (unsigned, const char *, unsigned);
+int core_map (int);
+void core_unmap (void);
+void core_decode (unsigned, unsigned);
+int core_image (void);
+
+/* jit.c */
+#define JIT_NONE        -2              /* jit_run(): not translated    */
+#define JIT_STAY        -1              /* stopped for run() in a block */
+int jit_run (reg_t *, ulong *);
+void jit_free (void);
 
 /* dpout.c */
 void pout_decode (char *fout);
@@ -472,8 +678,17 @@ void pout_decode_file (char *inname, char *outname);
 
 /* input.c */
 int input (unsigned);
+void input_queue_path (char *buf);
+
+void ib_cleanup (void);
 
 /* vsinput.c */
-int vsinput(unsigned (*cget)(void), void (*diag)(char *), int edit);
+int vsinput(unsigned (*cget)(void), void (*diag)(char *), int edit, int mem);
+uchar *vsinput_take(size_t *len);
+
+/* libdispak.c */
+int sv_load (void);
+void sv_decode (void);
+int run_loaded (void);
 
 #endif  /* defs_h */
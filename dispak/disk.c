@@ -12,20 +12,35 @@
  */
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <errno.h>
 #include "defs.h"
 #include <time.h>
 #include "diski.h"
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
 
 extern uint64_t userid();
 
 #define PATH_DEFAULT "/.besm6:/usr/local/share/besm6"
 
 char *disk_path;
+char *disk_overlays;
+static __thread disk_t *disk_kept; /* closed volumes with deltas in memory */
 
+static int disk_free(disk_t *);
 static int disk_positioni(disk_t *, u_int);
+static off_t disk_zonepos(disk_t *, u_int);
 static int disk_makezonei(disk_t *, u_int);
 static int disk_writedescri(disk_t *, int);
 static int disk_formcodei(char *);
+static void disk_mapi(disk_t *);
+static int disk_mapzones(disk_t *, u_int);
+static int disk_saveimage(disk_t *);
+static zone_t *disk_getzone(disk_t *, u_int);
+static void *disk_overlay(disk_t *, u_int);
+static void disk_delta_path(char *, u_int);
 
 static  int     disk_readi1(disk_t *disk_descr, u_int zone, char* buf, char* convol, char* cw, u_int mode);
 static  int     disk_writei1(disk_t *disk_descr, u_int zone, char* buf,  char* convol, char* cw, u_int mode);
@@ -55,11 +70,65 @@ disk_local_path (char *buf)
 	mkdir(buf, 0755);	/* ignore errors */
 }
 
+/*
+ * Images found so far, by volume number, to save the walk over the
+ * search path on every open.  The list is shared by all the machines
+ * of the process.
+ */
+static char *disk_found[4096];
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t disk_found_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static void disk_find_pathi(char *, u_int);
+
+/*
+ * Sets the search path, a copy of it, or back to the default with 0;
+ * the images found along the old path are looked for anew.
+ */
+void
+disk_set_path (const char *path)
+{
+	static char *copy;
+	int i;
+
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_lock(&disk_found_lock);
+#endif
+	free (copy);
+	copy = path ? strdup (path) : 0;
+	disk_path = copy;
+	for (i = 0; i < 4096; ++i) {
+		free (disk_found[i]);
+		disk_found[i] = 0;
+	}
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&disk_found_lock);
+#endif
+}
+
 void
 disk_find_path (char *fname, u_int diskno)
+{
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_lock(&disk_found_lock);
+	disk_find_pathi(fname, diskno);
+	pthread_mutex_unlock(&disk_found_lock);
+#else
+	disk_find_pathi(fname, diskno);
+#endif
+}
+
+static void
+disk_find_pathi (char *fname, u_int diskno)
 {
 	char *p, *q;
 
+	if (disk_found[diskno]) {
+		strcpy (fname, disk_found[diskno]);
+		return;
+	}
+
 	if (! disk_path && ! (disk_path = getenv("BESM6_PATH")) ) {
 		char *home;
 
@@ -91,8 +160,10 @@ disk_find_path (char *fname, u_int diskno)
 
 		/* Check for disk image here. */
 		sprintf(fname + strlen(fname), "/%d", diskno);
-		if (access(fname, R_OK) >= 0)
+		if (access(fname, R_OK) >= 0) {
+			disk_found[diskno] = strdup (fname);
 			return;
+		}
 	}
 }
 
@@ -106,7 +177,7 @@ disk_open(u_int diskno, u_int mode)
 	disk_t *d;
 	char fname[256];
 	u_int f, newmode = 0;
-	int size = -1, i;
+	int size = -1, i, j;
 	ulong pos;
 
 	if (mode > DISK_READ_TOTAL) {
@@ -118,13 +189,26 @@ disk_open(u_int diskno, u_int mode)
 		return 0;
 	}
 
+	if (diskno && disk_overlays) {
+		disk_t **p;
+
+		for (p = &disk_kept; *p; p = &(*p)->d_next)
+			if ((*p)->d_diskno == diskno) {
+				d = *p;
+				*p = d->d_next;
+				d->d_mode = mode;
+				return d;
+			}
+	}
 	if (diskno) {
 		disk_find_path (fname, diskno);
 		if (access(fname, R_OK) < 0) {
 			fprintf(stderr, "disk_open: no %d image found\n", diskno);
 			return 0;
 		}
-		if (access(fname, W_OK) < 0) {
+		if (disk_overlays)
+			newmode = DISK_RW_NO_WAY;
+		else if (access(fname, W_OK) < 0) {
 			newmode = DISK_RW_NO_WAY;
 			if ((mode & DISK_READ_TOTAL) == DISK_READ_WRITE) {
 				fprintf(stderr, "disk_open: %d is write-protected\n", diskno);
@@ -133,6 +217,9 @@ disk_open(u_int diskno, u_int mode)
 		}
 		f = open(fname, newmode == DISK_RW_NO_WAY ? O_RDONLY : O_RDWR);
 	} else {
+		/* a temporary file only if there is no memory to map */
+		if ((d = disk_drum(NULL)))
+			return d;
 		disk_local_path (fname);
 		sprintf(fname + strlen(fname), "/drumXXXXXX");
 		f = mkstemp(fname);
@@ -154,7 +241,7 @@ disk_open(u_int diskno, u_int mode)
 	d->d_diskno = diskno;
 
 	if (diskno) {
-            static md_t dummy;
+            static __thread md_t dummy;
 		size = read(f, &dummy, sizeof(md_t));
 		if ((size != 4 && size != sizeof(md_t)) ||
 			memcmp(dummy.md_magic, DISK_MAGIC, 4)) {
@@ -172,6 +259,12 @@ disk_open(u_int diskno, u_int mode)
                         return 0;
                     }
                     memcpy(d->d_md[0], &dummy, size);
+                    d->d_pos = calloc(DESCR_BLOCKS * BLOCK_ZONES, sizeof(u_long));
+                    if (!d->d_pos) {
+                        fprintf(stderr, "disk_open: no memory for %d\n", diskno);
+                        disk_close(d);
+                        return 0;
+                    }
                     d->d_readi = disk_readi1;
                     d->d_writei = disk_writei1;
                     d->d_str = Chained;
@@ -185,18 +278,25 @@ disk_open(u_int diskno, u_int mode)
 
 	d->d_mode = newmode | mode;
 
-        if (d->d_str == Physical)
-            return d;
+        if (d->d_str == Physical) {
+            disk_mapi(d);
+            return disk_overlays ? disk_overlay(d, mode) : d;
+        }
 
 	/* force writing the first descriptor */
 
-	if (size == 4 && disk_writedescri(d, 0) != DISK_IO_OK)
+	if (size == 4 && ! newmode && disk_writedescri(d, 0) != DISK_IO_OK)
 		return 0;
 
 	i = 0;
 
 	while ((pos = getlong(d->d_md[i]->md_next))) {
-		i++;
+		if (++i == DESCR_BLOCKS) {
+			fprintf(stderr, "disk_open: bad disk structure of %d\n", diskno);
+			disk_close(d);
+			return 0;
+		}
+		d->d_mdpos[i] = pos;
 		d->d_md[i] = calloc(sizeof(md_t), 1);
 		if (!d->d_md[i]) {
 			fprintf(stderr, "disk_open: no memory\n");
@@ -216,7 +316,467 @@ disk_open(u_int diskno, u_int mode)
 			return 0;
 		}
 	}
-	return d;
+
+	/* index the zones once, so that they need no walk over the chain */
+	for (i = 0; i < DESCR_BLOCKS && d->d_md[i]; i++)
+		for (j = 0; j < BLOCK_ZONES; j++)
+			d->d_pos[i * BLOCK_ZONES + j] =
+				getlong(d->d_md[i]->md_pos[j]);
+	return disk_overlays ? disk_overlay(d, mode) : d;
+}
+
+/*
+ * Handles of numbered volumes, kept open between exchanges by
+ * disk_get() until they are pushed out by other volumes, dropped by
+ * disk_uncache() or closed by disk_flush().  A volume has one handle
+ * at most, switched to the mode each caller asks for, so a Chained
+ * image never has two copies of its descriptors in memory.
+ */
+#define DISK_CACHE      8
+
+static __thread struct {
+	disk_t  *c_disk;
+	ulong   c_used;                 /* last use, for LRU            */
+} disk_cache[DISK_CACHE];
+static __thread ulong disk_clock;
+
+void *
+disk_get(u_int diskno, u_int mode)
+{
+	int i, lru = 0;
+
+	for (i = 0; i < DISK_CACHE; ++i) {
+		disk_t *d = disk_cache[i].c_disk;
+
+		if (d && d->d_diskno == diskno) {
+			if (disk_setmode(d, mode) != DISK_IO_OK)
+				return 0;
+			disk_cache[i].c_used = ++disk_clock;
+			return d;
+		}
+		if (!d)
+			disk_cache[i].c_used = 0;
+		if (disk_cache[i].c_used < disk_cache[lru].c_used)
+			lru = i;
+	}
+	if (disk_cache[lru].c_disk)
+		disk_close(disk_cache[lru].c_disk);
+	disk_cache[lru].c_disk = disk_open(diskno, mode);
+	disk_cache[lru].c_used = ++disk_clock;
+	return disk_cache[lru].c_disk;
+}
+
+void
+disk_uncache(u_int diskno)
+{
+	int i;
+
+	for (i = 0; i < DISK_CACHE; ++i)
+		if (disk_cache[i].c_disk &&
+		    disk_cache[i].c_disk->d_diskno == diskno) {
+			disk_close(disk_cache[i].c_disk);
+			disk_cache[i].c_disk = 0;
+		}
+}
+
+void
+disk_flush(void)
+{
+	int i;
+
+	for (i = 0; i < DISK_CACHE; ++i)
+		if (disk_cache[i].c_disk) {
+			disk_close(disk_cache[i].c_disk);
+			disk_cache[i].c_disk = 0;
+		}
+}
+
+/*
+ * Zone writes to image files are handed to a writer thread through a
+ * short queue, so that the machine does not wait for the disk; reads
+ * look into the queue before the file.  wb_drain() is the barrier:
+ * it waits for the queue to empty and tells if any write to the volume
+ * failed, so that a machine does not see the failures of another.
+ * Without threads the zones are written at once.
+ */
+#define WB_QUEUE        16
+
+typedef struct wbzone {
+	disk_t  *w_disk;
+	u_int   w_zone;
+	off_t   w_pos;
+	size_t  w_len;
+	union {
+		char    w_raw[ZONE_SIZE];
+		zone_t  w_z;
+	} w_u;
+} wbzone_t;
+
+#ifdef HAVE_LIBPTHREAD
+static wbzone_t wb_queue[WB_QUEUE];
+static int wb_head, wb_count;           /* oldest entry, entries queued */
+static int wb_state;                    /* 0 not started, 1 running, -1 failed */
+static pthread_t wb_thread;
+static pthread_mutex_t wb_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wb_more = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t wb_less = PTHREAD_COND_INITIALIZER;
+
+/*
+ * The writer owns the oldest entry while it writes it; the machines
+ * of the process fill the next free one under the lock.
+ */
+static void *
+wb_writer(void *arg)
+{
+	wbzone_t *w;
+	int failed;
+
+	pthread_mutex_lock(&wb_lock);
+	for (;;) {
+		while (! wb_count)
+			pthread_cond_wait(&wb_more, &wb_lock);
+		w = &wb_queue[wb_head];
+		pthread_mutex_unlock(&wb_lock);
+		failed = pwrite(w->w_disk->d_fileno, &w->w_u, w->w_len,
+			w->w_pos) != (ssize_t) w->w_len;
+		if (failed)
+			perror("disk_writei");
+		pthread_mutex_lock(&wb_lock);
+		if (failed)
+			w->w_disk->d_wbfail = 1;
+		wb_head = (wb_head + 1) % WB_QUEUE;
+		--wb_count;
+		pthread_cond_broadcast(&wb_less);
+	}
+	return 0;
+}
+
+/*
+ * fork() does not take the writer along: the queue is drained and
+ * held locked across it, and the child starts a writer of its own
+ * on its first write.
+ */
+static void
+wb_prefork(void)
+{
+	pthread_mutex_lock(&wb_lock);
+	while (wb_count)
+		pthread_cond_wait(&wb_less, &wb_lock);
+}
+
+static void
+wb_postfork(void)
+{
+	pthread_mutex_unlock(&wb_lock);
+}
+
+static void
+wb_postfork_child(void)
+{
+	pthread_mutex_init(&wb_lock, 0);
+	pthread_cond_init(&wb_more, 0);
+	pthread_cond_init(&wb_less, 0);
+	wb_state = 0;
+}
+#endif
+
+static int
+disk_putzone(disk_t *d, u_int zone, off_t pos, void *data, size_t len)
+{
+#ifdef HAVE_LIBPTHREAD
+	wbzone_t *w;
+
+	static int atfork;
+
+	pthread_mutex_lock(&wb_lock);
+	if (! wb_state) {
+		wb_state = pthread_create(&wb_thread, 0, wb_writer, 0) ? -1 : 1;
+		if (wb_state > 0 && ! atfork++)
+			pthread_atfork(wb_prefork, wb_postfork, wb_postfork_child);
+	}
+	if (wb_state > 0) {
+		while (wb_count == WB_QUEUE)
+			pthread_cond_wait(&wb_less, &wb_lock);
+		w = &wb_queue[(wb_head + wb_count) % WB_QUEUE];
+		w->w_disk = d;
+		w->w_zone = zone;
+		w->w_pos = pos;
+		w->w_len = len;
+		memcpy(&w->w_u, data, len);
+		++wb_count;
+		pthread_cond_signal(&wb_more);
+		pthread_mutex_unlock(&wb_lock);
+		return DISK_IO_OK;
+	}
+	pthread_mutex_unlock(&wb_lock);
+#endif
+	if (pwrite(d->d_fileno, data, len, pos) != (ssize_t) len) {
+		perror("disk_writei");
+		return DISK_IO_ENWRITE;
+	}
+	return DISK_IO_OK;
+}
+
+/* copies the latest queued write of the zone, if there is one */
+static int
+wb_find(disk_t *d, u_int zone, void *data, size_t len)
+{
+#ifdef HAVE_LIBPTHREAD
+	wbzone_t *w;
+	int i, found = 0;
+
+	pthread_mutex_lock(&wb_lock);
+	for (i = wb_count - 1; i >= 0; --i) {
+		w = &wb_queue[(wb_head + i) % WB_QUEUE];
+		if (w->w_disk == d && w->w_zone == zone) {
+			memcpy(data, &w->w_u, len);
+			found = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&wb_lock);
+	return found;
+#else
+	return 0;
+#endif
+}
+
+/* waits for the queue to empty; tells if a write to d failed */
+static int
+wb_drain(disk_t *d)
+{
+	int r = DISK_IO_OK;
+
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_lock(&wb_lock);
+	while (wb_state > 0 && wb_count)
+		pthread_cond_wait(&wb_less, &wb_lock);
+	if (d && d->d_wbfail) {
+		r = DISK_IO_ENWRITE;
+		d->d_wbfail = 0;
+	}
+	pthread_mutex_unlock(&wb_lock);
+#endif
+	return r;
+}
+
+/* the end of a Chained image, counting the zones still queued */
+static off_t
+disk_endi(disk_t *d, size_t len)
+{
+	off_t pos = lseek(d->d_fileno, 0, SEEK_END);
+
+	if (pos < d->d_end)
+		pos = d->d_end;
+	d->d_end = pos + len;
+	return pos;
+}
+
+/*
+ * Zones of Chained images, and of Physical ones that could not be
+ * mapped, go through a write-back cache shared by all the volumes of
+ * the machine; each thread running a machine has a cache of its own.
+ * A zone written stays dirty in memory until other zones push it
+ * out, its volume is closed, or disk_sync() is called (by terminate()
+ * and on SIGTERM).  Mapped zones are in the page cache already and
+ * never come here.  The cache holds zcache_size zones; 0 turns it off.
+ */
+#define ZC_HASH         256
+#define ZC_BUCKET(d,z)  (((d)->d_diskno * 67 + (z)) % ZC_HASH)
+
+typedef struct zcache {
+	disk_t  *c_disk;                /* NULL if the slot is free     */
+	u_int   c_zone;
+	u_char  c_dirty;
+	ulong   c_used;                 /* last use, for LRU            */
+	struct zcache *c_next;          /* in the hash chain            */
+	union {
+		char    c_raw[ZONE_SIZE];       /* Chained */
+		zone_t  c_z;                    /* Physical */
+	} c_u;
+} zcache_t;
+
+u_int   zcache_size = 64;
+__thread u_long zcache_hits, zcache_misses, zcache_writebacks;
+
+static __thread zcache_t *zcache, *zc_hash[ZC_HASH];
+static __thread ulong zc_clock;
+
+static zcache_t *
+zc_find(disk_t *d, u_int zone)
+{
+	zcache_t *c;
+
+	if (! zcache_size)
+		return 0;
+	for (c = zc_hash[ZC_BUCKET(d, zone)]; c; c = c->c_next)
+		if (c->c_disk == d && c->c_zone == zone) {
+			c->c_used = ++zc_clock;
+			++zcache_hits;
+			return c;
+		}
+	++zcache_misses;
+	return 0;
+}
+
+static void
+zc_unlink(zcache_t *c)
+{
+	zcache_t **p = &zc_hash[ZC_BUCKET(c->c_disk, c->c_zone)];
+
+	while (*p != c)
+		p = &(*p)->c_next;
+	*p = c->c_next;
+	c->c_disk = 0;
+}
+
+static int
+zc_writeback(zcache_t *c)
+{
+	disk_t *d = c->c_disk;
+
+	if (! c->c_dirty)
+		return DISK_IO_OK;
+	c->c_dirty = 0;
+	++zcache_writebacks;
+	if (d->d_str == Chained) {
+		if (disk_positioni(d, c->c_zone) == DISK_IO_NEW &&
+		    disk_makezonei(d, c->c_zone) != DISK_IO_OK)
+			return DISK_IO_ENWRITE;
+		return disk_putzone(d, c->c_zone, disk_zonepos(d, c->c_zone),
+			c->c_u.c_raw, ZONE_SIZE);
+	}
+	return disk_putzone(d, c->c_zone, (off_t) c->c_zone * sizeof(zone_t),
+		&c->c_u.c_z, sizeof(zone_t));
+}
+
+/*
+ * Gives a slot for the zone, writing back the least recently used
+ * one if need be; *cp is NULL when the cache is off.
+ */
+static int
+zc_alloc(disk_t *d, u_int zone, zcache_t **cp)
+{
+	zcache_t *c, *lru;
+	int b = ZC_BUCKET(d, zone);
+
+	*cp = 0;
+	if (! zcache_size)
+		return DISK_IO_OK;
+	if (! zcache && ! (zcache = calloc(zcache_size, sizeof(zcache_t)))) {
+		fprintf(stderr, "disk: no memory for %u cached zones\n", zcache_size);
+		zcache_size = 0;
+		return DISK_IO_OK;
+	}
+	lru = zcache;
+	for (c = zcache; c < zcache + zcache_size; ++c) {
+		if (! c->c_disk) {
+			lru = c;
+			break;
+		}
+		if (c->c_used < lru->c_used)
+			lru = c;
+	}
+	if (lru->c_disk) {
+		int r = zc_writeback(lru);
+
+		zc_unlink(lru);
+		if (r != DISK_IO_OK)
+			return r;
+	}
+	lru->c_disk = d;
+	lru->c_zone = zone;
+	lru->c_dirty = 0;
+	lru->c_used = ++zc_clock;
+	lru->c_next = zc_hash[b];
+	zc_hash[b] = lru;
+	*cp = lru;
+	return DISK_IO_OK;
+}
+
+/* writes back and forgets the cached zones of a volume */
+static int
+zc_drop(disk_t *d)
+{
+	zcache_t *c;
+	int r = DISK_IO_OK;
+
+	if (! zcache)
+		return r;
+	for (c = zcache; c < zcache + zcache_size; ++c)
+		if (c->c_disk == d) {
+			if (zc_writeback(c) != DISK_IO_OK)
+				r = DISK_IO_ENWRITE;
+			zc_unlink(c);
+		}
+	return r;
+}
+
+/*
+ * Frees the volumes with deltas in memory the thread has kept, and
+ * its zone cache once all its volumes are closed.
+ */
+void
+disk_release(void)
+{
+	zcache_t *c;
+	disk_t *d;
+
+	while ((d = disk_kept)) {
+		disk_kept = d->d_next;
+		disk_free(d);
+	}
+	if (! zcache)
+		return;
+	for (c = zcache; c < zcache + zcache_size; ++c)
+		if (c->c_disk)
+			return;
+	free(zcache);
+	zcache = 0;
+}
+
+static int
+disk_syncdescr(disk_t *d)
+{
+#ifndef synchronous_descriptors
+	int i;
+
+	if (d->d_str != Chained)
+		return DISK_IO_OK;
+	for (i = 0; i < DESCR_BLOCKS && d->d_md[i]; i++) {
+		if (d->d_modif[i]) {
+			if (pwrite(d->d_fileno, d->d_md[i], sizeof(md_t),
+			    d->d_mdpos[i]) != sizeof(md_t)) {
+				perror("disk_close");
+				return DISK_IO_ENWRITE;
+			}
+			d->d_modif[i] = 0;
+		}
+	}
+#endif
+	return DISK_IO_OK;
+}
+
+/*
+ * Writes all the dirty zones and descriptors back, keeping the
+ * volumes open; called from terminate() and from the signal handler.
+ */
+void
+disk_sync(void)
+{
+	zcache_t *c;
+	int i;
+
+	if (zcache)
+		for (c = zcache; c < zcache + zcache_size; ++c)
+			if (c->c_disk) {
+				zc_writeback(c);
+				disk_syncdescr(c->c_disk);
+			}
+	wb_drain(0);
+	for (i = 0; i < DISK_CACHE; ++i)
+		if (disk_cache[i].c_disk)
+			disk_syncdescr(disk_cache[i].c_disk);
 }
 
 /*
@@ -226,34 +786,62 @@ int
 disk_close(void *ud)
 {
 	disk_t *d = (disk_t *) ud;
-	int i;
-	ulong pos = 0;
 	if (! d || d->d_magic != DESCR_MAGIC) {
 		fprintf(stderr, "disk_close: bad descriptor\n");
 		return DISK_IO_FATAL;
 	}
 
-	if (d->d_str == Chained) {
-            for (i = 0; i < DESCR_BLOCKS; i++) {
-		if (d->d_md[i]) {
+	if (d->d_base && d->d_fileno < 0 && disk_overlays) {
+		/* a delta in memory is kept till the end of the run */
+		d->d_next = disk_kept;
+		disk_kept = d;
+		return DISK_IO_OK;
+	}
+	return disk_free(d);
+}
 
-#ifndef synchronous_descriptors
-			if (d->d_modif[i]) {
-				lseek(d->d_fileno, pos, SEEK_SET);
-				if (write(d->d_fileno, d->d_md[i], sizeof(md_t)) != sizeof(md_t)) {
-					perror("disk_close");
-					return DISK_IO_ENWRITE;
-				}
-			}
-			pos = getlong(d->d_md[i]->md_next);
-#endif
-			free(d->d_md[i]);
+/* writes back and frees everything the volume holds */
+static int
+disk_free(disk_t *d)
+{
+	int i, r;
+
+	r = zc_drop(d);
+	if (wb_drain(d) != DISK_IO_OK)
+		r = DISK_IO_ENWRITE;
+	if (d->d_base) {
+		if (disk_close(d->d_base) != DISK_IO_OK)
+			r = DISK_IO_ENWRITE;
+		/* a delta nothing was written to is not worth keeping */
+		if (! d->d_zones && d->d_fileno >= 0 && disk_overlays) {
+			char fname[256];
+
+			disk_delta_path(fname, d->d_diskno);
+			unlink(fname);
 		}
-            }
 	}
+	if (d->d_str == Chained) {
+		if (disk_syncdescr(d) != DISK_IO_OK)
+			return DISK_IO_ENWRITE;
+		for (i = 0; i < DESCR_BLOCKS; i++)
+			if (d->d_md[i])
+				free(d->d_md[i]);
+		free(d->d_pos);
+	}
+	if (d->d_fileno < 0) {
+		/* a drum in memory */
+		if (d->d_image && disk_saveimage(d) != DISK_IO_OK)
+			r = DISK_IO_ENWRITE;
+		munmap(d->d_map, d->d_mapped * sizeof(zone_t));
+		free(d->d_image);
+		free(d);
+		return r;
+	}
+	if (d->d_map)
+		munmap(d->d_map, d->d_mapped * sizeof(zone_t));
 	close(d->d_fileno);
 	free(d);
-	return DISK_IO_OK;
+	return r;
 }
 
 int
@@ -305,6 +893,9 @@ disk_readi(void *ud, u_int zone, char *buf, char *convol, char *check, u_int mod
 
 int disk_readi1(disk_t *d, u_int zone, char *buf, char *convol, char *check, u_int mode)
 {
+	zcache_t *zc;
+	char *to;
+
 /*	fprintf(stderr, "disk_readi1: %d zone %o\n", d->d_diskno, zone);*/
 	if (zone >= DESCR_BLOCKS * BLOCK_ZONES) {
 		fprintf(stderr, "disk_readi: bad zone number %o for disk %d\n",
@@ -318,24 +909,38 @@ int disk_readi1(disk_t *d, u_int zone, char *buf, char *convol, char *check, u_i
             mode = DISK_MODE_QUIET;
         }
 
-	if (disk_positioni(d, zone) == DISK_IO_NEW) {
-		switch (mode) {
-		case DISK_MODE_QUIET:
-			if (getenv("ZERODRUM") == 0 || d->d_diskno != 0)
-				disk_formcodei(buf);
-			else
-				memset(buf, 0, ZONE_SIZE);
-
-			return DISK_IO_OK;
-
-		case DISK_MODE_LOUD:
-			return DISK_IO_NEW;
+	if (buf && (zc = zc_find(d, zone)))
+		memcpy(buf, zc->c_u.c_raw, ZONE_SIZE);
+	else {
+		if (disk_positioni(d, zone) == DISK_IO_NEW) {
+			switch (mode) {
+			case DISK_MODE_QUIET:
+				if (getenv("ZERODRUM") == 0 || d->d_diskno != 0)
+					disk_formcodei(buf);
+				else
+					memset(buf, 0, ZONE_SIZE);
+
+				return DISK_IO_OK;
+
+			case DISK_MODE_LOUD:
+				return DISK_IO_NEW;
+			}
+		}
+		if (buf) {
+			if (zc_alloc(d, zone, &zc) != DISK_IO_OK)
+				return DISK_IO_ENREAD;
+			to = zc ? zc->c_u.c_raw : buf;
+			if (! wb_find(d, zone, to, ZONE_SIZE) &&
+			    pread(d->d_fileno, to, ZONE_SIZE,
+			    disk_zonepos(d, zone)) != ZONE_SIZE) {
+				if (zc)
+					zc_unlink(zc);
+				perror("disk_readi");
+				return DISK_IO_ENREAD;
+			}
+			if (zc)
+				memcpy(buf, zc->c_u.c_raw, ZONE_SIZE);
 		}
-	}
-
-	if (buf && read(d->d_fileno, buf, ZONE_SIZE) != ZONE_SIZE) {
-		perror("disk_readi");
-		return DISK_IO_ENREAD;
 	}
         if (convol) {
             // 0 means insn, 1 means data
@@ -348,51 +953,841 @@ int disk_readi1(disk_t *d, u_int zone, char *buf, char *convol, char *check, u_i
 	return DISK_IO_OK;
 }
 
-static zone_t zone_buf;
+/*
+ * Zone conversion kernels.  A zone_t keeps each word in the low 48
+ * bits of a uint64_t in host order, with the convolution tag above
+ * (1 for instructions, 2 for data); the callers' buffers have 6 bytes
+ * a word, most significant first, and one byte of convol[] a word,
+ * 1 for data.  The scalar kernels are the reference; on x86-64 the
+ * SSSE3 and AVX2 ones are picked at run time when the processor has
+ * them.  The vector loops leave the last few words to the scalar
+ * code, so that no load or store goes beyond the buffers.
+ */
+#define W48     ((1LL << 48) - 1)
+
+typedef struct {
+	const char *k_name;
+	void (*k_unpack)(const uint64_t *, u_char *, int);
+	void (*k_tags)(const uint64_t *, u_char *, int);
+	void (*k_pack)(const u_char *, const u_char *, uint64_t *, int);
+	uint64_t (*k_sum)(const uint64_t *, int);
+} zkernel_t;
+
+static void
+unpack_scalar(const uint64_t *z, u_char *buf, int n)
+{
+	int i;
+
+	for (i = 0; i < n; ++i, buf += 6)
+		word_put((word_t *) buf, z[i]);
+}
 
-int disk_readi2(disk_t *d, u_int zone, char *buf, char *convol, char *check, u_int mode)
+static void
+tags_scalar(const uint64_t *z, u_char *convol, int n)
 {
-/*	fprintf(stderr, "disk_readi2: %d zone %o\n", d->d_diskno, zone);*/
-        if (mode != DISK_MODE_PHYS) {
-            zone += ZONE_OFFSET;
-        }
+	int i;
+
+	for (i = 0; i < n; ++i)
+		convol[i] = ((z[i] >> 48) ^ 1) & 1;
+}
 
-        off_t max = lseek(d->d_fileno, 0, SEEK_END);
+static void
+pack_scalar(const u_char *buf, const u_char *convol, uint64_t *z, int n)
+{
+	int i;
 
-        off_t cur = lseek(d->d_fileno, zone * sizeof(zone_t), SEEK_SET);
+	for (i = 0; i < n; ++i, buf += 6)
+		z[i] = word_get((const word_t *) buf) |
+			(convol && convol[i] ? 2LL : 1LL) << 48;
+}
 
-	if (cur >= max) {
-            if (mode == DISK_MODE_LOUD)
-                return DISK_IO_NEW;
-            if (getenv("ZERODRUM") == 0 || d->d_diskno != 0)
-                disk_formcodei(buf);
-            else
-                memset(buf, 0, ZONE_SIZE);
-            return DISK_IO_OK;
-	}
+/* sum of the words with end-around carry */
+static uint64_t
+sum_scalar(const uint64_t *z, int n)
+{
+	uint64_t sum = 0;
+	int i;
 
-	if (read(d->d_fileno, &zone_buf, sizeof(zone_t)) != sizeof(zone_t)) {
-		perror("disk_readi");
-		return DISK_IO_ENREAD;
-	}
-        if (buf) {
-		int i, j;
-		for (i = 0; i < 1024; ++i) {
-			for (j = 0; j < 48; j += 8)
-				*buf++ = zone_buf.z_data[i] >> (40-j);
-		}
+	for (i = 0; i < n; ++i) {
+		sum += z[i] & W48;
+		sum = (sum & W48) + (sum >> 48);
 	}
-        if (convol) {
-		int i;
-		for (i = 0; i < 1024; ++i)
-			convol[i] = ((zone_buf.z_data[i] >> 48) ^ 1) & 1;
+	return sum;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+
+#define SSSE3   __attribute__((target("ssse3")))
+#define AVX2    __attribute__((target("avx2")))
+
+/*
+ * Adding up to 2^16 words of 48 bits cannot overflow 64, so the
+ * vector sums fold the carries once a chunk; that gives the same
+ * value as folding after every word, as the carry is end-around.
+ */
+#define SUMCHUNK	(1 << 15)
+
+static uint64_t
+sum_fold(uint64_t sum)
+{
+	while (sum >> 48)
+		sum = (sum & W48) + (sum >> 48);
+	return sum;
+}
+
+static uint64_t
+sum_chunks(uint64_t (*sum1)(const uint64_t *, int), const uint64_t *z, int n)
+{
+	uint64_t sum = 0;
+	int i;
+
+	for (i = 0; i < n; i += SUMCHUNK)
+		sum = sum_fold(sum + sum1(z + i, n - i < SUMCHUNK ? n - i : SUMCHUNK));
+	return sum;
+}
+
+static SSSE3 void
+unpack_ssse3(const uint64_t *z, u_char *buf, int n)
+{
+	const __m128i be = _mm_setr_epi8(5, 4, 3, 2, 1, 0,
+		13, 12, 11, 10, 9, 8, -1, -1, -1, -1);
+	int i;
+
+	for (i = 0; i + 3 <= n; i += 2)
+		_mm_storeu_si128((__m128i *) (buf + i * 6), _mm_shuffle_epi8(
+			_mm_loadu_si128((const __m128i *) (z + i)), be));
+	unpack_scalar(z + i, buf + i * 6, n - i);
+}
+
+static SSSE3 void
+tags_ssse3(const uint64_t *z, u_char *convol, int n)
+{
+	const __m128i one = _mm_set1_epi8(1);
+	__m128i t, sel[8];
+	int i, k;
+
+	/* word 2k of a block of 16 to byte 2k, word 2k+1 to 2k+1 */
+	for (k = 0; k < 8; ++k) {
+		char m[16];
+
+		memset(m, -1, sizeof(m));
+		m[2 * k] = 6;
+		m[2 * k + 1] = 14;
+		sel[k] = _mm_loadu_si128((const __m128i *) m);
 	}
-        if (check) {
-		int i, j;
-		for (i = 0; i < 8; ++i) {
-			for (j = 0; j < 48; j += 8)
-				*check++ = zone_buf.z_cwords[i] >> (40-j);
+	for (i = 0; i + 16 <= n; i += 16) {
+		t = _mm_setzero_si128();
+		for (k = 0; k < 8; ++k)
+			t = _mm_or_si128(t, _mm_shuffle_epi8(_mm_loadu_si128(
+				(const __m128i *) (z + i + 2 * k)), sel[k]));
+		_mm_storeu_si128((__m128i *) (convol + i), _mm_andnot_si128(t, one));
+	}
+	tags_scalar(z + i, convol + i, n - i);
+}
+
+static SSSE3 void
+pack_ssse3(const u_char *buf, const u_char *convol, uint64_t *z, int n)
+{
+	const __m128i le = _mm_setr_epi8(5, 4, 3, 2, 1, 0, -1, -1,
+		11, 10, 9, 8, 7, 6, -1, -1);
+	const __m128i tagpos = _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 0, -1,
+		-1, -1, -1, -1, -1, -1, 1, -1);
+	const __m128i two = _mm_set1_epi8(2);
+	__m128i w, t = _mm_set_epi64x(1LL << 48, 1LL << 48);
+	int i;
+
+	for (i = 0; i + 3 <= n; i += 2) {
+		w = _mm_shuffle_epi8(_mm_loadu_si128(
+			(const __m128i *) (buf + i * 6)), le);
+		if (convol) {
+			u_short c;
+
+			memcpy(&c, convol + i, 2);
+			/* 2 for a non-zero byte, 1 for zero */
+			t = _mm_add_epi8(two, _mm_cmpeq_epi8(
+				_mm_cvtsi32_si128(c), _mm_setzero_si128()));
+			t = _mm_shuffle_epi8(t, tagpos);
 		}
+		_mm_storeu_si128((__m128i *) (z + i), _mm_or_si128(w, t));
+	}
+	pack_scalar(buf + i * 6, convol ? convol + i : 0, z + i, n - i);
+}
+
+static SSSE3 uint64_t
+sum1_ssse3(const uint64_t *z, int n)
+{
+	const __m128i m = _mm_set1_epi64x(W48);
+	__m128i s = _mm_setzero_si128();
+	uint64_t r[2];
+	int i;
+
+	for (i = 0; i + 2 <= n; i += 2)
+		s = _mm_add_epi64(s, _mm_and_si128(m,
+			_mm_loadu_si128((const __m128i *) (z + i))));
+	_mm_storeu_si128((__m128i *) r, s);
+	r[0] += r[1];
+	for (; i < n; ++i)
+		r[0] += z[i] & W48;
+	return sum_fold(r[0]);
+}
+
+static SSSE3 uint64_t
+sum_ssse3(const uint64_t *z, int n)
+{
+	return sum_chunks(sum1_ssse3, z, n);
+}
+
+static AVX2 void
+unpack_avx2(const uint64_t *z, u_char *buf, int n)
+{
+	const __m256i be = _mm256_setr_epi8(5, 4, 3, 2, 1, 0,
+		13, 12, 11, 10, 9, 8, -1, -1, -1, -1,
+		5, 4, 3, 2, 1, 0, 13, 12, 11, 10, 9, 8, -1, -1, -1, -1);
+	__m256i w;
+	int i;
+
+	/* each lane makes 12 bytes; the second store covers the gap */
+	for (i = 0; i + 5 <= n; i += 4) {
+		w = _mm256_shuffle_epi8(_mm256_loadu_si256(
+			(const __m256i *) (z + i)), be);
+		_mm_storeu_si128((__m128i *) (buf + i * 6),
+			_mm256_castsi256_si128(w));
+		_mm_storeu_si128((__m128i *) (buf + i * 6 + 12),
+			_mm256_extracti128_si256(w, 1));
+	}
+	unpack_scalar(z + i, buf + i * 6, n - i);
+}
+
+static AVX2 void
+pack_avx2(const u_char *buf, const u_char *convol, uint64_t *z, int n)
+{
+	const __m256i le = _mm256_setr_epi8(5, 4, 3, 2, 1, 0, -1, -1,
+		11, 10, 9, 8, 7, 6, -1, -1,
+		5, 4, 3, 2, 1, 0, -1, -1, 11, 10, 9, 8, 7, 6, -1, -1);
+	const __m256i tagpos = _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, 0, -1,
+		-1, -1, -1, -1, -1, -1, 1, -1,
+		-1, -1, -1, -1, -1, -1, 2, -1, -1, -1, -1, -1, -1, -1, 3, -1);
+	const __m256i two = _mm256_set1_epi8(2);
+	__m256i w, t = _mm256_set1_epi64x(1LL << 48);
+	int i;
+
+	for (i = 0; i + 5 <= n; i += 4) {
+		w = _mm256_inserti128_si256(_mm256_castsi128_si256(
+			_mm_loadu_si128((const __m128i *) (buf + i * 6))),
+			_mm_loadu_si128((const __m128i *) (buf + i * 6 + 12)), 1);
+		w = _mm256_shuffle_epi8(w, le);
+		if (convol) {
+			int c;
+
+			memcpy(&c, convol + i, 4);
+			t = _mm256_add_epi8(two, _mm256_cmpeq_epi8(
+				_mm256_set1_epi32(c), _mm256_setzero_si256()));
+			t = _mm256_shuffle_epi8(t, tagpos);
+		}
+		_mm256_storeu_si256((__m256i *) (z + i), _mm256_or_si256(w, t));
+	}
+	pack_scalar(buf + i * 6, convol ? convol + i : 0, z + i, n - i);
+}
+
+static AVX2 uint64_t
+sum1_avx2(const uint64_t *z, int n)
+{
+	const __m256i m = _mm256_set1_epi64x(W48);
+	__m256i s = _mm256_setzero_si256();
+	uint64_t r[4];
+	int i;
+
+	for (i = 0; i + 4 <= n; i += 4)
+		s = _mm256_add_epi64(s, _mm256_and_si256(m,
+			_mm256_loadu_si256((const __m256i *) (z + i))));
+	_mm256_storeu_si256((__m256i *) r, s);
+	r[0] += r[1] + r[2] + r[3];
+	for (; i < n; ++i)
+		r[0] += z[i] & W48;
+	return sum_fold(r[0]);
+}
+
+static AVX2 uint64_t
+sum_avx2(const uint64_t *z, int n)
+{
+	return sum_chunks(sum1_avx2, z, n);
+}
+#endif
+
+static const zkernel_t zkernels[] = {
+	{ "scalar", unpack_scalar, tags_scalar, pack_scalar, sum_scalar },
+#if defined(__GNUC__) && defined(__x86_64__)
+	{ "ssse3", unpack_ssse3, tags_ssse3, pack_ssse3, sum_ssse3 },
+	{ "avx2", unpack_avx2, tags_ssse3, pack_avx2, sum_avx2 },
+#endif
+	{ 0 },
+};
+
+static int
+zkernel_usable(const zkernel_t *k)
+{
+#if defined(__GNUC__) && defined(__x86_64__)
+	if (! strcmp(k->k_name, "ssse3"))
+		return __builtin_cpu_supports("ssse3");
+	if (! strcmp(k->k_name, "avx2"))
+		return __builtin_cpu_supports("avx2");
+#endif
+	return 1;
+}
+
+/* the last usable kernel in the table is the fastest */
+static const zkernel_t *
+zkernel(void)
+{
+	static __thread const zkernel_t *best;
+	const zkernel_t *k;
+
+	if (! best)
+		for (k = zkernels; k->k_name; ++k)
+			if (zkernel_usable(k))
+				best = k;
+	return best;
+}
+
+/*
+ * Time each usable kernel on mb megabytes of zone data and check it
+ * against the scalar one; returns the number of kernels that differ.
+ */
+int
+disk_bench(unsigned long mb)
+{
+	int n = mb * 1024 * 1024 / 8 + 13, reps, r, bad = 0, i;
+	const zkernel_t *k;
+	uint64_t *z, *z2, sum0 = 0, seed = 1;
+	u_char *buf, *cv, *buf0, *cv0;
+	struct timeval t0, t1;
+	double sec;
+
+	/* an odd count exercises the scalar tails too */
+	z = malloc(n * 8);
+	z2 = malloc(n * 8);
+	buf = malloc(n * 6);
+	buf0 = malloc(n * 6);
+	cv = malloc(n);
+	cv0 = malloc(n);
+	if (! z || ! z2 || ! buf || ! buf0 || ! cv || ! cv0) {
+		fprintf(stderr, "disk_bench: out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < n; ++i) {
+		seed ^= seed << 13;
+		seed ^= seed >> 7;
+		seed ^= seed << 17;
+		z[i] = (seed & W48) | (seed >> 63 ? 2LL : 1LL) << 48;
+	}
+	reps = 1 + 256 / (mb ? mb : 1);
+	printf("kernel\tunpack\ttags\tpack\tsum\t(GB/s of zone words)\n");
+	for (k = zkernels; k->k_name; ++k) {
+		double gbs[4];
+		uint64_t sum = 0;
+		int t;
+
+		if (! zkernel_usable(k))
+			continue;
+		for (t = 0; t < 4; ++t) {
+			gettimeofday(&t0, NULL);
+			for (r = 0; r < reps; ++r)
+				switch (t) {
+				case 0: k->k_unpack(z, buf, n); break;
+				case 1: k->k_tags(z, cv, n); break;
+				case 2: k->k_pack(buf, cv, z2, n); break;
+				case 3: sum += k->k_sum(z, n); break;
+				}
+			gettimeofday(&t1, NULL);
+			sec = TIMEDIFF(t0, t1);
+			gbs[t] = sec > 0 ? (double) n * 8 * reps / sec / 1e9 : 0;
+		}
+		sum /= reps;
+		if (k == zkernels) {
+			memcpy(buf0, buf, n * 6);
+			memcpy(cv0, cv, n);
+			sum0 = sum;
+		}
+		if (memcmp(buf, buf0, n * 6) || memcmp(cv, cv0, n) ||
+		    memcmp(z, z2, n * 8) || sum != sum0) {
+			printf("%s: results differ from scalar\n", k->k_name);
+			++bad;
+		}
+		printf("%s\t%.2f\t%.2f\t%.2f\t%.2f\n", k->k_name,
+			gbs[0], gbs[1], gbs[2], gbs[3]);
+	}
+	free(z);
+	free(z2);
+	free(buf);
+	free(buf0);
+	free(cv);
+	free(cv0);
+	return bad;
+}
+
+static __thread zone_t zone_buf;
+
+/*
+ * Physical images are mapped whole, shared, so that the zones are
+ * decoded from the page cache straight into core, and read-only
+ * volumes are shared by all the emulators running.  The file is only
+ * ever grown by pwrite() of the zones written beyond the mapping, as
+ * before, so two emulators appending to the same volume cannot cut
+ * off each other's zones.  Once the file has grown DISK_EXTENT zones
+ * past the mapping, the next write past it extends the mapping to the
+ * whole file.  Where mmap() fails, the zones go through zone_buf as
+ * before.
+ */
+#define DISK_EXTENT     256
+
+static void
+disk_mapi(disk_t *d)
+{
+	struct stat st;
+	void *m;
+
+	if (fstat(d->d_fileno, &st) < 0)
+		return;
+	/* a partial zone at the end is not there, as it was not mapped */
+	d->d_zones = d->d_mapped = st.st_size / sizeof(zone_t);
+	if (! d->d_mapped)
+		return;
+	m = mmap(0, d->d_mapped * sizeof(zone_t), d->d_mode & DISK_RW_NO_WAY ?
+		PROT_READ : PROT_READ | PROT_WRITE, MAP_SHARED, d->d_fileno, 0);
+	if (m == MAP_FAILED)
+		d->d_mapped = 0;
+	else
+		d->d_map = m;
+}
+
+/* maps zones up to n, if the file has them; DISK_IO_OK if it could */
+static int
+disk_mapzones(disk_t *d, u_int n)
+{
+	struct stat st;
+	u_int want;
+	void *m;
+
+	if (n <= d->d_mapped)
+		return DISK_IO_OK;
+	if (d->d_fileno < 0) {
+		fprintf(stderr, "disk_writei: zone %o is beyond the drum\n", n - 1);
+		return DISK_IO_ENWRITE;
+	}
+	if (fstat(d->d_fileno, &st) < 0)
+		return DISK_IO_ENWRITE;
+	want = st.st_size / sizeof(zone_t);
+	/* the zones written back past the mapping grow the file */
+	if (want < d->d_mapped + DISK_EXTENT)
+		return DISK_IO_ENWRITE;
+	m = mmap(0, want * sizeof(zone_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+		d->d_fileno, 0);
+	if (m == MAP_FAILED)
+		return DISK_IO_ENWRITE;
+	/* zones cached while unmapped would be shadowed by the mapping */
+	if (zc_drop(d) != DISK_IO_OK || wb_drain(d) != DISK_IO_OK) {
+		munmap(m, want * sizeof(zone_t));
+		return DISK_IO_ENWRITE;
+	}
+	if (d->d_map)
+		munmap(d->d_map, d->d_mapped * sizeof(zone_t));
+	d->d_map = m;
+	d->d_mapped = want;
+	return n <= want ? DISK_IO_OK : DISK_IO_ENWRITE;
+}
+
+/*
+ * A drum is an anonymous mapping large enough for every tract the
+ * units can address; pages are only taken as the tracts are written.
+ * With an image file the drum is loaded from it, and written back
+ * there by disk_close().  The image is in the Physical disk format.
+ */
+#define DRUM_ZONES      (4096 + ZONE_OFFSET)
+
+void *
+disk_drum(char *image)
+{
+	disk_t *d;
+	void *m;
+	int f;
+	ssize_t size;
+
+	d = calloc(sizeof(disk_t), 1);
+	if (! d) {
+		fprintf(stderr, "disk_drum: no memory\n");
+		return 0;
+	}
+	m = mmap(0, DRUM_ZONES * sizeof(zone_t), PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (m == MAP_FAILED) {
+		perror("disk_drum");
+		free(d);
+		return 0;
+	}
+	d->d_magic = DESCR_MAGIC;
+	d->d_fileno = -1;
+	d->d_str = Physical;
+	d->d_readi = disk_readi2;
+	d->d_writei = disk_writei2;
+	d->d_mode = DISK_READ_WRITE;
+	d->d_map = m;
+	d->d_mapped = DRUM_ZONES;
+	if (! image)
+		return d;
+
+	d->d_image = strdup(image);
+	if ((f = open(image, O_RDONLY)) < 0) {
+		if (errno == ENOENT)
+			return d;
+		perror(image);
+		disk_close(d);
+		return 0;
+	}
+	size = read(f, m, DRUM_ZONES * sizeof(zone_t));
+	close(f);
+	if (size < 0) {
+		perror(image);
+		disk_close(d);
+		return 0;
+	}
+	d->d_zones = (size + sizeof(zone_t) - 1) / sizeof(zone_t);
+	return d;
+}
+
+static int
+disk_saveimage(disk_t *d)
+{
+	size_t len = (size_t) d->d_zones * sizeof(zone_t);
+	int f;
+
+	f = open(d->d_image, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (f < 0 || write(f, d->d_map, len) != (ssize_t) len) {
+		perror(d->d_image);
+		if (f >= 0)
+			close(f);
+		return DISK_IO_ENWRITE;
+	}
+	close(f);
+	return DISK_IO_OK;
+}
+
+/*
+ * Overlays let many jobs share a volume: the image itself is opened
+ * read-only, and the zones a job writes go into a delta of its own.
+ * With disk_overlays set to a directory the delta of volume N is the
+ * sparse Physical image N there, kept for disk_commit() or
+ * disk_discard(); with disk_overlays empty it is in memory and lives
+ * until the end of the run.  Every word written has a tag, so a zone
+ * of the delta that is all zeroes has never been written.
+ */
+static void
+disk_delta_path(char *fname, u_int diskno)
+{
+	sprintf(fname, "%.200s/%d", disk_overlays, diskno);
+}
+
+static int
+disk_indelta(disk_t *d, u_int zone)
+{
+	zone_t *z;
+
+	return zone < d->d_zones && (z = disk_getzone(d, zone)) &&
+		z->z_data[0] >> 48;
+}
+
+/*
+ * Zones of a Chained image are always numbered from ZONE_OFFSET in
+ * the delta, whatever mode they are asked for.
+ */
+static int
+disk_reado(disk_t *d, u_int zone, char *buf, char *convol, char *check, u_int mode)
+{
+	disk_t *b = d->d_base;
+
+	if (b->d_str == Chained && mode == DISK_MODE_PHYS) {
+		zone = (zone - ZONE_OFFSET) & 07777;
+		mode = DISK_MODE_QUIET;
+	}
+	if (disk_indelta(d, mode == DISK_MODE_PHYS ? zone : zone + ZONE_OFFSET))
+		return disk_readi2(d, zone, buf, convol, check, mode);
+	return b->d_readi(b, zone, buf, convol, check, mode);
+}
+
+static int
+disk_writeo(disk_t *d, u_int zone, char *buf, char *convol, char *check, u_int mode)
+{
+	disk_t *b = d->d_base;
+
+	if (b->d_str == Chained && mode == DISK_MODE_PHYS) {
+		zone = (zone - ZONE_OFFSET) & 07777;
+		mode = DISK_MODE_QUIET;
+	}
+	if (mode == DISK_MODE_LOUD) {
+		if (! disk_indelta(d, zone + ZONE_OFFSET) &&
+		    b->d_readi(b, zone, NULL, NULL, NULL, mode) == DISK_IO_NEW)
+			return DISK_IO_NEW;
+		mode = DISK_MODE_QUIET;
+	}
+	return disk_writei2(d, zone, buf, convol, check, mode);
+}
+
+/* puts a delta over the image just opened read-only */
+/* a Physical volume on an open file; the file is closed on failure */
+static disk_t *
+disk_physical(int f, u_int diskno, u_int mode)
+{
+	disk_t *d;
+
+	if (! (d = calloc(sizeof(disk_t), 1))) {
+		fprintf(stderr, "disk_open: no memory for %d\n", diskno);
+		close(f);
+		return 0;
+	}
+	d->d_magic = DESCR_MAGIC;
+	d->d_fileno = f;
+	d->d_diskno = diskno;
+	d->d_str = Physical;
+	d->d_mode = mode;
+	d->d_readi = disk_readi2;
+	d->d_writei = disk_writei2;
+	disk_mapi(d);
+	return d;
+}
+
+static void *
+disk_overlay(disk_t *base, u_int mode)
+{
+	disk_t *d;
+	char fname[256];
+	int f;
+
+	base->d_mode = DISK_RW_NO_WAY | DISK_READ_ONLY;
+	if (*disk_overlays) {
+		disk_delta_path(fname, base->d_diskno);
+		if ((f = open(fname, O_RDWR | O_CREAT, 0644)) < 0) {
+			perror(fname);
+			disk_close(base);
+			return 0;
+		}
+		if (! (d = disk_physical(f, base->d_diskno, mode))) {
+			disk_close(base);
+			return 0;
+		}
+	} else if (! (d = disk_drum(NULL))) {
+		disk_close(base);
+		return 0;
+	}
+	d->d_diskno = base->d_diskno;
+	d->d_mode = mode;
+	d->d_base = base;
+	d->d_readi = disk_reado;
+	d->d_writei = disk_writeo;
+	return d;
+}
+
+/*
+ * Copies the zones of the delta of a volume into the image and
+ * removes the delta; returns the number of zones copied, or -1.
+ */
+int
+disk_commit(u_int diskno)
+{
+	char *dir = disk_overlays;
+	char buf[ZONE_SIZE], convol[1024], check[48];
+	disk_t *d, *b;
+	u_int zone;
+	int n = 0, r;
+
+	if (! dir || ! *dir)
+		return -1;
+	if (! (d = disk_open(diskno, DISK_READ_ONLY)))
+		return -1;
+	disk_overlays = 0;
+	b = disk_open(diskno, DISK_READ_WRITE);
+	disk_overlays = dir;
+	if (! b) {
+		disk_close(d);
+		return -1;
+	}
+	for (zone = 0; zone < d->d_zones; ++zone) {
+		if (! disk_indelta(d, zone))
+			continue;
+		r = disk_readi2(d, zone, buf, convol, check, DISK_MODE_PHYS);
+		if (r == DISK_IO_OK)
+			r = b->d_str == Chained ?
+				disk_writei(b, zone - ZONE_OFFSET, buf, NULL, NULL,
+					DISK_MODE_QUIET) :
+				disk_writei(b, zone, buf, convol, check,
+					DISK_MODE_PHYS);
+		if (r != DISK_IO_OK) {
+			fprintf(stderr, "disk_commit: zone %o of %d failed\n",
+				zone, diskno);
+			n = -1;
+			break;
+		}
+		++n;
+	}
+	if (disk_close(b) != DISK_IO_OK)
+		n = -1;
+	disk_close(d);
+	if (n >= 0)
+		disk_discard(diskno);
+	return n;
+}
+
+int
+disk_discard(u_int diskno)
+{
+	char fname[256];
+
+	if (! disk_overlays || ! *disk_overlays)
+		return -1;
+	disk_delta_path(fname, diskno);
+	if (unlink(fname) < 0 && errno != ENOENT) {
+		perror(fname);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Rewrites the Chained image of a volume as a Physical one, zone for
+ * zone: the holes below the last zone written get the format pattern
+ * a Chained image reads for them.  The new image replaces the old
+ * one only when all of it is written; *st tells what was done.
+ */
+int
+disk_convert(u_int diskno, disk_convstat_t *st)
+{
+	char *dir = disk_overlays;
+	char fname[256], tname[260];
+	char buf[ZONE_SIZE], convol[1024];
+	struct stat sb;
+	disk_t *c, *d;
+	u_int zone, last;
+	u_long pos, prev = 0;
+	int f, r = DISK_IO_OK;
+
+	memset(st, 0, sizeof(*st));
+	disk_uncache(diskno);
+	disk_overlays = 0;
+	c = disk_open(diskno, DISK_READ_ONLY);
+	disk_overlays = dir;
+	if (! c)
+		return DISK_IO_ENREAD;
+	if (c->d_str != Chained) {
+		fprintf(stderr, "disk_convert: %d is not Chained\n", diskno);
+		disk_close(c);
+		return DISK_IO_FATAL;
+	}
+	disk_find_path(fname, diskno);
+	sprintf(tname, "%s.new", fname);
+	if (fstat(c->d_fileno, &sb) < 0 ||
+	    (f = open(tname, O_RDWR | O_CREAT | O_TRUNC, sb.st_mode & 07777)) < 0) {
+		perror(tname);
+		disk_close(c);
+		return DISK_IO_ENWRITE;
+	}
+	if (! (d = disk_physical(f, diskno, DISK_READ_WRITE))) {
+		unlink(tname);
+		disk_close(c);
+		return DISK_IO_ENWRITE;
+	}
+	st->cs_before = sb.st_size;
+
+	for (last = DESCR_BLOCKS * BLOCK_ZONES; last && ! c->d_pos[last - 1]; --last)
+		continue;
+	for (zone = 0; zone < last; ++zone) {
+		if ((pos = c->d_pos[zone])) {
+			/* a new extent wherever the zones are not back to back */
+			if (! prev || pos != prev + ZONE_SIZE)
+				++st->cs_extents;
+			++st->cs_zones;
+			r = disk_readi1(c, zone, buf, convol, NULL, DISK_MODE_QUIET);
+		} else {
+			++st->cs_holes;
+			disk_formcodei(buf);
+			memset(convol, 0, sizeof(convol));
+		}
+		prev = pos;
+		if (r == DISK_IO_OK)
+			r = disk_writei2(d, zone, buf, convol, NULL, DISK_MODE_QUIET);
+		if (r != DISK_IO_OK) {
+			fprintf(stderr, "disk_convert: zone %o of %d failed\n",
+				zone, diskno);
+			break;
+		}
+	}
+	if (disk_close(d) != DISK_IO_OK && r == DISK_IO_OK)
+		r = DISK_IO_ENWRITE;
+	disk_close(c);
+	if (r == DISK_IO_OK && stat(tname, &sb) == 0 && rename(tname, fname) == 0) {
+		st->cs_after = sb.st_size;
+		return DISK_IO_OK;
+	}
+	if (r == DISK_IO_OK) {
+		perror(fname);
+		r = DISK_IO_ENWRITE;
+	}
+	unlink(tname);
+	return r;
+}
+
+/* a zone of a Physical image: mapped, cached, queued or read into zone_buf */
+static zone_t *
+disk_getzone(disk_t *d, u_int zone)
+{
+	zone_t *z;
+	zcache_t *zc;
+
+	if (zone < d->d_mapped)
+		return &d->d_map[zone];
+	if ((zc = zc_find(d, zone)))
+		return &zc->c_u.c_z;
+	if (zc_alloc(d, zone, &zc) != DISK_IO_OK)
+		return 0;
+	z = zc ? &zc->c_u.c_z : &zone_buf;
+	if (! wb_find(d, zone, z, sizeof(zone_t)) &&
+	    pread(d->d_fileno, z, sizeof(zone_t),
+	    (off_t) zone * sizeof(zone_t)) != sizeof(zone_t)) {
+		if (zc)
+			zc_unlink(zc);
+		perror("disk_readi");
+		return 0;
+	}
+	return z;
+}
+
+int disk_readi2(disk_t *d, u_int zone, char *buf, char *convol, char *check, u_int mode)
+{
+	zone_t *z;
+
+/*	fprintf(stderr, "disk_readi2: %d zone %o\n", d->d_diskno, zone);*/
+        if (mode != DISK_MODE_PHYS) {
+            zone += ZONE_OFFSET;
+        }
+
+	if (zone >= d->d_zones) {
+            if (mode == DISK_MODE_LOUD)
+                return DISK_IO_NEW;
+            if (getenv("ZERODRUM") == 0 || d->d_diskno != 0)
+                disk_formcodei(buf);
+            else
+                memset(buf, 0, ZONE_SIZE);
+            return DISK_IO_OK;
+	}
+
+	if (! (z = disk_getzone(d, zone)))
+		return DISK_IO_ENREAD;
+        if (buf)
+		zkernel()->k_unpack(z->z_data, (u_char *) buf, 1024);
+        if (convol)
+		zkernel()->k_tags(z->z_data, (u_char *) convol, 1024);
+        if (check) {
+		int i;
+		for (i = 0; i < 8; ++i, check += 6)
+			word_put((word_t *) check, z->z_cwords[i]);
 	}
 	return DISK_IO_OK;
 }
@@ -423,6 +1818,8 @@ disk_writei(void *ud, u_int zone, char *buf, char *convol, char *check, u_int mo
 int
 disk_writei1(disk_t *d, u_int zone, char *buf, char *convol, char *check, u_int mode)
 {
+	zcache_t *zc;
+
 /*	fprintf(stderr, "disk_writei1: %d zone %o\n", d->d_diskno, zone);*/
 
 	// Convolution and check words are ignored
@@ -438,6 +1835,18 @@ disk_writei1(disk_t *d, u_int zone, char *buf, char *convol, char *check, u_int
 	    mode = DISK_MODE_QUIET;
         }
 
+	if (! (zc = zc_find(d, zone))) {
+		if (mode == DISK_MODE_LOUD && disk_positioni(d, zone) == DISK_IO_NEW)
+			return DISK_IO_NEW;
+		if (zc_alloc(d, zone, &zc) != DISK_IO_OK)
+			return DISK_IO_ENWRITE;
+	}
+	if (zc) {
+		memcpy(zc->c_u.c_raw, buf, ZONE_SIZE);
+		zc->c_dirty = 1;
+		return DISK_IO_OK;
+	}
+
 	if (disk_positioni(d, zone) == DISK_IO_NEW) {
 		switch (mode) {
 		case DISK_MODE_LOUD:
@@ -448,17 +1857,12 @@ disk_writei1(disk_t *d, u_int zone, char *buf, char *convol, char *check, u_int
 				return DISK_IO_ENWRITE;
 		}
 	}
-
-	if (write(d->d_fileno, buf, ZONE_SIZE) != ZONE_SIZE) {
-		perror("disk_writei");
-		return DISK_IO_ENWRITE;
-	}
-	return DISK_IO_OK;
+	return disk_putzone(d, zone, disk_zonepos(d, zone), buf, ZONE_SIZE);
 }
 
 /* Time since midnight is 0.02 sec ticks */
 uint ticks_since_midnight() {
-	struct tm       *d;
+	struct tm       tm, *d;
 #if defined (__linux) || ! defined (CLOCK_REALTIME)
 	struct timeval t;
 	gettimeofday (&t, NULL);
@@ -466,7 +1870,7 @@ uint ticks_since_midnight() {
 	struct timespec t;
 	clock_gettime (CLOCK_REALTIME, &t);
 #endif
-	d = localtime (&t.tv_sec);
+	d = localtime_r (&t.tv_sec, &tm);
 	return ((d->tm_hour * 60 + d->tm_min) * 60 + d->tm_sec) * 50 +
 #if defined (__linux) || ! defined (CLOCK_REALTIME)
 		t.tv_usec / 20000;
@@ -479,9 +1883,9 @@ uint ticks_since_midnight() {
 /* Returns DDMMY in BCD */
 static int date_for_cwords() {
 	time_t t;
-	struct tm * d;
+	struct tm tm, * d;
 	time(&t);
-	d = localtime(&t);
+	d = localtime_r(&t, &tm);
 	++d->tm_mon;
 	return (d->tm_mday / 10) << 13 |
 		(d->tm_mday % 10) << 9 |
@@ -494,6 +1898,8 @@ int
 disk_writei2(disk_t *d, u_int zone, char *buf, char *convol, char *check, u_int mode)
 {
 	int i;
+	zone_t *z;
+	zcache_t *zc;
 	unsigned char *b = (unsigned char*) buf;
 	unsigned char *c = (unsigned char*) check;
 
@@ -502,93 +1908,71 @@ disk_writei2(disk_t *d, u_int zone, char *buf, char *convol, char *check, u_int
 		zone += ZONE_OFFSET;
 	}
 
-	off_t max = lseek(d->d_fileno, 0, SEEK_END);
-
-	off_t cur = lseek(d->d_fileno, zone * sizeof(zone_t), SEEK_SET);
-
-	if (mode == DISK_MODE_LOUD && cur >= max)
+	if (mode == DISK_MODE_LOUD && zone >= d->d_zones)
 		return DISK_IO_NEW;
 
-	if (cur < max) {
-		if (read(d->d_fileno, &zone_buf.z_cwords, sizeof(zone_buf.z_cwords)) != sizeof(zone_buf.z_cwords)) {
-			perror("disk_writei (cwords)");
+	/* the zone is formed in place in the mapping, if there is one */
+	zc = 0;
+	if (disk_mapzones(d, zone + 1) == DISK_IO_OK)
+		z = &d->d_map[zone];
+	else if (d->d_fileno < 0)
+		return DISK_IO_ENWRITE;
+	else {
+		if (! (zc = zc_find(d, zone)) &&
+		    zc_alloc(d, zone, &zc) != DISK_IO_OK)
 			return DISK_IO_ENWRITE;
-		}
-		lseek(d->d_fileno, zone * sizeof(zone_t), SEEK_SET);
-	}
-
-	memset(zone_buf.z_data, 0, sizeof (zone_buf.z_data));
-	if (buf) {
-		for (i = 0; i < 1024; ++i, b+=6) {
-			zone_buf.z_data[i] = (uint64_t) b[0] << 40;
-			zone_buf.z_data[i] |= (uint64_t) b[1] << 32;
-			zone_buf.z_data[i] |= (uint64_t) b[2] << 24;
-			zone_buf.z_data[i] |= (uint64_t) b[3] << 16;
-			zone_buf.z_data[i] |= (uint64_t) b[4] << 8;
-			zone_buf.z_data[i] |= (uint64_t) b[5];
-		}
+		z = zc ? &zc->c_u.c_z : &zone_buf;
 	}
+
+	if (buf)
+		zkernel()->k_pack(b, (u_char *) convol, z->z_data, 1024);
+	else
+		for (i = 0; i < 1024; ++i)
+			z->z_data[i] = (convol && convol[i] ? 2LL : 1LL) << 48;
 	uint64_t uid = userid();
-	for (i = 0; i < 1024; ++i) {
-		zone_buf.z_data[i] |= (convol && convol[i] ? 2LL : 1LL) << 48;
-	}
 	if (check) {
-		for (i = 0; i < 8; ++i, c+=6) {
-			zone_buf.z_cwords[i] = (uint64_t) c[0] << 40;
-			zone_buf.z_cwords[i] |= (uint64_t) c[1] << 32;
-			zone_buf.z_cwords[i] |= (uint64_t) c[2] << 24;
-			zone_buf.z_cwords[i] |= (uint64_t) c[3] << 16;
-			zone_buf.z_cwords[i] |= (uint64_t) c[4] << 8;
-			zone_buf.z_cwords[i] |= (uint64_t) c[5];
-		}
+		for (i = 0; i < 8; ++i, c+=6)
+			z->z_cwords[i] = word_get((word_t *) c);
 	} else {
-		uint64_t csum = 0;
+		uint64_t csum = zkernel()->k_sum(z->z_data, 1024);
 		uint64_t coarse_time = ticks_since_midnight() >> 15;
 
-		for (i = 0; i < 1024; ++i) {
-			csum += zone_buf.z_data[i] & ((1LL<<48)-1);
-			csum = (csum & ((1LL<<48)-1)) + (csum >> 48);
-		}
-
 		/* 30 - номер устройства, 1 - номер машины */
-		zone_buf.z_cwords[0] = (uint64_t) zone << 37 | coarse_time << 27 |
+		z->z_cwords[0] = (uint64_t) zone << 37 | coarse_time << 27 |
 		030 << 21 | date_for_cwords() << 6 | 1 << 3 | 2ll << 48;
 		/* 013 в 48-40 разрядах - код формата служ. слов (см. РУКАВА) */
 		/* 12-1 разряды - контрольная сумма "сектора" - не используются */
-		zone_buf.z_cwords[1] = 01370707LL << 24 | d->d_diskno << 12 | (2ll << 48);
-		zone_buf.z_cwords[2] = uid | (2ll << 48);
-		zone_buf.z_cwords[3] = csum | (2ll << 48);
+		z->z_cwords[1] = 01370707LL << 24 | d->d_diskno << 12 | (2ll << 48);
+		z->z_cwords[2] = uid | (2ll << 48);
+		z->z_cwords[3] = csum | (2ll << 48);
 		/* Вторая полузона - нечетный номер дорожки */
-		zone_buf.z_cwords[4] = zone_buf.z_cwords[0] | 1LL << 36;
-		zone_buf.z_cwords[5] = zone_buf.z_cwords[1];
-		zone_buf.z_cwords[6] = zone_buf.z_cwords[2];
-		zone_buf.z_cwords[7] = zone_buf.z_cwords[3];
+		z->z_cwords[4] = z->z_cwords[0] | 1LL << 36;
+		z->z_cwords[5] = z->z_cwords[1];
+		z->z_cwords[6] = z->z_cwords[2];
+		z->z_cwords[7] = z->z_cwords[3];
 	}
-	if (write(d->d_fileno, &zone_buf, sizeof(zone_buf)) != sizeof(zone_buf)) {
-		perror("disk_writei");
+	if (zc)
+		zc->c_dirty = 1;
+	else if (z == &zone_buf &&
+	    disk_putzone(d, zone, (off_t) zone * sizeof(zone_t), z,
+	    sizeof(zone_t)) != DISK_IO_OK)
 		return DISK_IO_ENWRITE;
-	}
+	if (zone >= d->d_zones)
+		d->d_zones = zone + 1;
 	return DISK_IO_OK;
 }
 
+/* where a zone of a Chained image is, 0 if it has none yet */
+static off_t
+disk_zonepos(disk_t *d, u_int zone)
+{
+	return d->d_pos[zone];
+}
+
 static int
 disk_positioni(disk_t *d, u_int zone)
 {
-	ulong pos;
-	int block = zone / BLOCK_ZONES;
-
-	if (d->d_md[block] == NULL) {
-		return DISK_IO_NEW;
-	}
-	if ((pos = getlong(d->d_md[block]->md_pos[zone % BLOCK_ZONES])) == 0) {
-		return DISK_IO_NEW;
-	}
-
-#ifdef DEBUG
-	fprintf(stderr, "disk_positioni: seeking to %d\n", pos);
-#endif
-	lseek(d->d_fileno, pos, SEEK_SET);
-	return DISK_IO_OK;
+	return d->d_pos[zone] ? DISK_IO_OK : DISK_IO_NEW;
 }
 
 static int
@@ -613,11 +1997,12 @@ disk_makezonei(disk_t *d, u_int zone)
 			}
 			memcpy(d->d_md[i]->md_magic, DISK_MAGIC, 4);
 			d->d_modif[i] = 1;
-			pos = lseek(d->d_fileno, 0, SEEK_END);
+			pos = disk_endi(d, sizeof(md_t));
 #ifdef DEBUG
 			fprintf(stderr, "disk_makezonei: seeking to end (%d) for new descriptor\n", pos);
 #endif
 			putlong(d->d_md[i - 1]->md_next, pos);
+			d->d_mdpos[i] = pos;
 			d->d_modif[i-1] = 1;
 
 			/* force writing intermediate descriptors */
@@ -626,40 +2011,26 @@ disk_makezonei(disk_t *d, u_int zone)
 				return DISK_IO_ENWRITE;
 		} while (i++ != block);
 	}
-	pos = lseek(d->d_fileno, 0, SEEK_END);
+	pos = disk_endi(d, ZONE_SIZE);
 
 #ifdef DEBUG
 	fprintf(stderr, "disk_makezonei: seeking to end (%d) for new zone\n", pos);
 #endif
 	putlong(d->d_md[block]->md_pos[zone % BLOCK_ZONES], pos);
+	d->d_pos[zone] = pos;
 	d->d_modif[block] = 1;
 
-	if (disk_writedescr(d, block) != DISK_IO_OK)
-		return DISK_IO_ENWRITE;
-
-	/*
-	 * go back to the zone
-	 */
-	lseek(d->d_fileno, pos, SEEK_SET);
-	return DISK_IO_OK;
+	return disk_writedescr(d, block);
 }
 
 static int
 disk_writedescri(disk_t *d, int block)
 {
-	ulong pos;
-	if (block == 0) {
 #ifdef DEBUG
-		fprintf(stderr, "disk_writedescr: seeking to -0- for descriptor\n");
+	fprintf(stderr, "disk_writedescr: descriptor %d at %d\n", block, d->d_mdpos[block]);
 #endif
-		lseek(d->d_fileno, 0, SEEK_SET);
-	} else {
-		lseek(d->d_fileno, pos = getlong(d->d_md[block - 1]->md_next), SEEK_SET);
-#ifdef DEBUG
-		fprintf(stderr, "disk_writedescr: seeking to %d for descriptor\n", pos);
-#endif
-	}
-	if (write(d->d_fileno, d->d_md[block], sizeof(md_t)) != sizeof(md_t)) {
+	if (pwrite(d->d_fileno, d->d_md[block], sizeof(md_t),
+	    d->d_mdpos[block]) != sizeof(md_t)) {
 		perror("disk_writedescri");
 		return DISK_IO_ENWRITE;
 	}
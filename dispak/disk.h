@@ -26,14 +26,36 @@
 
 #define ZONE_SIZE       6144		/* bytes */
 
+/* what disk_convert() did */
+typedef struct {
+	u_int	cs_zones;		/* zones copied                  */
+	u_int	cs_holes;		/* zones never written, formatted */
+	u_int	cs_extents;		/* contiguous runs in the old image */
+	off_t	cs_before, cs_after;	/* image sizes, bytes            */
+} disk_convstat_t;
+
 extern char	*disk_path;		/* disk search path */
+extern char	*disk_overlays;		/* NULL, "" for deltas in memory, or their dir */
+extern u_int	zcache_size;		/* zones in the write-back cache */
+extern __thread u_long zcache_hits, zcache_misses, zcache_writebacks;
 
 extern  void    *disk_open(u_int diskno_decimal, u_int mode);   /* NULL if failure */
 extern  int     disk_close(void *disk_descr);
+extern  void    *disk_drum(char *image);                        /* NULL if failure */
 extern  int     disk_setmode(void *disk_descr, u_int mode);
 extern  int     disk_readi(void *disk_descr, u_int zone, char* buf, char* convol, char* check, u_int mode);
 extern  int     disk_writei(void *disk_descr, u_int zone, char* buf, char* convol, char *check, u_int mode);
 extern	void	disk_local_path(char *buf);
+extern  void    disk_set_path(const char *path);               /* 0 - the default */
+extern  void    *disk_get(u_int diskno_decimal, u_int mode);    /* cached, NULL if failure */
+extern  void    disk_uncache(u_int diskno_decimal);
+extern  void    disk_flush(void);
+extern  void    disk_sync(void);
+extern  void    disk_release(void);
+extern  int     disk_commit(u_int diskno_decimal);              /* zones copied, -1 if failure */
+extern  int     disk_discard(u_int diskno_decimal);
+extern  int     disk_convert(u_int diskno_decimal, disk_convstat_t *st);
+extern  int     disk_bench(unsigned long megabytes);
 
 #define disk_read(a,b,c)    disk_readi(a,b,c,NULL,NULL,DISK_MODE_QUIET)
 #define disk_write(a,b,c)   disk_writei(a,b,c,NULL,NULL,DISK_MODE_QUIET)
@@ -30,11 +30,21 @@ typedef enum { Chained, Physical } structure_t;
 typedef struct disk {
 	u_long	d_magic;
 	u_int	d_diskno;
-	u_int	d_fileno;
+	int	d_fileno;		/* -1 for a drum in memory       */
 	structure_t d_str;
 	md_t	*d_md[DESCR_BLOCKS];	/* up to 040000 zones */
 	u_char	d_modif[DESCR_BLOCKS];
+	u_long	d_mdpos[DESCR_BLOCKS];	/* Chained: where each md_t is   */
+	u_long	*d_pos;			/* Chained: where each zone is, 0 if none */
 	u_char	d_mode;
+	u_char	d_wbfail;		/* a queued write of it failed   */
+	struct zone *d_map;		/* Physical: the image, mapped   */
+	u_int	d_mapped;		/* zones in the mapping          */
+	u_int	d_zones;		/* zones in the image            */
+	char	*d_image;		/* drums: where to save the zones */
+	off_t	d_end;			/* Chained: end with queued zones */
+	struct disk *d_base;		/* overlays: the image under the delta */
+	struct disk *d_next;		/* overlays: kept in memory       */
     int     (*d_readi)(struct disk *disk_descr, u_int zone, char* buf, char* convol, char* check, u_int mode);
     int     (*d_writei)(struct disk *disk_descr, u_int zone, char* buf, char* convol, char* check, u_int mode);
 } disk_t;
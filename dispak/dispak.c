@@ -28,6 +28,8 @@
  *		trace extracode 064
  *	-s, --stats
  *		show statistics for machine instructions
+ *	--stats-file=file
+ *		gather statistics and write them to file as CSV
  *	--path=dir1:dir2...
  *		specify search path for disk images
  *	-p, --output-enable
@@ -54,7 +56,38 @@
  *		run in user mode only to build 2099 (no E66, cannot use -x)
  *	--no-insn-check
  *		the only non-insn word is at addr 0
+ *	--no-jit
+ *		interpret hot blocks rather than translate them to host code
+ *	--snapshot=file
+ *		save the machine to file once the supervisor is loaded,
+ *		before the task (if any) is read in
+ *	--restore=file
+ *		start from a snapshot instead of loading the supervisor
+ *	--server[=socket]
+ *		load the supervisor once, then run each task in a child
+ *		forked from it: task file names are read from stdin, or
+ *		the tasks themselves from connections to the Unix socket;
+ *		each connection ends with a "dispak: status N" line, and
+ *		with stdin the server exits nonzero if any task failed
+ *	-j N, --jobs=N
+ *		with --server=socket, run at most N tasks at a time
+ *	--input-queue=dir
+ *		keep the input buffers in dir rather than ~/.besm6/input_queue
+ *	--overlay[=dir]
+ *		open volumes read-only and keep the zones written apart,
+ *		in memory or as delta images in dir
+ *	--drum-image=file
+ *		load the drum from file and save it back at exit
+ *	--zone-cache=N
+ *		keep up to N disk zones in the write-back cache (0 = off)
+ *	--pack-bench[=MB]
+ *		time the disk zone conversion kernels and check them
  */
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -66,29 +99,23 @@
 #include "encoding.h"
 #include "gost10859.h"
 
-static struct   {
-	int     dsk;
-	ushort  zone;
-	ushort  sz;
-	reg_t   caddr;
-}       sv_disk[] = {
-	{2099,   0100,   3,      0,		},	/* disp99       */
-	{2099,   0103,   3,      010000,	},	/* e64, ekdisp, spe66  */
-	{0,      0,      0,      0,		},
-};
-
-char		*punchfile = NULL;
-ulong           icnt;
-
 static char     *pout_raw = NULL;
+static char     *drum_image = NULL;
+static char     *snapshot_file = NULL;
+static char     *restore_file = NULL;
+static char     *server_socket = NULL;
+static int      server_mode;
+static int      server_jobs;
 static FILE	*input_fd;
 
 void            catchsig(int sig);
-ulong           run();
-extern void     ib_cleanup(void);
-static int      sv_load(void);
+static int      snap_save(char *filename);
+static int      snap_restore(char *filename);
+static int      run_task(void);
+static int      server(char *sockname);
 void            pout_dump(char *filename);
 void            stat_out(void);
+static void     stat_csv(char *filename, double sec);
 
 enum {
 	OPT_CYRILLIC,
@@ -100,6 +127,21 @@ enum {
 	OPT_PATH,
 	OPT_INPUT_ENCODING,
 	OPT_NO_INSN_CHECK,
+#ifdef JIT
+	OPT_NO_JIT,
+#endif
+	OPT_STATS_FILE,
+	OPT_PACK_BENCH,
+	OPT_ZONE_CACHE,
+	OPT_DRUM_IMAGE,
+	OPT_OVERLAY,
+	OPT_INPUT_QUEUE,
+	OPT_SNAPSHOT,
+	OPT_RESTORE,
+	OPT_SERVER,
+#ifdef FAST_ALU
+	OPT_ALU_CHECK,
+#endif
 };
 
 /* Table of options. */
@@ -114,6 +156,7 @@ static struct option longopts[] = {
 	{ "trace",		0,	0,	't'		},
 	{ "trace-e64",		0,	0,	OPT_TRACE_E64	},
 	{ "stats",		0,	0,	's'		},
+	{ "stats-file",		1,	0,	OPT_STATS_FILE	},
 	{ "output-enable",	0,	0,	'p'		},
 	{ "output-disable",	0,	0,	'q'		},
 	{ "native",		0,	0,	'x'		},
@@ -126,6 +169,21 @@ static struct option longopts[] = {
 	{ "path",		1,	0,	OPT_PATH	},
 	{ "input-encoding",	1,	0,	OPT_INPUT_ENCODING },
 	{ "no-insn-check",	0,	0,	OPT_NO_INSN_CHECK },
+#ifdef JIT
+	{ "no-jit",		0,	0,	OPT_NO_JIT	},
+#endif
+	{ "pack-bench",		2,	0,	OPT_PACK_BENCH	},
+	{ "zone-cache",		1,	0,	OPT_ZONE_CACHE	},
+	{ "drum-image",		1,	0,	OPT_DRUM_IMAGE	},
+	{ "overlay",		2,	0,	OPT_OVERLAY	},
+	{ "input-queue",	1,	0,	OPT_INPUT_QUEUE	},
+	{ "snapshot",		1,	0,	OPT_SNAPSHOT	},
+	{ "restore",		1,	0,	OPT_RESTORE	},
+	{ "server",		2,	0,	OPT_SERVER	},
+	{ "jobs",		1,	0,	'j'		},
+#ifdef FAST_ALU
+	{ "alu-check",		2,	0,	OPT_ALU_CHECK },
+#endif
 	{ 0,			0,	0,	0		},
 };
 
@@ -141,6 +199,9 @@ usage ()
 	fprintf (stderr, _("  %s [options] <task-file>\n"), PACKAGE_NAME);
 	fprintf (stderr, _("  %s [options] <input-buf-number>\n"), PACKAGE_NAME);
 	fprintf (stderr, _("  %s [options] --decode-output <raw-file>\n"), PACKAGE_NAME);
+	fprintf (stderr, _("  %s [options] --snapshot=<snapshot-file> [<task-file>]\n"), PACKAGE_NAME);
+	fprintf (stderr, _("  %s [options] --restore=<snapshot-file> <task-file>\n"), PACKAGE_NAME);
+	fprintf (stderr, _("  %s [options] --server[=<socket>]\n"), PACKAGE_NAME);
 	fprintf (stderr, _("Options:\n"));
 	fprintf (stderr, _("  -x, --native           use native extracode E64\n"));
 	fprintf (stderr, _("  -b, --break            break on first cmd\n"));
@@ -148,6 +209,7 @@ usage ()
 	fprintf (stderr, _("  -t, --trace            trace all extracodes\n"));
 	fprintf (stderr, _("  --trace-e64            trace extracode 064\n"));
 	fprintf (stderr, _("  -s, --stats            show statistics for machine instructions\n"));
+	fprintf (stderr, _("  --stats-file=file      write the statistics to file as CSV\n"));
 	fprintf (stderr, _("  --path=dir1:dir2...    specify search path for disk images\n"));
 	fprintf (stderr, _("  -p, --output-enable    display printing output (default for batch tasks)\n"));
 	fprintf (stderr, _("  -q, --output-disable   no printing output (default for TELE tasks)\n"));
@@ -161,6 +223,21 @@ usage ()
 	fprintf (stderr, _("  --input-encoding=code  set encoding for input files: utf8 koi8 cp1251 cp866\n"));
 	fprintf (stderr, _("  --bootstrap            used to generate contents of the system disk\n"));
 	fprintf (stderr, _("  --no-insn-check        all words but at addr 0 are treated as insns\n"));
+#ifdef JIT
+	fprintf (stderr, _("  --no-jit               interpret hot blocks, do not translate them\n"));
+#endif
+	fprintf (stderr, _("  --snapshot=file        save the machine to file once the supervisor is loaded\n"));
+	fprintf (stderr, _("  --restore=file         start from a snapshot instead of loading the supervisor\n"));
+	fprintf (stderr, _("  --server[=socket]      run the tasks named on stdin, or sent to socket, in forked children\n"));
+	fprintf (stderr, _("  -j N, --jobs=N         with --server=socket, run at most N tasks at a time\n"));
+	fprintf (stderr, _("  --input-queue=dir      keep the input buffers in dir\n"));
+	fprintf (stderr, _("  --overlay[=dir]        keep writes to volumes in memory or in delta images in dir\n"));
+	fprintf (stderr, _("  --drum-image=file      load the drum from file and save it back at exit\n"));
+	fprintf (stderr, _("  --zone-cache=N         keep up to N disk zones in the write-back cache\n"));
+	fprintf (stderr, _("  --pack-bench[=MB]      time the disk zone conversion kernels on MB megabytes\n"));
+#ifdef FAST_ALU
+	fprintf (stderr, _("  --alu-check[=N]        compare the 64-bit ALU with the original on N random operations\n"));
+#endif
 
 	fprintf (stderr, _("\nReport bugs to %s\n"), PACKAGE_BUGREPORT);
 	exit (1);
@@ -178,16 +255,7 @@ cget(void)
 		c = unicode_getc (input_fd);
 		if (c < 0)
 			return GOST_EOF;
-		switch (c) {
-		case '*': return GOST_MULTIPLICATION;
-		case '<': return GOST_LESS_THAN_OR_EQUAL;
-		case '>': return GOST_GREATER_THAN_OR_EQUAL;
-		case ':': return GOST_DIVISION;
-		case '@': return GOST_LOWER_TEN;
-		case '|': return GOST_LOGICAL_OR;
-		case '=': return GOST_IDENTICAL;
-		case '?': return GOST_IMPLICATION;
-		}
+		return escape_to_gost (c);
 	}
 	c = unicode_to_gost (c);
 	return c;
@@ -203,8 +271,6 @@ int
 main(int argc, char **argv)
 {
 	int             i, k;
-	double          sec;
-	void            *nh;
 	char 		*endptr;
 	int		decode_output = 0;
 
@@ -212,9 +278,11 @@ main(int argc, char **argv)
 	setlocale (LC_ALL, "");
 	bindtextdomain (PACKAGE_NAME, "/usr/local/share/locale");
 	textdomain (PACKAGE_NAME);
+	if (core_map(-1) < 0)
+		exit(1);
 
 	for (;;) {
-		i = getopt_long (argc, argv, "hVlbvtspqxo:c:", longopts, 0);
+		i = getopt_long (argc, argv, "hVlbvtspqxo:c:j:", longopts, 0);
 		if (i < 0)
 			break;
 		switch (i) {
@@ -283,6 +351,47 @@ main(int argc, char **argv)
 		case OPT_NO_INSN_CHECK:
 			no_insn_check = 1;
 			break;
+#ifdef JIT
+		case OPT_NO_JIT:
+			no_jit = 1;
+			break;
+#endif
+		case OPT_STATS_FILE:	/* machine-readable statistics */
+			stats_file = optarg;
+			break;
+		case OPT_OVERLAY:	/* copy-on-write volumes */
+			disk_overlays = optarg ? optarg : "";
+			break;
+		case OPT_INPUT_QUEUE:	/* private input queue */
+			input_queue = optarg;
+			break;
+		case OPT_SNAPSHOT:	/* save the loaded machine */
+			snapshot_file = optarg;
+			break;
+		case OPT_RESTORE:	/* warm start */
+			restore_file = optarg;
+			break;
+		case OPT_SERVER:	/* fork a loaded machine per task */
+			server_mode = 1;
+			server_socket = optarg;
+			break;
+		case 'j':		/* tasks the server runs at once */
+			server_jobs = strtol (optarg, 0, 0);
+			if (server_jobs < 1)
+				usage ();
+			break;
+		case OPT_DRUM_IMAGE:	/* persistent drum */
+			drum_image = optarg;
+			break;
+		case OPT_ZONE_CACHE:	/* size of the zone cache */
+			zcache_size = strtoul (optarg, 0, 0);
+			break;
+		case OPT_PACK_BENCH:	/* time the zone conversion kernels */
+			exit (disk_bench (optarg ? strtoul (optarg, 0, 0) : 8));
+#ifdef FAST_ALU
+		case OPT_ALU_CHECK:	/* cross-check the 64-bit ALU */
+			exit (alu_check (optarg ? strtoul (optarg, 0, 0) : 1000000));
+#endif
 		}
 	}
 	if (bootstrap) {
@@ -296,7 +405,13 @@ main(int argc, char **argv)
 		exit (0);
 	}
 
-	if (optind >= argc)
+	if (server_mode) {
+		if (optind < argc || restore_file || snapshot_file)
+			usage ();
+		exit (server (server_socket));
+	}
+
+	if (optind >= argc && ! snapshot_file)
 		usage ();
 
 	if (optind < argc-1) {
@@ -310,73 +425,76 @@ main(int argc, char **argv)
 	if (signal (SIGINT, SIG_IGN) != SIG_IGN)
 		signal (SIGINT, catchsig);
 
-	i = strtol(ifile, &endptr, 8);
-	if (*endptr == 0) {
-		/* Input buf number, use it. */
-	} else {
-		/* Task passport file. */
-		input_fd = fopen(ifile, "r");
-		if (! input_fd) {
-			perror(ifile);
-			exit(1);
+	i = 0;
+	if (ifile) {
+		i = strtol(ifile, &endptr, 8);
+		if (*endptr == 0) {
+			/* Input buf number, use it. */
+		} else {
+			/* Task passport file. */
+			input_fd = fopen(ifile, "r");
+			if (! input_fd) {
+				perror(ifile);
+				exit(1);
+			}
+			i = vsinput(cget, diag, 1, 1);
+			if (i < 0)
+				exit(1);
+			fclose (input_fd);
 		}
-		i = vsinput(cget, diag, 1);
-		if (i < 0)
+	}
+
+	/* the supervisor does not depend on the task, which comes after */
+	if (restore_file) {
+		if (snap_restore(restore_file) < 0)
+			exit(1);
+	} else if (!bootstrap && !sv_load()) {
+		fprintf(stderr, _("Error loading supervisor.\n"));
+		exit(1);
+	}
+	if (snapshot_file) {
+		if (snap_save(snapshot_file) < 0)
 			exit(1);
-		fclose (input_fd);
+		if (! ifile)
+			exit(0);
 	}
-	drumh = disk_open(0, DISK_READ_WRITE);
+
+	drumh = drum_image ? disk_drum(drum_image) :
+		disk_open(0, DISK_READ_WRITE);
 	if (! drumh)
 		exit(1);
-	k = input(i);
-	if (k < 0) {
+	if ((k = input(i)) < 0) {
 		utf8_puts (_(" ОШ ВВД "), stderr);
 		fprintf(stderr, "%03o\n", i);
 		exit(1);
 	}
-	if (notty) {
-		/* Batch task. */
-		pout_enable = ! pout_disable;
-	} else {
-		/* TELE task. */
-		pout_disable = ! pout_enable;
-	}
-
-	if (!bootstrap && !sv_load()) {
-		fprintf(stderr, _("Error loading supervisor.\n"));
-		exit(1);
-	}
+	return run_task();
+}
 
-	for (i = 00; i < 030; ++i) {
-		disks[i].diskh = drumh;
-		disks[i].offset = i * 040;
-	}
-	for (i = 070; i < 0100; ++i) {
-		disks[i].diskh = drumh;
-		disks[i].offset = i * 040;
-	}
-	nh = disk_open(0, DISK_READ_WRITE);
-	if (! nh)
-		exit(1);
-	disks[OSD_NOMML3].diskh = nh;
+/*
+ * Runs the task that is in core, with the supervisor loaded, and
+ * reports on it.
+ */
+static int
+run_task(void)
+{
+	double          sec;
 
-	if (!(nh = disk_open(2053, DISK_READ_ONLY)))
+	if (run_loaded() < 0)
 		exit(1);
-	disks[OSD_NOMML1].diskh = nh;
-
-	(void) signal(SIGALRM, alrm_handler);
-	gettimeofday(&start_time, NULL);
-	icnt = run();
-	gettimeofday(&stop_time, NULL);
 	sec = TIMEDIFF(start_time, stop_time) - excuse;
 	if (!sec)
 		sec = 0.000001;
 	if (stats) {
 		printf(_("%ld instructions per %2f seconds - %ld IPS, %3f uSPI\n"),
 			icnt, sec, (long)(icnt/sec), (sec * 1000000) / icnt);
+		printf(_("zone cache: %lu hits, %lu misses, %lu write-backs\n"),
+			zcache_hits, zcache_misses, zcache_writebacks);
 		if (stats > 1)
 			stat_out();
 	}
+	if (stats_file)
+		stat_csv(stats_file, sec);
 	if (pout_enable && xnative && pout_raw)
 		pout_dump(pout_raw);
 	terminate();
@@ -384,11 +502,184 @@ main(int argc, char **argv)
 	return (0);
 }
 
+/*
+ * A child of the server exits with 0 if its task ran to the end,
+ * 1 if it could not be run, else with the code run() stopped with.
+ * Over a socket the client gets it as the last line.
+ */
+static void
+serve_exit(int status)
+{
+	if (server_socket)
+		printf("dispak: status %d\n", status);
+	exit(status);
+}
+
+/*
+ * A child of the server: reads the task from fp and runs it on the
+ * machine inherited from the server, then exits.
+ */
+static void
+serve_task(FILE *fp)
+{
+	input_fd = fp;
+	if (vsinput(cget, diag, 1, 1) < 0)
+		serve_exit(1);
+	fclose(fp);
+	drumh = drum_image ? disk_drum(drum_image) :
+		disk_open(0, DISK_READ_WRITE);
+	if (! drumh)
+		serve_exit(1);
+	if (input(0) < 0) {
+		utf8_puts (_(" ОШ ВВД "), stderr);
+		putc('\n', stderr);
+		serve_exit(1);
+	}
+	run_task();
+	serve_exit(stoperr == E_TERM ? 0 : stoperr);
+}
+
+/*
+ * Reaps a child of the server, waiting for one if block is set;
+ * returns its pid, or 0 if there was none.  Children that died
+ * before their status line are reported on stderr.
+ */
+static pid_t
+serve_wait(int block)
+{
+	pid_t           pid;
+	int             status;
+
+	while ((pid = waitpid(-1, &status, block ? 0 : WNOHANG)) < 0 &&
+	    errno == EINTR)
+		continue;
+	if (pid <= 0)
+		return 0;
+	if (WIFSIGNALED(status))
+		fprintf(stderr, _("%s: task %d killed by signal %d\n"),
+			PACKAGE_NAME, (int) pid, WTERMSIG(status));
+	return pid;
+}
+
+/*
+ * --server: the supervisor is loaded and decoded and disk 2053 opened
+ * once, and each task runs in a child forked from this machine, which
+ * shares them copy-on-write.  Without a socket, task file names are read
+ * from stdin and run one at a time, with the printing on stdout.
+ * With one, each connection sends a task and gets the printing, the
+ * diagnostics and the status line back; up to --jobs tasks run side
+ * by side, and further connections wait in the listen queue.
+ */
+static int
+server(char *sockname)
+{
+	struct sockaddr_un sun;
+	char            line[MAXPATHLEN];
+	FILE            *fp;
+	pid_t           pid;
+	int             s, c, status, failed, running;
+
+	if (!bootstrap && !sv_load()) {
+		fprintf(stderr, _("Error loading supervisor.\n"));
+		return 1;
+	}
+	if (!bootstrap)
+		sv_decode();            /* once for all the children */
+	if (!(disks[OSD_NOMML1].diskh = disk_open(2053, DISK_READ_ONLY)))
+		return 1;
+
+	if (! sockname) {
+		/* a child's exit() would seek stdin back over what we read ahead */
+		setvbuf(stdin, 0, _IONBF, 0);
+		failed = 0;
+		while (fgets(line, sizeof(line), stdin)) {
+			line[strcspn(line, "\n")] = 0;
+			if (! line[0])
+				continue;
+			fflush(stdout);
+			pid = fork();
+			if (pid == 0) {
+				if (! (fp = fopen(line, "r"))) {
+					perror(line);
+					exit(1);
+				}
+				serve_task(fp);
+			}
+			if (pid < 0) {
+				perror("fork");
+				return 1;
+			}
+			while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+				continue;
+			fflush(stdout);
+			if (WIFEXITED(status) && WEXITSTATUS(status) == 0)
+				continue;
+			if (WIFSIGNALED(status))
+				fprintf(stderr, _("%s: killed by signal %d\n"),
+					line, WTERMSIG(status));
+			else
+				fprintf(stderr, _("%s: status %d\n"),
+					line, WEXITSTATUS(status));
+			++failed;
+		}
+		return failed != 0;
+	}
+
+	if (strlen(sockname) >= sizeof(sun.sun_path)) {
+		fprintf(stderr, _("%s: socket name too long\n"), sockname);
+		return 1;
+	}
+	memset(&sun, 0, sizeof(sun));
+	sun.sun_family = AF_UNIX;
+	strcpy(sun.sun_path, sockname);
+	unlink(sockname);
+	if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 ||
+	    bind(s, (struct sockaddr *) &sun, sizeof(sun)) < 0 ||
+	    listen(s, 64) < 0) {
+		perror(sockname);
+		return 1;
+	}
+	if (! server_jobs)
+		server_jobs = sysconf(_SC_NPROCESSORS_ONLN) > 0 ?
+			sysconf(_SC_NPROCESSORS_ONLN) : 1;
+	running = 0;
+	for (;;) {
+		/* reap what is done; at the limit, wait before accepting more */
+		while (running > 0 && serve_wait(running >= server_jobs))
+			--running;
+		if ((c = accept(s, 0, 0)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror(sockname);
+			return 1;
+		}
+		fflush(stdout);
+		pid = fork();
+		if (pid == 0) {
+			close(s);
+			dup2(c, 1);
+			dup2(c, 2);
+			setvbuf(stdout, 0, _IOLBF, 0);
+			if (! (fp = fdopen(c, "r")))
+				exit(1);
+			serve_task(fp);
+		}
+		if (pid < 0)
+			perror("fork");
+		else
+			++running;
+		close(c);
+	}
+}
+
 void
 catchsig (int sig)
 {
 	printf (_("\nInterrupt\n"));
 	breakflg = 1;
+	/* we may not live to terminate(); the debugger entry syncs */
+	if (sig == SIGTERM)
+		sync_rq = 1;
 	if (signal (SIGTERM, SIG_IGN) != SIG_IGN)
 		signal (SIGTERM, catchsig);
 	if (signal (SIGINT, SIG_IGN) != SIG_IGN)
@@ -397,44 +688,90 @@ catchsig (int sig)
 		longjmp (top, 1);
 }
 
-static struct timeval   stopped;
+/*
+ * A snapshot is the machine as it stands once the supervisor is
+ * loaded and before a task is read in: core with its convolution.
+ * Everything else is set up by input() for the task that follows,
+ * so one snapshot serves any number of tasks.  The header only lets
+ * in snapshots made by the same build.
+ */
+#define SNAP_MAGIC      "BESM6SNP"
 
-void
-stopwatch(void)
-{
-	gettimeofday(&stopped, NULL);
-}
+struct snapshot {
+	char            s_magic[8];
+	uint            s_size;                 /* of struct snapshot   */
+	uint            s_coresz;               /* of core              */
+	uint            s_convolsz;             /* one byte a word      */
+};
 
-void
-startwatch(void)
+static char     snap_convol[CORESZ * 2];
+
+static int
+snap_save(char *filename)
 {
-	struct timeval  curr;
+	struct snapshot s;
+	FILE            *fp;
 
-	gettimeofday(&curr, NULL);
-	excuse += TIMEDIFF(stopped, curr);
+	memset(&s, 0, sizeof(s));
+	memcpy(s.s_magic, SNAP_MAGIC, 8);
+	s.s_size = sizeof(s);
+	s.s_coresz = CORE_BYTES;
+	s.s_convolsz = sizeof(snap_convol);
+	convol_get(0, snap_convol, CORESZ * 2);
+
+	fp = fopen(filename, "w");
+	if (! fp) {
+		perror(filename);
+		return -1;
+	}
+	if (fwrite(&s, sizeof(s), 1, fp) != 1 ||
+	    fwrite(core, CORE_BYTES, 1, fp) != 1 ||
+	    fwrite(snap_convol, sizeof(snap_convol), 1, fp) != 1) {
+		perror(filename);
+		fclose(fp);
+		unlink(filename);
+		return -1;
+	}
+	if (fclose(fp) != 0) {
+		perror(filename);
+		unlink(filename);
+		return -1;
+	}
+	return 0;
 }
 
 static int
-sv_load()
+snap_restore(char *filename)
 {
-	void            *dh;
-	ushort          z;
-	reg_t           cp;
-	int             i;
-
-	for (i = 0; sv_disk[i].sz; ++i) {
-		dh = disk_open(sv_disk[i].dsk, DISK_READ_ONLY);
-		if (!dh)
-			return 0;
+	struct snapshot s;
+	struct stat     st;
+	int             fd;
 
-		for (z = sv_disk[i].zone, cp = sv_disk[i].caddr + 0100000;
-				z < sv_disk[i].zone + sv_disk[i].sz;
-				++z, cp += 1024)
-			if (disk_read(dh, z, (char *) (core + cp)) != DISK_IO_OK)
-				return 0;
-		disk_close(dh);
+	fd = open(filename, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(filename);
+		return -1;
+	}
+	if (read(fd, &s, sizeof(s)) != sizeof(s) ||
+	    memcmp(s.s_magic, SNAP_MAGIC, 8) ||
+	    s.s_size != sizeof(s) || s.s_coresz != CORE_BYTES ||
+	    s.s_convolsz != sizeof(snap_convol) ||
+	    st.st_size != (off_t) (sizeof(s) + CORE_BYTES +
+	    sizeof(snap_convol))) {
+		fprintf(stderr, _("%s: not a snapshot of this %s\n"),
+			filename, PACKAGE_NAME);
+		close(fd);
+		return -1;
 	}
-	return 1;
+	if (read(fd, core, CORE_BYTES) != CORE_BYTES ||
+	    read(fd, snap_convol, sizeof(snap_convol)) != sizeof(snap_convol)) {
+		perror(filename);
+		close(fd);
+		return -1;
+	}
+	close(fd);
+	convol_put(0, snap_convol, CORESZ * 2);
+	return 0;
 }
 
 void
@@ -460,24 +797,171 @@ pout_dump(char *filename)
 int
 opcomp(const void *o1, const void *o2)
 {
-	return ((optab_t *) o1)->o_count - ((optab_t *) o2)->o_count;
+	ulong   c1 = ((optab_t *) o1)->o_count, c2 = ((optab_t *) o2)->o_count;
+
+	return c1 < c2 ? -1 : c1 > c2;
+}
+
+#define NHOT    20              /* hottest addresses reported   */
+
+static int
+addrcomp(const void *a1, const void *a2)
+{
+	ulong   c1 = addr_count[*(int *) a1], c2 = addr_count[*(int *) a2];
+
+	return c1 < c2 ? 1 : c1 > c2 ? -1 : 0;
+}
+
+/*
+ * Find the n most executed words, by pc | supmode; returns how many
+ * were executed at all, up to n.
+ */
+static int
+hot_addrs(int *hot, int n)
+{
+	int     i, k = 0;
+
+	for (i = 0; i < CORESZ * 2; ++i) {
+		if (!addr_count[i])
+			continue;
+		if (k < n)
+			hot[k++] = i;
+		else if (addr_count[i] > addr_count[hot[n - 1]])
+			hot[n - 1] = i;
+		else
+			continue;
+		qsort(hot, k, sizeof(int), addrcomp);
+	}
+	return k;
+}
+
+static uint      *seqcount;
+
+static int
+seqcomp(const void *s1, const void *s2)
+{
+	uint    c1 = seqcount[*(int *) s1], c2 = seqcount[*(int *) s2];
+
+	return c1 < c2 ? 1 : c1 > c2 ? -1 : 0;
+}
+
+/*
+ * Print the most frequent opcode sequences of the given length,
+ * the candidates for fused handlers.
+ */
+static void
+seq_out(uint *count, int len, char **name)
+{
+	int     i, j, n, nseq = 1, *idx;
+	double  total = 0;
+
+	for (i = 0; i < len; ++i)
+		nseq *= 0120;
+	idx = malloc(nseq * sizeof(int));
+	if (!idx)
+		return;
+	for (i = n = 0; i < nseq; ++i)
+		if (count[i]) {
+			total += count[i];
+			idx[n++] = i;
+		}
+	seqcount = count;
+	qsort(idx, n, sizeof(int), seqcomp);
+	for (i = 0; i < n && i < 20; ++i) {
+		for (j = len - 1; j >= 0; --j) {
+			int     k, op = idx[i];
+
+			for (k = 0; k < j; ++k)
+				op /= 0120;
+			printf("%s%s", name[op % 0120], j ? " " : "");
+		}
+		printf("\t%10u\t%7.4f%%\n", count[idx[i]],
+			100.0 * count[idx[i]] / total);
+	}
+	free(idx);
 }
 
 void
 stat_out(void)
 {
-	int     i;
-	int     total = 0;
+	int     i, n, hot[NHOT];
+	ulong   total = 0, etotal = 0;
+	char    *name[0120];
 
+	for (i = 0; i < 0120; ++i)
+		name[i] = optab[i].o_name;
 	qsort(optab, 0120, sizeof(optab[0]), opcomp);
 	for (i = 0; i < 0120; ++i)
 		total += optab[i].o_count;
 
 	for (i = 0; i < 0120; ++i)
 		if (optab[i].o_count)
-			printf("%s\t%10d\t%7.4f%%\t%d cpi\n",
+			printf("%s\t%10lu\t%7.4f%%\t%lu %s\n",
 				optab[i].o_name,
 				optab[i].o_count,
 				100.0 * optab[i].o_count / total,
-				optab[i].o_ticks / optab[i].o_count);
+				optab[i].o_ticks / optab[i].o_count, TICK_UNIT);
+
+	for (i = 0; i < 040; ++i)
+		etotal += ecode_count[i];
+	if (etotal) {
+		printf(_("\nExtracodes:\n"));
+		for (i = 0; i < 040; ++i)
+			if (ecode_count[i])
+				printf("e%o\t%10lu\t%7.4f%%\t%lu %s\n",
+					i + 050, ecode_count[i],
+					100.0 * ecode_count[i] / etotal,
+					ecode_ticks[i] / ecode_count[i],
+					TICK_UNIT);
+	}
+
+	printf(_("\nHottest addresses:\n"));
+	n = hot_addrs(hot, NHOT);
+	for (i = 0; i < n; ++i)
+		printf("%06o\t%10lu\t%7.4f%%\t%lu %s\n", hot[i],
+			addr_count[hot[i]], 100.0 * addr_count[hot[i]] / total,
+			addr_ticks[hot[i]] / addr_count[hot[i]], TICK_UNIT);
+
+	printf(_("\nMost frequent pairs:\n"));
+	seq_out(op_pairs, 2, name);
+	printf(_("\nMost frequent triples:\n"));
+	seq_out(op_triples, 3, name);
+}
+
+/*
+ * The same statistics in CSV, one line per opcode, extracode and
+ * hot address, for comparing runs of different versions.  Time is in
+ * TICK_UNIT and is the total, not per instruction.
+ */
+static void
+stat_csv(char *filename, double sec)
+{
+	FILE    *fp;
+	int     i, n, hot[NHOT];
+
+	fp = fopen(filename, "w");
+	if (!fp) {
+		perror(filename);
+		return;
+	}
+	fprintf(fp, "kind,name,count,ticks\n");
+	fprintf(fp, "version,%s,0,0\n", PACKAGE_VERSION);
+	fprintf(fp, "unit,%s,0,0\n", TICK_UNIT);
+	fprintf(fp, "total,%.6f,%lu,0\n", sec, icnt);
+	for (i = 0; i < 0120; ++i)
+		if (optab[i].o_count)
+			fprintf(fp, "opcode,%s,%lu,%lu\n", optab[i].o_name,
+				optab[i].o_count, optab[i].o_ticks);
+	for (i = 0; i < 040; ++i)
+		if (ecode_count[i])
+			fprintf(fp, "extracode,e%o,%lu,%lu\n", i + 050,
+				ecode_count[i], ecode_ticks[i]);
+	n = hot_addrs(hot, NHOT);
+	for (i = 0; i < n; ++i)
+		fprintf(fp, "address,%06o,%lu,%lu\n", hot[i],
+			addr_count[hot[i]], addr_ticks[hot[i]]);
+	fprintf(fp, "zcache,hits,%lu,0\n", zcache_hits);
+	fprintf(fp, "zcache,misses,%lu,0\n", zcache_misses);
+	fprintf(fp, "zcache,writebacks,%lu,0\n", zcache_writebacks);
+	fclose(fp);
 }
@@ -20,13 +20,13 @@
 
 #define PARASZ  (256 * 6)
 
-static unsigned char	para[PARASZ];
-static uchar		line[129];
-static int		pos;
-static int		maxp;
-static int		done;
-static int		bytes_total, bytes_tail;
-static unsigned char	lastc;
+static __thread unsigned char	para[PARASZ];
+static __thread uchar		line[129];
+static __thread int		pos;
+static __thread int		maxp;
+static __thread int		done;
+static __thread int		bytes_total, bytes_tail;
+static __thread unsigned char	lastc;
 
 static void
 rstline(void)
@@ -43,7 +43,7 @@ put(FILE * fout, uchar c)
 	if (line[pos] != GOST_SPACE) {
 		int saved = pos;
 		if (trace_e64)
-			putchar('\n');
+			putc('\n', LPOUT);
 		gost_write(line, maxp+1, fout);
 		rstline();
 		pos = saved;
@@ -61,12 +61,12 @@ dump(FILE *fout, unsigned sz)
 
 	for (cp = para + 12; cp - para < sz; ++cp) {
 		if (*cp && trace_e64) {
-			printf("%03o-", *cp <= 0140 ? *cp-1 : *cp);
+			fprintf(LPOUT, "%03o-", *cp <= 0140 ? *cp-1 : *cp);
 		}
 		switch (*cp) {
 		case 0177:
 			if (trace_e64)
-				printf("%03o-", cp[1]);
+				fprintf(LPOUT, "%03o-", cp[1]);
 			for (rc = *++cp; rc; --rc)
 				put(fout, lastc);
 			continue;
@@ -74,7 +74,7 @@ dump(FILE *fout, unsigned sz)
 		case 0175:
 		case 0:
 			if (trace_e64)
-				putchar('\n');
+				putc('\n', LPOUT);
 			return;
 		}
 		if (*cp & 0200) {
@@ -92,7 +92,7 @@ dump(FILE *fout, unsigned sz)
 		}
 		if (maxp >= 0) {
 			if (trace_e64)
-				putchar('\n');
+				putc('\n', LPOUT);
 			gost_write(line, maxp + 1, fout);
 			rstline();
 		}
@@ -151,7 +151,7 @@ pout_decode (char *outname)
 			return;
 		}
 	} else
-		fout = stdout;
+		fout = LPOUT;
 
 	bytes_total = 0;
 	bytes_tail = 0;
@@ -175,7 +175,7 @@ pout_decode (char *outname)
 		gost_write(line, maxp + 1, fout);
 		putc('\n', fout);
 	}
-	if (fout != stdout)
+	if (fout != LPOUT)
 		fclose (fout);
 }
 
@@ -198,7 +198,7 @@ pout_decode_file (char *inname, char *outname)
 			return;
 		}
 	} else
-		fout = stdout;
+		fout = LPOUT;
 	fflush (stderr);
 
 	bytes_total = 0;
@@ -214,6 +214,6 @@ pout_decode_file (char *inname, char *outname)
 		putc('\n', fout);
 	}
 	fflush (fout);
-	if (fout != stdout)
+	if (fout != LPOUT)
 		fclose (fout);
 }
@@ -424,7 +424,7 @@ again:
 static void
 utf8_putc (unsigned short ch, FILE *fout)
 {
-	static int initialized = 0;
+	static __thread int initialized = 0;
 
 	if (! initialized) {
 		/* Write UTF-8 tag: zero width no-break space. */
@@ -1249,7 +1249,7 @@ fatal_encoding (char *lang)
 	exit (1);
 }
 
-static void
+void
 init_local_encoding ()
 {
 	char *lang, *p;
@@ -1381,6 +1381,27 @@ utf8_to_gost (unsigned char **p)
 		(c3 & 0x3f));
 }
 
+/*
+ * Convert the character after a backslash in task text to GOST-10859:
+ * \* \< \> \: \@ \| \= \? stand for the symbols missing in ASCII,
+ * any other character for itself.
+ */
+unsigned char
+escape_to_gost (int c)
+{
+	switch (c) {
+	case '*': return GOST_MULTIPLICATION;
+	case '<': return GOST_LESS_THAN_OR_EQUAL;
+	case '>': return GOST_GREATER_THAN_OR_EQUAL;
+	case ':': return GOST_DIVISION;
+	case '@': return GOST_LOWER_TEN;
+	case '|': return GOST_LOGICAL_OR;
+	case '=': return GOST_IDENTICAL;
+	case '?': return GOST_IMPLICATION;
+	}
+	return unicode_to_gost (c);
+}
+
 unsigned short
 gost_to_unicode (unsigned char ch)
 {
@@ -12,7 +12,9 @@ void gost_write (unsigned char*, int, FILE*);
 unsigned char unicode_to_gost (unsigned short);
 unsigned short gost_to_unicode (unsigned char ch);
 unsigned char utf8_to_gost (unsigned char**);
+unsigned char escape_to_gost (int);
 void utf8_puts (const char*, FILE*);
 int unicode_getc (FILE*);
 void unicode_putc (unsigned short, FILE*);
 void set_input_encoding (char*);
+void init_local_encoding (void);
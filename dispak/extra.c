@@ -15,6 +15,8 @@
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
+#include <signal.h>
+#include <sys/syscall.h>
 #include "defs.h"
 #include "disk.h"
 #include "iobuf.h"
@@ -41,15 +43,13 @@ getbyte(ptr *bp)
 uint64_t
 getword(ptr *bp)
 {
-	uint64_t	w = 0;
-	int		i;
+	uint64_t	w;
 
 	if (bp->p_b) {
 		bp->p_b = 0;
 		++bp->p_w;
 	}
-	for (i = 0; i < 6; ++i)
-		w = w << 8 | core[bp->p_w].w_b[i];
+	w = word_get(&core[bp->p_w]);
 
 	++bp->p_w;
 
@@ -74,9 +74,23 @@ terminate(void)
 {
 	unsigned        u;
 
+	/* passport chunks share the drum, closed last to save its image */
 	for (u = 030; u < 070; ++u)
-		if (disks[u].diskh)
+		if (disks[u].diskh && disks[u].diskh != drumh)
 			disk_close(disks[u].diskh);
+	if (disks[OSD_NOMML1].diskh)
+		disk_close(disks[OSD_NOMML1].diskh);
+	disks[OSD_NOMML1].diskh = 0;
+	/* the drum of the supervisor, of a mapping of its own */
+	if (disks[OSD_NOMML3].diskh)
+		disk_close(disks[OSD_NOMML3].diskh);
+	disks[OSD_NOMML3].diskh = 0;
+	disk_flush();
+	disk_sync();
+	if (drumh)
+		disk_close(drumh);
+	drumh = 0;
+	alarm_release();
 }
 
 static int
@@ -91,7 +105,7 @@ lflush(uchar *line)
 	if (i < 0)
 		return 0;
 
-	gost_write (line, i + 1, stdout);
+	gost_write (line, i + 1, LPOUT);
 	memset (line, GOST_SPACE, i + 1);
 	return 1;
 }
@@ -102,19 +116,19 @@ print_text_debug (ushort addr0, ushort addr1, int itm_flag, int pos)
 	ptr             bp;
 	int		c;
 
-	printf ("*** E64  %s ", itm_flag ? "itm" : "gost");
+	fprintf (LPOUT, "*** E64  %s ", itm_flag ? "itm" : "gost");
 	bp.p_w = addr0;
 	bp.p_b = 0;
 	for (;;) {
 		if (! bp.p_w) {
-done:			printf ("\n");
+done:			fprintf (LPOUT, "\n");
 			return;
 		}
 		if (addr1 && bp.p_w == addr1 + 1)
 			goto done;
 
 		c = getbyte(&bp);
-		printf ("-%03o", c);
+		fprintf (LPOUT, "-%03o", c);
 
 		/* end of information */
 		if (itm_flag)
@@ -123,7 +137,7 @@ done:			printf ("\n");
 				goto done;
 			case 0173: /* repeat last symbol */
 				c = getbyte(&bp);
-				printf ("-%03o", c);
+				fprintf (LPOUT, "-%03o", c);
 				if (c == 040)
 					pos = 0;
 				else
@@ -136,7 +150,7 @@ done:			printf ("\n");
 				++pos;
 				if (pos == 128) {
 					/* No space left on line. */
-					putchar('/');
+					putc('/', LPOUT);
 					pos = 0;
 				}
 				break;
@@ -162,7 +176,7 @@ done:			printf ("\n");
 			case GOST_SET_POSITION:
 			case 0200: /* set position */
 				c = getbyte(&bp);
-				printf ("-%03o", c);
+				fprintf (LPOUT, "-%03o", c);
 				pos = c % 128;
 				break;
 			default:
@@ -172,7 +186,7 @@ done:			printf ("\n");
 				++pos;
 				if (pos == 128) {
 					/* No space left on line. */
-					putchar('/');
+					putc('/', LPOUT);
 					if (addr1)
 						pos = 0;
 				}
@@ -217,8 +231,8 @@ print_gost(ushort addr0, ushort addr1, uchar *line, int pos, int *need_newline)
 				lflush(line);
 				pos = 0;
 			}
-			if (! isatty (1))
-				utf8_puts("\f", stdout);
+			if (! isatty (fileno (LPOUT)))
+				utf8_puts("\f", LPOUT);
 			line[pos++] = GOST_SPACE;
 			break;
 		case GOST_CARRIAGE_RETURN:
@@ -231,7 +245,7 @@ print_gost(ushort addr0, ushort addr1, uchar *line, int pos, int *need_newline)
 				lflush(line);
 				pos = 0;
 			}
-			utf8_puts("\n", stdout);
+			utf8_puts("\n", LPOUT);
 			break;
 		case 0143: /* null width symbol */
 		case 0341:
@@ -248,7 +262,7 @@ print_gost(ushort addr0, ushort addr1, uchar *line, int pos, int *need_newline)
 				/* fill line by last symbol (?) */
 				memset (line, lastc, 128);
 				lflush(line);
-				putchar('\n');
+				putc('\n', LPOUT);
 				pos = 0;
 			} else
 				while (c-- & 017) {
@@ -275,7 +289,7 @@ print_gost(ushort addr0, ushort addr1, uchar *line, int pos, int *need_newline)
 			}
 			if (line[pos] != GOST_SPACE) {
 				lflush(line);
-				fputs("\\\n", stdout);
+				fputs("\\\n", LPOUT);
 			}
 			line[pos] = c;
 			lastc = c;
@@ -283,7 +297,7 @@ print_gost(ushort addr0, ushort addr1, uchar *line, int pos, int *need_newline)
 			if (pos == 128) {
 				/* No space left on line. */
 				lflush(line);
-				putchar('\n');
+				putc('\n', LPOUT);
 			}
 			break;
 		}
@@ -318,7 +332,7 @@ print_itm(ushort addr0, ushort addr1, uchar *line, int pos)
 				return bp.p_w;
 			}
 			lflush(line);
-			putchar('\n');
+			putc('\n', LPOUT);
 			pos = 0;
 		}
 		c = getbyte(&bp);
@@ -336,7 +350,7 @@ print_itm(ushort addr0, ushort addr1, uchar *line, int pos)
 				/* fill line by last symbol (?) */
 				memset (line, lastc, 128);
 				lflush(line);
-				putchar('\n');
+				putc('\n', LPOUT);
 				pos = 0;
 			} else
 				while (c-- & 017)
@@ -355,7 +369,7 @@ print_char (uchar *line, int *pos, int sym)
 {
 	if (*pos == 128) {
 		lflush (line);
-		putchar ('\n');
+		putc ('\n', LPOUT);
 	}
 	line [(*pos) & 127] = sym;
 	++(*pos);
@@ -388,11 +402,7 @@ print_octal(ushort addr0, ushort addr1, uchar *line, int pos,
 				return 0;
 			return addr0;
 		}
-		w = (uint64_t) core[addr0].w_b[0] << 40 |
-			(uint64_t) core[addr0].w_b[1] << 32 |
-			(uint) core[addr0].w_b[2] << 24 |
-			(uint) core[addr0].w_b[3] << 16 |
-			core[addr0].w_b[4] << 8 | core[addr0].w_b[5];
+		w = word_get(&core[addr0]);
 		++addr0;
 
 		w <<= 64 - digits * 3;
@@ -443,6 +453,7 @@ print_command(ushort addr0, ushort addr1, uchar *line, int pos,
 	int width, int repeat)
 {
 	unsigned long a, b;
+	uint64_t w;
 
 	for (;;) {
 		if (! addr0)
@@ -458,10 +469,9 @@ print_command(ushort addr0, ushort addr1, uchar *line, int pos,
 				return 0;
 			return addr0;
 		}
-		a = (unsigned long) core[addr0].w_b[0] << 16 |
-			core[addr0].w_b[1] << 8 | core[addr0].w_b[2];
-		b = (unsigned long) core[addr0].w_b[3] << 16 |
-			core[addr0].w_b[4] << 8 | core[addr0].w_b[5];
+		w = word_get(&core[addr0]);
+		a = w >> 24;
+		b = w & 0xffffff;
 		++addr0;
 
 		print_command1 (line, &pos, a);
@@ -645,12 +655,12 @@ again:
 		width = wp->w_b[4] >> 4 | ((wp->w_b[3] << 4) & 0xf0);
 		repeat = Raddr2(*wp);
 		if (trace_e64) {
-			printf ("*** E64  %05o-%05o  format=%d offset=%d", addr0, addr1, format, offset);
-			if (digits) printf (" digits=%d", digits);
-			if (width) printf (" width=%d", width);
-			if (repeat) printf (" repeat=%d", repeat);
-			if (final) printf (" FINAL=%#o", final);
-			printf ("\n");
+			fprintf (LPOUT, "*** E64  %05o-%05o  format=%d offset=%d", addr0, addr1, format, offset);
+			if (digits) fprintf (LPOUT, " digits=%d", digits);
+			if (width) fprintf (LPOUT, " width=%d", width);
+			if (repeat) fprintf (LPOUT, " repeat=%d", repeat);
+			if (final) fprintf (LPOUT, " FINAL=%#o", final);
+			fprintf (LPOUT, "\n");
 		}
 		need_newline = 1;
 		switch (format) {
@@ -684,21 +694,21 @@ again:
 				++final;
 			if (addr1 && addr0 <= addr1) {
 				/* Repeat printing task until all data expired. */
-				putchar('\n');
+				putc('\n', LPOUT);
 				goto again;
 			}
 			while (final-- > 0)
-				putchar('\n');
+				putc('\n', LPOUT);
 			break;
 		}
 		/* Check the limit of data pointer. */
 		if (addr1 && addr0 > addr1) {
 			lflush(line);
-			putchar('\n');
+			putc('\n', LPOUT);
 			break;
 		}
 	}
-	fflush(stdout);
+	fflush(LPOUT);
 	return E_SUCCESS;
 }
 
@@ -758,7 +768,7 @@ e53(void)
 		restore_state();
 		return E_SUCCESS;
 	case 017: {             /* wait for events      */
-		struct itimerval        itv = {{0, 0}, {0, 0}};
+		sigset_t        set, old;
 
 		acc.l = 0;
 		if (!(emask & 1)) {
@@ -766,16 +776,18 @@ e53(void)
 			return E_SUCCESS;
 		}
 		eenab = 1;
-		if (eraise(0)) {
-			acc.r = 0;
-			return E_SUCCESS;
-		}
-		getitimer(ITIMER_REAL, &itv);
-		if (!(itv.it_value.tv_sec | itv.it_value.tv_usec)) {
-			itv.it_value.tv_usec = 040 * 80000;
-			setitimer(ITIMER_REAL, &itv, NULL);
+		/* the alarm must not go off between the test and the wait */
+		sigemptyset(&set);
+		sigaddset(&set, SIGALRM);
+		pthread_sigmask(SIG_BLOCK, &set, &old);
+		if (! eraise(0)) {
+			if (! alarm_pending())
+				alarm_set(040 * 80000);
+			set = old;
+			sigdelset(&set, SIGALRM);
+			sigsuspend(&set);
 		}
-		pause();
+		pthread_sigmask(SIG_SETMASK, &old, NULL);
 		acc.r = 0;
 		return E_SUCCESS;
 	}
@@ -867,9 +879,9 @@ e50(void)
 	}
 	case 0114: {	/* get date */
 		time_t t;
-		struct tm * d;
+		struct tm tm, * d;
 		time(&t);
-		d = localtime(&t);
+		d = localtime_r(&t, &tm);
 		++d->tm_mon;
 		acc.l = (d->tm_mday / 10) << 9 |
 			(d->tm_mday % 10) << 5 |
@@ -900,13 +912,11 @@ e50(void)
 		}
 		disks[u].diskno = NDISK(acc.r);
 		disks[u].mode = acc.r & 0x10000 ? DISK_READ_ONLY : DISK_READ_WRITE;
-		if (!(disks[u].diskh = disk_open(disks[u].diskno, disks[u].mode))) {
+		if (!disk_get(disks[u].diskno, disks[u].mode)) {
 			acc.r = 1;
 			disks[u].diskno = 0;
 			return E_SUCCESS;
 		}
-		disk_close(disks[u].diskh);
-		disks[u].diskh = 0;
 		disks[u].offset = 0;
 		acc.r = 0;
 		return E_SUCCESS;
@@ -961,17 +971,13 @@ e50(void)
 		return E_SUCCESS;
 	case 07700:	/* set alarm */
 		if (!(acc.r & 0x7fff)) {
-			struct itimerval        itv = {{0, 0}, {0, 0}};
-			setitimer(ITIMER_REAL, &itv, NULL);
+			alarm_set(0);
 			return E_SUCCESS;
 		}
 		if (!ehandler || (acc.l != 0xffffff))
 			usleep((acc.r & 0x7fff) * 80000);
-		else {
-			struct itimerval        itv = {{0, 0}, {0, 0}};
-			itv.it_value.tv_usec = (acc.r & 0x7fff) * 80000;
-			setitimer(ITIMER_REAL, &itv, NULL);
-		}
+		else
+			alarm_set((acc.r & 0x7fff) * 80000);
 		return E_SUCCESS;
 	case 07701:	/* form new task */
 		exform();
@@ -1044,6 +1050,7 @@ e62(void)
 				if (disks[u].diskh)
 					disk_close(disks[u].diskh);
 				disks[u].diskh = 0;
+				disk_uncache(disks[u].diskno);
 				disks[u].diskno = 0;
 			}
 			return E_SUCCESS;
@@ -1161,13 +1168,14 @@ ddio(void)
 	ushort          sector = 0;
 	uinstr_t        uil, uir;
 	int             r;
-	static uchar	buf[6144];
-        static char	cvbuf[1024];
+	void            *dh;
+	static __thread uchar buf[6144];
+        static __thread char cvbuf[1024];
 
 	LOAD(acc, addr);
 	unpack(addr);
-	uil = uicore[addr][0];
-	uir = uicore[addr][1];
+	uil = shadow[addr].s_insn[0];
+	uir = shadow[addr].s_insn[1];
 	cwadj(&uil);
 	cwadj(&uir);
 	addr = (uil.i_addr & 03700) << 4;
@@ -1180,11 +1188,12 @@ ddio(void)
 		zone += (u - (phdrum & 077)) * 040;
 		u = phdrum >> 8;
 	}
-	if (!disks[u].diskh) {
+	/* numbered volumes come from the handle cache */
+	if (!(dh = disks[u].diskh)) {
 	    if (!disks[u].diskno) {
 		return E_CWERR;
 	    } else {
-		if (!(disks[u].diskh = disk_open(disks[u].diskno, disks[u].mode)))
+		if (!(dh = disk_get(disks[u].diskno, disks[u].mode)))
 			return E_INT;
 	    }
 	}
@@ -1200,7 +1209,7 @@ ddio(void)
                } else {
                  sector = (uir.i_addr >> 6) & 3;
                }
-		r = disk_readi(disks[u].diskh,
+		r = disk_readi(dh,
 			(zone + disks[u].offset) & 0xfff,
                                (char *)buf, cvbuf, NULL, DISK_MODE_QUIET);
 		if (!(uil.i_opcode & 010)) {
@@ -1209,12 +1218,9 @@ ddio(void)
 				core + addr + (uil.i_addr & 3) * 256,
 				256 * 6
 			);
-                        memcpy(
-                               cvbuf + sector * 256,
-                               convol + addr + (uil.i_addr & 3) * 256,
-                               256
-                               );
-			r = disk_writei(disks[u].diskh,
+                        convol_get(addr + (uil.i_addr & 3) * 256,
+                               cvbuf + sector * 256, 256);
+			r = disk_writei(dh,
 				(zone + disks[u].offset) & 0xfff,
                                         (char *)buf, cvbuf, NULL, DISK_MODE_QUIET);
 
@@ -1226,9 +1232,12 @@ ddio(void)
 			/* листовой обмен с диском по КУС - физический номер зоны */
 			iomode = DISK_MODE_PHYS;
 		}
-		r = disk_readi(disks[u].diskh,
+		/* a zone never written leaves the convolution as it was */
+		convol_get(addr, cvbuf, 1024);
+		r = disk_readi(dh,
 			(zone + disks[u].offset) & 0xfff,
-                               (char *)(core + addr), (char *)convol + addr, cwords, iomode);
+                               (char *)(core + addr), cvbuf, cwords, iomode);
+		convol_put(addr, cvbuf, 1024);
 		core[0].w_s[0] = core[0].w_s[1] = core[0].w_s[2] = 0;
 		if (uil.i_opcode & 1 && disks[u].diskno < 2048) {
 			/* check words requested for tape */
@@ -1239,33 +1248,25 @@ ddio(void)
 			memcpy((char*)(core + addr), cwords, 48);
 		}
 	} else {
-            r = disk_writei(disks[u].diskh,
+            convol_get(addr, cvbuf, 1024);
+            r = disk_writei(dh,
                             (zone + disks[u].offset) & 0xfff,
-                            (char *)(core + addr), (char *)convol + addr, NULL, DISK_MODE_QUIET);
+                            (char *)(core + addr), cvbuf, NULL, DISK_MODE_QUIET);
         }
-	if (disks[u].diskno) {
-		disk_close(disks[u].diskh);
-		disks[u].diskh = 0;
-	}
 	if (r != DISK_IO_OK)
 		return E_DISKERR;
 	if (uil.i_reg & 8 && uil.i_opcode & 010) {
 		memcpy(core + addr + (uil.i_addr & 3) * 256,
 		       buf + sector * 256 * 6,
 		       256 * 6);
-                memcpy(convol + addr + (uil.i_addr & 3) * 256,
-                       cvbuf + sector * 256,
-                       256);
+                convol_put(addr + (uil.i_addr & 3) * 256,
+                       cvbuf + sector * 256, 256);
 		core[0].w_s[0] = core[0].w_s[1] = core[0].w_s[2] = 0;
-		for (u = addr + (uil.i_addr & 3) * 256;
-		     u < addr + (uil.i_addr & 3) * 256 + 256; ++u)
-			cflags[u] &= ~C_UNPACKED;
+		pages_written(addr + (uil.i_addr & 3) * 256, 256);
 	} else if (uil.i_opcode & 010) {
-		for (u = addr; u < addr + 1024; ++u)
-			cflags[u] &= ~C_UNPACKED;
+		pages_written(addr, 1024);
 		if (uil.i_opcode & 1)
-			for (u = 010; u < 020; ++u)
-				cflags[u] &= ~C_UNPACKED;
+			pages_written(010, 010);
 	}
 	return E_SUCCESS;
 }
@@ -1280,7 +1281,7 @@ ttout(uchar flags, ushort a1, ushort a2)
 	start = sp = core[a1].w_b;
 	if (flags == 0220) {
 		/* output to operator's console - first char is channel num */
-		putchar(' ');
+		putc(' ', LPOUT);
 		++sp;
 	}
 	while ((sp - start < E71BUFSZ) && (sp - start < (a2 - a1 + 1) * 6)) {
@@ -1289,14 +1290,14 @@ ttout(uchar flags, ushort a1, ushort a2)
 				break;
 			/* bit 37 means raw I/O, but convert control chars to ANSI escapes */
 			switch (*sp &0x7f) {
-			case '\037': fputs("\033[H\033[J", stdout); break;	// clrscr
-			case '\014': fputs("\033[H", stdout); break;		// home
-			case '\031': fputs("\033[A", stdout); break;		// up
-			case '\032': fputs("\033[B", stdout); break;		// down
-			case '\030': fputs("\033[C", stdout); break;		// right
-			case '\010': fputs("\033[D", stdout); break;		// left
+			case '\037': fputs("\033[H\033[J", LPOUT); break;	// clrscr
+			case '\014': fputs("\033[H", LPOUT); break;		// home
+			case '\031': fputs("\033[A", LPOUT); break;		// up
+			case '\032': fputs("\033[B", LPOUT); break;		// down
+			case '\030': fputs("\033[C", LPOUT); break;		// right
+			case '\010': fputs("\033[D", LPOUT); break;		// left
 			default:
-				putchar(*sp & 0x7f);
+				putc(*sp & 0x7f, LPOUT);
 			}
 		} else
 		switch (*sp) {
@@ -1304,16 +1305,16 @@ ttout(uchar flags, ushort a1, ushort a2)
 		case GOST_EOF:
 			if (!(flags & 010)) {
 				/* if not a prompt */
-				putchar('\n');
+				putc('\n', LPOUT);
 			}
 			goto done;
 		case GOST_CARRIAGE_RETURN:
 			/* maybe should output backslash here ? */
 		case GOST_NEWLINE:
-			putchar('\n');
+			putc('\n', LPOUT);
 			break;
 		case 0136:
-			putchar('?');
+			putc('?', LPOUT);
 			break;
 		case 0141:
 		case 0142:
@@ -1324,48 +1325,48 @@ ttout(uchar flags, ushort a1, ushort a2)
 		case 0170:
 			/* non-destructive backspace */
 			/* assuming ANSI compatibility */
-			fputs("\033[D", stdout);
+			fputs("\033[D", LPOUT);
 			break;
 		case 0171:
 			/* move right - assuming ANSI compatibility */
-			fputs("\033[C", stdout);
+			fputs("\033[C", LPOUT);
 			break;
 		case 0176:
 			/* move up - assuming ANSI compatibility */
-			fputs("\033[A", stdout);
+			fputs("\033[A", LPOUT);
 			break;
 		case 0177:
 			/* move down - assuming ANSI compatibility */
-			fputs("\033[B", stdout);
+			fputs("\033[B", LPOUT);
 			break;
 		case 0162:
 			/* erase */
-			fputs("\033[H\033[J", stdout);
+			fputs("\033[H\033[J", LPOUT);
 			break;
 		case 0167:
 			/* home */
-			fputs("\033[H", stdout);
+			fputs("\033[H", LPOUT);
 			break;
 		case 021:
 			if (flags == 0220) {
 				/* up arrow is end of text for op. console */
-				putchar('\n');
+				putc('\n', LPOUT);
 				goto done;
 			}
 			/* fall thru */
 		default:
 			if (*sp <= 0134)
-				gost_putc(*sp, stdout);
+				gost_putc(*sp, LPOUT);
 			else {
-				printf("[%03o]", *sp);
+				fprintf(LPOUT, "[%03o]", *sp);
 			}
 			break;
 		}
-		fflush(stdout);
+		fflush(LPOUT);
 		++sp;
 	}
 done:
-	fflush(stdout);
+	fflush(LPOUT);
 
 	if (!(flags & 010))
 		(void) eraise(010);
@@ -1380,8 +1381,8 @@ ttin(uchar flags, ushort a1, ushort a2)
 	if (flags & 4)          /* non-standard prompt */
 		ttout(flags, a1, a2);
 	else
-		fputs("-\r", stdout);
-	fflush(stdout);
+		fputs("-\r", LPOUT);
+	fflush(LPOUT);
 	if (! fgets((char*) buf, sizeof(buf), stdin))
 		buf[0] = '\n';
 	dp = core[a1].w_b;
@@ -1408,19 +1409,20 @@ ttin(uchar flags, ushort a1, ushort a2)
 
 int punch(ushort a1, ushort a2)
 {
-	static FILE * fd = 0;
+	FILE * fd;
 	unsigned char * sp;
 	int bytecnt = 0, max;
-	if (!punchfile)
-		return E_SUCCESS;
-	if (!fd) {
-		if (!(fd = fopen(punchfile, "w"))) {
+	if (!punchout) {
+		if (!punchfile)
+			return E_SUCCESS;
+		if (!(punchout = fopen(punchfile, "w"))) {
 			perror(punchfile);
 			punchfile = 0;
 			return E_UNIMP;
 		}
-		/* fputs("P4 80 N\n", fd); */
+		/* fputs("P4 80 N\n", punchout); */
 	}
+	fd = punchout;
 	sp = core[a1].w_b;
 	max = (a2 - a1 + 1) * 6;
 	while (bytecnt < max) {
@@ -1505,8 +1507,8 @@ term(void)
 	}
 	for (;;++addr) {
 		unpack(addr);
-		uil = uicore[addr][0];
-		uir = uicore[addr][1];
+		uil = shadow[addr].s_insn[0];
+		uir = shadow[addr].s_insn[1];
 		cwadj(&uil);
 		cwadj(&uir);
 		switch (uil.i_opcode & 0360) {
@@ -1533,7 +1535,7 @@ oporos:
 				return punch(ADDR(reg[uil.i_reg] + uil.i_addr),
 				 ADDR(reg[uir.i_reg] + uir.i_addr));
 			}
-printf ("e71: unknown op %#o\n", uil.i_opcode);
+fprintf (LPOUT, "e71: unknown op %#o\n", uil.i_opcode);
 			return E_UNIMP;
 		}
 		if (uir.i_opcode & 0100)
@@ -1637,6 +1639,7 @@ resources(void)
 				disk_close(disks[arg[i]].diskh);
 			disks[arg[i]].diskh = 0;
 			if (arg[i] != (phdrum >> 8)) {
+				disk_uncache(disks[arg[i]].diskno);
 				disks[arg[i]].diskno = 0;
 			}
 		}
@@ -1685,7 +1688,6 @@ resources(void)
 #define USRC    (arg[i])
 #define UDST    (arg[i + 1])
 		for (i = 1; i < 7; i += 2) {
-			int j;
 			uchar tmp[6144];
 			if (USRC == 077)
 				return E_SUCCESS;
@@ -1696,13 +1698,12 @@ resources(void)
 			memcpy(tmp, &core[USRC * 02000], 6144);
 			memcpy(&core[USRC * 02000], &core[UDST * 02000], 6144);
 			memcpy(&core[UDST * 02000], tmp, 6144);
-			memcpy(tmp, &convol[USRC * 02000], 1024);
-			memcpy(&convol[USRC * 02000], &convol[UDST * 02000], 1024);
-			memcpy(&convol[UDST * 02000], tmp, 1024);
-			for (j = 0; j < 02000; j++) {
-				cflags[j + USRC * 02000] &= ~C_UNPACKED;
-				cflags[j + UDST * 02000] &= ~C_UNPACKED;
-			}
+			convol_get(USRC * 02000, (char *) tmp, 1024);
+			convol_get(UDST * 02000, (char *) tmp + 1024, 1024);
+			convol_put(USRC * 02000, (char *) tmp + 1024, 1024);
+			convol_put(UDST * 02000, (char *) tmp, 1024);
+			pages_written(USRC * 02000, 02000);
+			pages_written(UDST * 02000, 02000);
 		}
 		return E_SUCCESS;
 	case 000:				/* free RAM pages */
@@ -1728,7 +1729,68 @@ alrm_handler(int sig)
 	(void) eraise(1);
 }
 
-static ptr      txt;
+/*
+ * The alarm of extracode 050 07700, which 050 017 waits for.  With
+ * setitimer() and pause() it would belong to the process, and the
+ * machines of libdispak would cancel each other's alarms and sleep
+ * through their own; each machine has a timer of its own instead,
+ * made on first use, which signals the thread running the machine.
+ */
+static __thread timer_t alarm_timer;
+static __thread uchar   alarm_made;
+
+void
+alarm_set(ulong usec)
+{
+	struct itimerspec       its;
+	struct sigevent         sev;
+
+	if (! alarm_made) {
+		if (! usec)
+			return;
+		memset(&sev, 0, sizeof(sev));
+		sev.sigev_signo = SIGALRM;
+#ifdef SIGEV_THREAD_ID
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+		sev.sigev_notify = SIGEV_THREAD_ID;
+		sev.sigev_notify_thread_id = syscall(SYS_gettid);
+#else
+		sev.sigev_notify = SIGEV_SIGNAL;
+#endif
+		if (timer_create(CLOCK_MONOTONIC, &sev, &alarm_timer) < 0) {
+			perror("timer_create");
+			return;
+		}
+		alarm_made = 1;
+	}
+	memset(&its, 0, sizeof(its));
+	its.it_value.tv_sec = usec / 1000000;
+	its.it_value.tv_nsec = usec % 1000000 * 1000;
+	timer_settime(alarm_timer, 0, &its, NULL);
+}
+
+int
+alarm_pending(void)
+{
+	struct itimerspec       its;
+
+	if (! alarm_made || timer_gettime(alarm_timer, &its) < 0)
+		return 0;
+	return its.it_value.tv_sec || its.it_value.tv_nsec;
+}
+
+/* at the end of a run */
+void
+alarm_release(void)
+{
+	if (alarm_made)
+		timer_delete(alarm_timer);
+	alarm_made = 0;
+}
+
+static __thread ptr txt;
 
 static unsigned
 uget(void)
@@ -1756,7 +1818,7 @@ nextw(void)
 	return getword(&txt);
 }
 
-static ushort   diagaddr;
+static __thread ushort diagaddr;
 
 static void
 diag(char *s)
@@ -1788,19 +1850,19 @@ exform(void)
 
 	do {
 		c = getbyte(&txt);
-		gost_putc(c, stdout);
+		gost_putc(c, LPOUT);
 	} while(c != GOST_TSE);
-	putchar('\n');
+	putc('\n', LPOUT);
 	txt.p_w = ADDR(acc.r);
 	txt.p_b = 0;
 	w = getword(&txt);
 	diagaddr = 0;
 	if ((w & 0xffffff000000ull) == TKH000) {
 		diagaddr = ADDR(w);
-		r = vsinput(uget, diag, 1);
+		r = vsinput(uget, diag, 1, 0);
 	} else {
 		--txt.p_w;
-		r = vsinput(uget, diag, 0);
+		r = vsinput(uget, diag, 0, 0);
 	}
 	if (r < 0) {
 		acc.r = -r;
@@ -1833,6 +1895,8 @@ emu_call(void)
 				    : disk_write(disks[u].diskh, zone, addr);
 		if (r != DISK_IO_OK)
 			return E_DISKERR;
+		if (acc.r & 0400000)
+			pages_written(accex.r & 0176000, 02000);
 		return E_SUCCESS;
 	}
 	case 'b':       /* break on first cmd */
@@ -17,33 +17,70 @@
 #include "disk.h"
 #include "iobuf.h"
 
-static FILE             *ibuf;
-static char             ibufname[MAXPATHLEN];
-static struct passport  psp;
-static ushort           iaddr;
-static size_t            enda3;
+static __thread uchar   *ibuf;          /* the whole input buffer       */
+static __thread size_t  ibpos;
+static __thread char    ibufname[MAXPATHLEN];   /* "" if from memory */
+static __thread struct passport psp;
+static __thread ushort  iaddr;
+static __thread size_t   enda3;
 
+/*
+ * The directory of the input buffers: --input-queue, $BESM6_QUEUE or
+ * ~/.besm6/input_queue.  A queue of its own lets a run start without
+ * contending for buffer numbers with all the others on the host.
+ */
+void
+input_queue_path(char *buf)
+{
+	if (input_queue || (input_queue = getenv("BESM6_QUEUE")))
+		strcpy(buf, input_queue);
+	else {
+		disk_local_path (buf);
+		strcat(buf, "/input_queue");
+	}
+	mkdir(buf, 0755);
+}
+
+/*
+ * Loads the task from input buffer ibufno of the input queue, or from
+ * the one vsinput() left in memory if ibufno is 0.
+ */
 int
 input(unsigned ibufno)
 {
-	int             i;
+	int             i, fd;
 	struct stat     stbuf;
 
-	disk_local_path (ibufname);
-	strcat(ibufname, "/input_queue");
-	mkdir(ibufname, 0755);
-	sprintf(ibufname + strlen(ibufname), "/%03o", ibufno);
+	if (ibufno == 0) {
+		ibufname[0] = 0;
+		if (! (ibuf = vsinput_take(&enda3)))
+			return -1;
+	} else {
+		input_queue_path (ibufname);
+		sprintf(ibufname + strlen(ibufname), "/%03o", ibufno);
 
-	ibuf = fopen(ibufname, "r");
-	if (!ibuf) {
-		perror(ibufname);
-		return -1;
+		fd = open(ibufname, O_RDONLY);
+		if (fd < 0) {
+			perror(ibufname);
+			return -1;
+		}
+		if (fstat(fd, &stbuf) < 0 ||
+		    ! (ibuf = malloc(stbuf.st_size ? stbuf.st_size : 1)) ||
+		    read(fd, ibuf, stbuf.st_size) != stbuf.st_size) {
+			close(fd);
+			perror(_("Input buffer read"));
+			return -1;
+		}
+		close(fd);
+		enda3 = stbuf.st_size;
 	}
-	if (fread(&psp, sizeof(psp), 1, ibuf) != 1) {
+	if (enda3 < sizeof(psp)) {
 ibr:
-		perror(_("Input buffer read"));
+		fprintf(stderr, "%s\n", _("Input buffer read"));
 		return -1;
 	}
+	memcpy(&psp, ibuf, sizeof(psp));
+	ibpos = sizeof(psp);
 
 	user = psp.user;
 	spec_saved = psp.spec;
@@ -80,11 +117,13 @@ ibr:
 	if ((phdrum = psp.phys))
 		phdrum |= psp.vol[0].u << 8;
 
-	while (ftell(ibuf) < psp.arr_end) {
+	while (ibpos < psp.arr_end) {
 		struct ibword   ibw;
 
-		if (fread(&ibw, sizeof(ibw), 1, ibuf) != 1)
+		if (ibpos + sizeof(ibw) > enda3)
 			goto ibr;
+		memcpy(&ibw, ibuf + ibpos, sizeof(ibw));
+		ibpos += sizeof(ibw);
 		switch (ibw.tag) {
 		case W_IADDR:
 			iaddr = ibw.w.w_b[4] << 8 | ibw.w.w_b[5];
@@ -99,8 +138,6 @@ ibr:
 		ninter = 1;
 		intercept = psp.intercept;
 	}
-	fstat(fileno(ibuf), &stbuf);
-	enda3 = stbuf.st_size;
 	return 0;
 }
 
@@ -109,39 +146,40 @@ e60(void)
 {
 	struct ibword   ibw[24];
 	int             i;
-	size_t          pos;
 
 	if (reg[016] == 0)
 		return E_SUCCESS;
 
-	if ((pos = ftell(ibuf)) == enda3) {
+	if (ibpos == enda3) {
 		reg[016] = 0;
 		return E_SUCCESS;
 	}
 
-	if (pos == psp.arr_end) {
-		if (fread(ibw, sizeof(struct ibword), 1, ibuf) != 1)
+	if (ibpos == psp.arr_end) {
+		if (ibpos + sizeof(struct ibword) > enda3)
 			return E_INT;
-		pos += sizeof(struct ibword);
+		memcpy(ibw, ibuf + ibpos, sizeof(struct ibword));
+		ibpos += sizeof(struct ibword);
 		if (ibw[0].tag != W_IADDR)
 			return E_INT;
 	}
 
-	if (fread(ibw, sizeof(struct ibword), 24, ibuf) != 24)
+	if (ibpos + sizeof(struct ibword) * 24 > enda3)
 		return E_INT;
-	pos += sizeof(struct ibword) * 24;
+	memcpy(ibw, ibuf + ibpos, sizeof(struct ibword) * 24);
+	ibpos += sizeof(struct ibword) * 24;
 
 	for (i = 0; i < 24; ++i) {
 		if (ibw[i].tag != W_DATA)
 			return E_INT;
 		core[reg[016] + i] = ibw[i].w;
-		cflags[reg[016] + i] &= ~C_UNPACKED;
+		PAGE_WRITTEN(reg[016] + i);
 		if (!psp.spec)
-			convol[reg[016] + i] |= CV_NUMBER;
+			shadow[reg[016] + i].s_convol |= CV_NUMBER;
 	}
 
-	if (pos == enda3) {
-		fseek(ibuf, psp.arr_end, SEEK_SET);
+	if (ibpos == enda3) {
+		ibpos = psp.arr_end;
 		reg[016] = 0;
 	}
 
@@ -151,7 +189,8 @@ e60(void)
 void
 ib_cleanup(void)
 {
-	fclose(ibuf);
-	if (!psp.keep)
+	free(ibuf);
+	ibuf = NULL;
+	if (ibufname[0] && !psp.keep)
 		unlink(ibufname);
 }
@@ -0,0 +1,1314 @@
+/*
+ * BESM-6 processor control unit.
+ * Translation of hot blocks into x86-64 code.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this program and/or modify it under the terms of
+ * the GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "COPYING" for more details.
+ */
+
+/*
+ * A cached block of user code (see cu.c) entered JIT_HOT times is
+ * translated into host code, which run_fast() then calls instead of
+ * going through the block.  The code keeps the machine where run()
+ * keeps it, in the thread-local variables of defs.h, addressed from
+ * rbx; it counts the instructions itself and leaves pc, right, abpc
+ * and abright as run() would at the point it stops.
+ * Loads, stores, the index register instructions, the jumps and the
+ * logical operations are translated in line; the other routines of
+ * arith.c that need no normalization are called directly once the
+ * operand is fetched, and the rest goes through the helpers below,
+ * which do what run() does around them, the rounding tail included.  Extracodes, stop, the privileged
+ * instructions and watched stores are left to run(): the code stops
+ * in front of them, and run_fast() goes on from there in the block.
+ * At every word the code checks what run() checks in a block and
+ * stops if any of it fails.  A block that ends goes on to the block
+ * it jumps to, if that one is translated too, after the checks run()
+ * makes when it enters a block, so a hot loop stays in host code
+ * until its exit, an interrupt or the instruction budget.
+ * Each machine has a buffer of code of its own, placed where the code
+ * can call into the program directly if it can be, and dropped as a
+ * whole when full; a block that changes drops its translation along
+ * with the block.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include "defs.h"
+#include "optab.h"
+
+#ifdef JIT
+
+#define JIT_HOT         32              /* entries of a block to translate it */
+#define JIT_BYTES       (16 << 20)      /* code buffer of a machine     */
+#define JIT_BLOCKS      65536           /* s_jit indexes these          */
+#define JIT_ALIGN       16              /* each block starts at these   */
+#define JIT_ROOM        32768           /* more than the longest block  */
+#define JIT_HALVES      64              /* longest block, in half-words */
+#define JIT_FIXUPS      1024
+
+extern long     aumodes[];
+extern int      aax(), aex(), aox();
+
+enum { RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+       R8, R9, R10, R11, R12, R13, R14, R15 };
+#define NOIDX   -1
+
+/* condition codes */
+#define CC_E    4
+#define CC_NE   5
+#define CC_S    8
+#define CC_AE   3
+#define JUMP    -1
+
+/* opcodes */
+#define O_ADD   0x01
+#define O_OR    0x09
+#define O_AND   0x21
+#define O_TEST  0x85
+#define O_ST8   0x88
+#define O_ST    0x89
+#define O_LD    0x8b
+#define O_LEA   0x8d
+#define O_IMUL  0x69
+#define O_MOVZB 0x0fb6
+#define O_MOVZW 0x0fb7
+#define O_SETE  0x0f94
+
+/* the group 1 operations, as the register of the ModRM byte */
+#define G_ADDI  0
+#define G_ANDI  4
+#define G_SUBI  5
+#define G_CMPI  7
+
+/* a variable of the machine, relative to rbx */
+#define T(v)    offset(&(v))
+#define M(v)    RBX, NOIDX, 1, T(v)
+
+/* where translated code may leave */
+enum {
+	X_BEFORE,       /* in front of instruction k, for run()         */
+	X_AFTER,        /* past k, eax the result                       */
+	X_DONE,         /* past k, pc set: on to the block there        */
+	X_FAIL,         /* a helper failed at k, before it or past it   */
+	NX
+};
+#define X_NONE  0xffff                  /* jit_at: left from chain      */
+#define X_MOD   0x80                    /* jit_at: the address of k is modified */
+
+struct jit {
+	uchar   *buf;                   /* JIT_BYTES of code            */
+	unsigned first, used;           /* past the common code, all    */
+	uchar   *p;                     /* emitting here                */
+	uchar   *leave, *chain;         /* the common code              */
+	uchar   *out, *done;        /* the exits, shared            */
+	unsigned nblocks;               /* entry[0] is not used         */
+	uchar   *entry[JIT_BLOCKS];     /* the code of each block       */
+	reg_t   start;                  /* the block being translated   */
+	uint64_t dyn;                   /* its halves after utc or wtc  */
+	int     wrote;                  /* it may have stored by now    */
+	int     nfix;
+	struct  {
+		uchar   *at;
+		uchar   kind, k;
+	}       fix[JIT_FIXUPS];        /* jumps to the exits           */
+	uchar   *stub[NX][JIT_HALVES];  /* the exits, once made         */
+};
+
+static __thread struct jit *J;          /* translator of the machine    */
+
+static __thread uchar   jit_broken;     /* no buffer to be had          */
+static __thread reg_t   jit_from;       /* the block stopped in         */
+static __thread unsigned jit_at;        /* and where: kind << 8 | k     */
+
+#define B(x)    (*J->p++ = (x))
+
+/*
+ * Out of line, so that the address of each variable is taken as the
+ * linker can relax it, and not subtracted from a GOT entry.
+ */
+static int __attribute__((noinline))
+offset(void *v)
+{
+	return (char *) v - (char *) reg;
+}
+
+static void
+d16(unsigned v)
+{
+	ushort  s = v;
+
+	memcpy(J->p, &s, 2);
+	J->p += 2;
+}
+
+static void
+d32(unsigned v)
+{
+	memcpy(J->p, &v, 4);
+	J->p += 4;
+}
+
+/* ModRM for [base + index * scale + disp], r the register or /digit */
+static void
+modrm(int r, int base, int index, int scale, int disp)
+{
+	int     mod = !disp && (base & 7) != RBP ? 0 :
+		disp == (signed char) disp ? 0x40 : 0x80;
+
+	if (index == NOIDX && (base & 7) != RSP) {
+		B(mod | (r & 7) << 3 | (base & 7));
+	} else {
+		B(mod | (r & 7) << 3 | RSP);
+		B((scale == 8 ? 0xc0 : scale == 4 ? 0x80 : scale == 2 ? 0x40 : 0) |
+			((index == NOIDX ? RSP : index) & 7) << 3 | (base & 7));
+	}
+	if (mod == 0x40)
+		B(disp);
+	else if (mod == 0x80)
+		d32(disp);
+}
+
+/* an instruction on a register and memory; pfx is 0x66 or 0, w REX.W */
+static void
+mem(int pfx, int w, int op, int r, int base, int index, int scale, int disp)
+{
+	int     rex = (w ? 8 : 0) | (r & 8) >> 1 | (base & 8) >> 3 |
+		(index == NOIDX ? 0 : (index & 8) >> 2);
+
+	if (pfx)
+		B(pfx);
+	if (rex)
+		B(0x40 | rex);
+	if (op > 0xff)
+		B(op >> 8);
+	B(op);
+	modrm(r, base, index, scale, disp);
+}
+
+/* same on two registers, m in the r/m field */
+static void
+rr(int pfx, int w, int op, int r, int m)
+{
+	int     rex = (w ? 8 : 0) | (r & 8) >> 1 | (m & 8) >> 3;
+
+	if (pfx)
+		B(pfx);
+	if (rex)
+		B(0x40 | rex);
+	if (op > 0xff)
+		B(op >> 8);
+	B(op);
+	B(0xc0 | (r & 7) << 3 | (m & 7));
+}
+
+static void
+movi(int r, unsigned v)
+{
+	if (r & 8)
+		B(0x41);
+	B(0xb8 | (r & 7));
+	d32(v);
+}
+
+static void
+movabs(int r, uint64_t v)
+{
+	B(0x48 | (r & 8) >> 3);
+	B(0xb8 | (r & 7));
+	memcpy(J->p, &v, 8);
+	J->p += 8;
+}
+
+static void
+alui(int g, int r, unsigned v)
+{
+	if ((int) v == (signed char) v) {
+		rr(0, 0, 0x83, g, r);
+		B(v);
+	} else {
+		rr(0, 0, 0x81, g, r);
+		d32(v);
+	}
+}
+
+static void
+shl(int r, int n)
+{
+	rr(0, 0, 0xc1, 4, r);
+	B(n);
+}
+
+static void
+shr(int r, int n)
+{
+	rr(0, 0, 0xc1, 5, r);
+	B(n);
+}
+
+/* a jump, or a conditional one, to be patched; returns the place */
+static uchar *
+jmp_fwd(int cc)
+{
+	if (cc == JUMP)
+		B(0xe9);
+	else {
+		B(0x0f);
+		B(0x80 | cc);
+	}
+	J->p += 4;
+	return J->p - 4;
+}
+
+static void
+patch(uchar *at, uchar *to)
+{
+	int     rel = to - (at + 4);
+
+	memcpy(at, &rel, 4);
+}
+
+static void
+jmp_to(int cc, uchar *to)
+{
+	patch(jmp_fwd(cc), to);
+}
+
+/* call the C function f, directly if the buffer is near enough */
+static void
+call_c(void *f)
+{
+	long    rel = (uchar *) f - (J->p + 5);
+
+	if (rel == (int) rel) {
+		B(0xe8);
+		d32(rel);
+	} else {
+		movabs(RAX, (uint64_t) (long) f);
+		B(0xff); B(0xd0);               /* call rax */
+	}
+}
+
+static void
+exit_to(int cc, int kind, int k)
+{
+	J->fix[J->nfix].at = jmp_fwd(cc);
+	J->fix[J->nfix].kind = kind;
+	J->fix[J->nfix++].k = k;
+}
+
+/*
+ * The code every block shares: the entry from jit_run(), the way
+ * back to it, and the way on to another block.
+ */
+static void
+common(void)
+{
+	uchar   *out[10], *p;
+	int     i, n = 0;
+
+	/* rdi the instruction count, rsi the code, rdx the machine */
+	B(0x53);                                /* push rbx */
+	B(0x41); B(0x54);                       /* push r12 */
+	B(0x41); B(0x55);                       /* push r13 */
+	B(0x41); B(0x56);                       /* push r14 */
+	B(0x41); B(0x57);                       /* push r15 */
+	rr(0, 1, O_ST, RDX, RBX);
+	rr(0, 1, O_ST, RDI, R14);
+	mem(0, 1, O_LD, R12, M(core));
+	mem(0, 1, O_LD, R13, M(shadow));
+	B(0xff); B(0xe6);                       /* jmp rsi */
+
+	/* eax the result */
+	J->leave = J->p;
+	mem(0, 1, O_LD, RCX, R14, NOIDX, 1, 0);
+	mem(0, 1, O_ST, RCX, M(icnt));
+	B(0x41); B(0x5f);                       /* pop r15 */
+	B(0x41); B(0x5e);                       /* pop r14 */
+	B(0x41); B(0x5d);                       /* pop r13 */
+	B(0x41); B(0x5c);                       /* pop r12 */
+	B(0x5b);                                /* pop rbx */
+	B(0xc3);                                /* ret */
+
+	/* eax the new pc, right 0: what run() checks entering a block */
+	J->chain = J->p;
+	rr(0, 0, O_TEST, RAX, RAX);
+	out[n++] = jmp_fwd(CC_E);
+	mem(0, 1, O_LD, RCX, M(ilimit));
+	rr(0, 1, O_TEST, RCX, RCX);
+	p = jmp_fwd(CC_E);
+	mem(0, 1, 0x39, RCX, R14, NOIDX, 1, 0);         /* cmp [r14], rcx */
+	out[n++] = jmp_fwd(CC_AE);
+	patch(p, J->p);
+	mem(0, 0, 0x80, G_CMPI, M(goahead));
+	B(0);
+	out[n++] = jmp_fwd(CC_NE);
+	mem(0, 0, 0x83, G_CMPI, M(breakflg));
+	B(0);
+	out[n++] = jmp_fwd(CC_NE);
+	/* a block may end on utc or wtc; the next one is not for it */
+	mem(0, 0, 0x80, G_CMPI, M(addrmod));
+	B(0);
+	out[n++] = jmp_fwd(CC_NE);
+	rr(0, 0, O_ST, RAX, RCX);
+	shr(RCX, PAGESHIFT);
+	mem(0, 1, O_LD, RDX, RBX, RCX, 8, T(pagegen));
+	mem(0, 1, 0x3b, RDX, RBX, RCX, 8, T(codegen));  /* cmp rdx, */
+	out[n++] = jmp_fwd(CC_NE);
+	rr(0, 0, O_IMUL, RCX, RAX);
+	d32(sizeof(shadow_t));
+	mem(0, 0, 0xf6, 0, R13, RCX, 1, offsetof(shadow_t, s_flags));
+	B(C_UNPACKED);
+	out[n++] = jmp_fwd(CC_E);
+	if (!no_insn_check) {
+		mem(0, 0, 0xf6, 0, R13, RCX, 1, offsetof(shadow_t, s_convol));
+		B(CV_NUMBER);
+		out[n++] = jmp_fwd(CC_NE);
+	}
+	mem(0, 0, O_MOVZW, RCX, R13, RCX, 1, offsetof(shadow_t, s_jit));
+	rr(0, 0, O_TEST, RCX, RCX);
+	out[n++] = jmp_fwd(CC_E);
+	movabs(RDX, (uint64_t) (long) J->entry);
+	mem(0, 0, 0xff, 4, RDX, RCX, 8, 0);     /* jmp [rdx + rcx * 8] */
+	for (i = 0; i < n; ++i)
+		patch(out[i], J->p);
+	rr(0, 0, 0x31, RAX, RAX);               /* xor eax, eax */
+	jmp_to(JUMP, J->leave);
+
+	/*
+	 * ecx kind << 8 | k, edx the block, eax the result:
+	 * jit_run() leaves the machine as run() would there
+	 */
+	J->out = J->p;
+	mem(0, 0, O_ST, RCX, M(jit_at));
+	mem(0x66, 0, O_ST, RDX, M(jit_from));
+	jmp_to(JUMP, J->leave);
+
+	/* ecx k, edx the block, pc set: past k and on to the next block */
+	J->done = J->p;
+	mem(0, 0, O_LEA, RAX, RCX, NOIDX, 1, 1);
+	mem(0, 1, O_ADD, RAX, R14, NOIDX, 1, 0);        /* add [r14], rax */
+	rr(0, 0, O_ST, RCX, RAX);
+	alui(G_ANDI, RAX, 1);
+	mem(0, 0, O_ST8, RAX, M(abright));
+	shr(RCX, 1);
+	rr(0, 0, O_ADD, RDX, RCX);
+	mem(0x66, 0, O_ST, RCX, M(abpc));
+	mem(0, 0, O_MOVZW, RAX, M(pc));
+	jmp_to(JUMP, J->chain);
+}
+
+/*
+ * A buffer below the program, where the code can call the helpers
+ * directly, if one is free there; else anywhere.
+ */
+static uchar *
+jit_map(void)
+{
+	long    near = ((long) jit_map & -(long) JIT_BYTES) - JIT_BYTES;
+	uchar   *p;
+	int     i;
+
+	for (i = 0; i < 64 && near > JIT_BYTES; ++i, near -= JIT_BYTES) {
+		p = mmap((void *) near, JIT_BYTES, PROT_READ | PROT_WRITE |
+			PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == (uchar *) near)
+			return p;
+		if (p != MAP_FAILED)
+			munmap(p, JIT_BYTES);
+	}
+	return mmap(0, JIT_BYTES, PROT_READ | PROT_WRITE | PROT_EXEC,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+static int
+jit_open(void)
+{
+	J = calloc(1, sizeof(*J));
+	if (J) {
+		J->buf = jit_map();
+		if (J->buf != MAP_FAILED) {
+			J->p = J->buf;
+			common();
+			J->first = J->used = (J->p - J->buf + JIT_ALIGN - 1) &
+				-JIT_ALIGN;
+			return 1;
+		}
+		free(J);
+		J = 0;
+	}
+	jit_broken = 1;                 /* run() does without */
+	return 0;
+}
+
+/* let the code of the machine go, with its memory; see core_unmap() */
+void
+jit_free(void)
+{
+	if (J) {
+		munmap(J->buf, JIT_BYTES);
+		free(J);
+		J = 0;
+	}
+	jit_broken = 0;
+}
+
+/*
+ * The instructions that call C.  Each gets what run() has at hand:
+ * the address field after any modification, the register and the
+ * opcode; returns the error, or JIT_STAY to leave it to run().
+ */
+
+/* what run() does at _break */
+static int
+tail(optab_t *op)
+{
+	int     i, err;
+
+	if ((i = op->o_flags & F_GRP))
+		augroup.gl_au = aumodes[i];
+	if (op->o_flags & F_AR) {
+		if ((err = norm()))
+			return err;
+		if (op->o_inline == I_YTA)
+			accex = enreg;
+		rnd_rq = 0;
+	}
+	return 0;
+}
+
+/* a store the debugger waits for */
+static int
+watched(unsigned addr)
+{
+	return addr && (shadow[addr].s_flags & C_BPW);
+}
+
+static void
+set_mode(void)
+{
+	dis_exc = (enreg.o & 040) != 0;
+	G_ADD = (enreg.o & 020) != 0;
+	G_MUL = (enreg.o & 010) != 0;
+	G_LOG = (enreg.o & 004) != 0;
+	dis_round = (enreg.o & 002) != 0;
+	dis_norm = (enreg.o & 001) != 0;
+}
+
+static int
+h_xta(unsigned addr, unsigned r, unsigned opcode)
+{
+	uinstr_t        ui = { r };
+	optab_t         op = optab[opcode];
+
+	CHK_STACK;
+	GET_OP;
+	acc = enreg;
+	return tail(&op);
+}
+
+static int
+h_atx(unsigned addr, unsigned r, unsigned opcode)
+{
+	ushort          a = ADDR(addr + reg[r]);
+
+	if (watched(a))
+		return JIT_STAY;
+	STORE(acc, a);
+	if (!addr && r == STACKREG)
+		reg[STACKREG] = ADDR(reg[STACKREG] + 1);
+	return 0;
+}
+
+static int
+h_stx(unsigned addr, unsigned r, unsigned opcode)
+{
+	optab_t         op = optab[opcode];
+	ushort          a = ADDR(addr + reg[r]);
+
+	if (watched(a))
+		return JIT_STAY;
+	STORE(acc, a);
+	STK_POP;
+	return tail(&op);
+}
+
+static int
+h_its(unsigned addr, unsigned r, unsigned opcode)
+{
+	optab_t         op = optab[opcode];
+
+	if (watched(reg[STACKREG]))
+		return JIT_STAY;
+	STK_PUSH;
+	acc.l = 0;
+	acc.r = reg[(addr + reg[r]) & 0xf];
+	return tail(&op);
+}
+
+static int
+h_sti(unsigned addr, unsigned r, unsigned opcode)
+{
+	optab_t         op = optab[opcode];
+	uchar           rg = (addr + reg[r]) & 0xf;
+
+	reg[rg] = ADDR(acc.r);
+	reg[0] = 0;
+	if (rg != STACKREG)
+		reg[STACKREG] = ADDR(reg[STACKREG] - 1);
+	LOAD(acc, reg[STACKREG]);
+	return tail(&op);
+}
+
+static int
+h_wtc(unsigned addr, unsigned r, unsigned opcode)
+{
+	uinstr_t        ui = { r };
+	optab_t         op = optab[opcode];
+
+	CHK_STACK;
+	GET_OP;
+	reg[MODREG] = ADDR(enreg.r);
+	addrmod = 1;
+	return 0;
+}
+
+static int
+h_xtr(unsigned addr, unsigned r, unsigned opcode)
+{
+	uinstr_t        ui = { r };
+	optab_t         op = optab[opcode];
+
+	CHK_STACK;
+	GET_OP;
+	set_mode();
+	return 0;
+}
+
+static int
+h_ntr(unsigned addr, unsigned r, unsigned opcode)
+{
+	uinstr_t        ui = { r };
+	optab_t         op = optab[opcode];
+
+	GET_NAI_OP;
+	set_mode();
+	return 0;
+}
+
+static int
+h_rte(unsigned addr, unsigned r, unsigned opcode)
+{
+	uinstr_t        ui = { r };
+	optab_t         op = optab[opcode];
+
+	GET_NAI_OP;
+	acc.o = 0;
+	if (dis_exc)
+		acc.o = 040;
+	if (G_LOG)
+		acc.o |= 004;
+	if (G_MUL)
+		acc.o |= 010;
+	if (G_ADD)
+		acc.o |= 020;
+	if (dis_round)
+		acc.o |= 002;
+	if (dis_norm)
+		acc.o |= 001;
+	acc.l = (long) (acc.o & enreg.o) << 17;
+	acc.r = 0;
+	return tail(&op);
+}
+
+static int
+h_yta(unsigned addr, unsigned r, unsigned opcode)
+{
+	optab_t         op = optab[opcode];
+
+	if (G_LOG) {
+		acc = accex;
+		return tail(&op);
+	}
+	UNPCK(accex);
+	UNPCK(acc);
+	acc.mr = accex.mr;
+	acc.ml = accex.ml & 0xffff;
+	acc.o += ((addr + reg[r]) & 0x7f) - 64;
+	op.o_flags |= F_AR;
+	enreg = accex;
+	accex = zeroword;
+	PACK(enreg);
+	return tail(&op);
+}
+
+static int
+h_add(unsigned addr, unsigned r, unsigned opcode)
+{
+	uinstr_t        ui = { r };
+	optab_t         op = optab[opcode];
+	int             err;
+
+	CHK_STACK;
+	GET_OP;
+	if ((err = add()))
+		return err;
+	return tail(&op);
+}
+
+static int
+h_sub(unsigned addr, unsigned r, unsigned opcode)
+{
+	uinstr_t        ui = { r };
+	optab_t         op = optab[opcode];
+	int             err;
+
+	CHK_STACK;
+	GET_OP;
+	NEGATE(enreg);
+	if ((err = add()))
+		return err;
+	return tail(&op);
+}
+
+static int
+h_rsub(unsigned addr, unsigned r, unsigned opcode)
+{
+	uinstr_t        ui = { r };
+	optab_t         op = optab[opcode];
+	int             err;
+
+	CHK_STACK;
+	GET_OP;
+	NEGATE(acc);
+	if ((err = add()))
+		return err;
+	return tail(&op);
+}
+
+static int
+h_asub(unsigned addr, unsigned r, unsigned opcode)
+{
+	uinstr_t        ui = { r };
+	optab_t         op = optab[opcode];
+	int             err;
+
+	CHK_STACK;
+	GET_OP;
+	if (NEGATIVE(acc))
+		NEGATE(acc);
+	if (!NEGATIVE(enreg))
+		NEGATE(enreg);
+	if ((err = add()))
+		return err;
+	return tail(&op);
+}
+
+static int
+h_impl(unsigned addr, unsigned r, unsigned opcode)
+{
+	uinstr_t        ui = { r };
+	optab_t         op = optab[opcode];
+	int             err;
+
+	GET_IMPL_OP;
+	if ((err = (*op.o_impl)()))
+		return err;
+	return tail(&op);
+}
+
+/* uza and u1a: whether to jump */
+static int
+h_uza(unsigned addr, unsigned r, unsigned opcode)
+{
+	accex = acc;
+	if (G_ADD)
+		return !(acc.l & 0x10000);
+	if (G_MUL)
+		return (acc.l & 0x800000) != 0;
+	if (G_LOG)
+		return !(acc.l | acc.r);
+	return 0;
+}
+
+static int
+h_u1a(unsigned addr, unsigned r, unsigned opcode)
+{
+	accex = acc;
+	if (G_ADD)
+		return (acc.l & 0x10000) != 0;
+	if (G_MUL)
+		return !(acc.l & 0x800000);
+	if (G_LOG)
+		return (acc.l | acc.r) != 0;
+	return 1;
+}
+
+/* call a helper, the address already in edi */
+static void
+call(int (*f)(unsigned, unsigned, unsigned), uinstr_t ui)
+{
+	movi(RSI, ui.i_reg);
+	movi(RDX, ui.i_opcode);
+	call_c(f);
+	rr(0, 0, O_TEST, RAX, RAX);
+}
+
+/* the address field into edi, modified if the last one was utc or wtc */
+static void
+get_addr(uinstr_t ui, int dyn)
+{
+	if (!dyn) {
+		movi(RDI, ui.i_addr);
+		return;
+	}
+	mem(0, 0, O_MOVZW, RDI, M(reg[MODREG]));
+	alui(G_ADDI, RDI, ui.i_addr);
+	alui(G_ANDI, RDI, 077777);
+	mem(0, 0, 0xc6, 0, M(addrmod));
+	B(0);
+}
+
+/* reg[STACKREG] = ADDR(reg[STACKREG] + by) */
+static void
+stack(int by)
+{
+	mem(0, 0, O_MOVZW, RCX, M(reg[STACKREG]));
+	alui(G_ADDI, RCX, by);
+	alui(G_ANDI, RCX, 077777);
+	mem(0x66, 0, O_ST, RCX, M(reg[STACKREG]));
+}
+
+/* ADDR(addr + reg[r]) into eax */
+static void
+get_ea(uinstr_t ui)
+{
+	rr(0, 0, O_ST, RDI, RAX);
+	if (ui.i_reg) {
+		mem(0, 0, O_MOVZW, RCX, M(reg[ui.i_reg]));
+		rr(0, 0, O_ADD, RCX, RAX);
+		alui(G_ANDI, RAX, 077777);
+	}
+}
+
+/* (addr + reg[r]) & 0xf into ecx */
+static void
+get_regno(uinstr_t ui)
+{
+	rr(0, 0, O_ST, RDI, RCX);
+	if (ui.i_reg) {
+		mem(0, 0, O_MOVZW, RDX, M(reg[ui.i_reg]));
+		rr(0, 0, O_ADD, RDX, RCX);
+	}
+	alui(G_ANDI, RCX, 0xf);
+}
+
+static void
+set_group(optab_t *op)
+{
+	if (op->o_flags & F_GRP) {
+		mem(0, 0, 0xc7, 0, M(augroup.gl_au));
+		d32(aumodes[op->o_flags & F_GRP]);
+	}
+}
+
+/* the word at eax into enreg, and acc if to_acc: LOAD and acc = enreg */
+static void
+load_word(int to_acc)
+{
+	mem(0, 1, O_LEA, RCX, RAX, RAX, 2, 0);
+	mem(0, 0, O_LD, RDX, R12, RCX, 2, 0);
+	mem(0, 0, O_MOVZW, RCX, R12, RCX, 2, 4);
+	B(0x0f); B(0xca);                       /* bswap edx */
+	B(0x66); rr(0, 0, 0xc1, 0, RCX); B(8);  /* rol cx, 8 */
+	rr(0, 0, O_ST, RDX, RAX);
+	shr(RAX, 8);
+	alui(G_ANDI, RDX, 0xff);
+	shl(RDX, 16);
+	rr(0, 0, O_OR, RCX, RDX);
+	mem(0, 0, O_ST, RAX, M(enreg.l));
+	mem(0, 0, O_ST, RDX, M(enreg.r));
+	if (!to_acc)
+		return;
+	mem(0, 0, O_ST, RAX, M(acc.l));
+	mem(0, 0, O_ST, RDX, M(acc.r));
+	mem(0, 1, O_LD, RCX, RBX, NOIDX, 1, T(enreg) + 8);
+	mem(0, 1, O_ST, RCX, RBX, NOIDX, 1, T(acc) + 8);
+}
+
+/* acc to the word at eax, not 0, as STORE */
+static void
+store_acc(int k)
+{
+	uchar   *p, *q;
+
+	J->wrote = 1;
+	rr(0, 0, O_IMUL, RSI, RAX);
+	d32(sizeof(shadow_t));
+	mem(0, 0, 0xf6, 0, R13, RSI, 1, offsetof(shadow_t, s_flags));
+	B(C_BPW);
+	exit_to(CC_NE, X_BEFORE, k);
+	mem(0, 1, O_LEA, RCX, RAX, RAX, 2, 0);
+	mem(0, 0, O_LD, RDX, M(acc.l));
+	alui(G_ANDI, RDX, 0xffffff);
+	shl(RDX, 8);
+	mem(0, 0, O_MOVZB, R8, RBX, NOIDX, 1, T(acc.r) + 2);
+	rr(0, 0, O_OR, R8, RDX);
+	B(0x0f); B(0xca);                       /* bswap edx */
+	mem(0, 0, O_ST, RDX, R12, RCX, 2, 0);
+	mem(0, 0, O_MOVZW, RDX, M(acc.r));
+	B(0x66); rr(0, 0, 0xc1, 0, RDX); B(8);  /* rol dx, 8 */
+	mem(0x66, 0, O_ST, RDX, R12, RCX, 2, 4);
+
+	/* PAGE_WRITTEN */
+	rr(0, 0, O_ST, RAX, RCX);
+	shr(RCX, PAGESHIFT);
+	mem(0, 0, 0x80, G_CMPI, RBX, RCX, 1, T(pagedrops));
+	B(PAGE_PRECISE);
+	p = jmp_fwd(CC_AE);
+	mem(0, 1, 0x83, G_ADDI, RBX, RCX, 8, T(pagegen));
+	B(1);
+	q = jmp_fwd(JUMP);
+	patch(p, J->p);
+	mem(0, 0, 0x80, G_ANDI, R13, RSI, 1, offsetof(shadow_t, s_flags));
+	B(~C_UNPACKED & 0xff);
+	patch(q, J->p);
+
+	/* the convolution is a number unless spec */
+	mem(0, 0, 0x83, G_CMPI, M(spec));
+	B(0);
+	rr(0, 0, O_SETE, 0, RCX);
+	rr(0, 0, O_MOVZB, RCX, RCX);
+	mem(0, 0, O_MOVZB, RDX, R13, RSI, 1, offsetof(shadow_t, s_convol));
+	alui(G_ANDI, RDX, ~CV_NUMBER);
+	rr(0, 0, O_OR, RCX, RDX);
+	mem(0, 0, O_ST8, RDX, R13, RSI, 1, offsetof(shadow_t, s_convol));
+}
+
+/*
+ * aax, aox and aex on acc and enreg, the operand in eax and edx;
+ * returns 0 for the other routines
+ */
+static int
+logic(int (*f)())
+{
+	int     o = f == aax ? O_AND : f == aox ? O_OR : f == aex ? 0x31 : 0;
+
+	if (!o)
+		return 0;
+	mem(0, 1, O_LD, RCX, M(acc.l));
+	mem(0, 1, O_LD, RSI, RBX, NOIDX, 1, T(acc) + 8);
+	if (f == aex) {
+		mem(0, 1, O_ST, RCX, M(accex.l));
+		mem(0, 1, O_ST, RSI, RBX, NOIDX, 1, T(accex) + 8);
+	} else {
+		rr(0, 0, 0x31, RSI, RSI);
+		mem(0, 1, O_ST, RSI, M(accex.l));
+		mem(0, 1, O_ST, RSI, RBX, NOIDX, 1, T(accex) + 8);
+	}
+	rr(0, 0, o, RAX, RCX);
+	mem(0, 0, O_ST, RCX, M(acc.l));
+	mem(0, 0, o, RDX, M(acc.r));
+	return 1;
+}
+
+/* JMP to the pc in register r, or to the address to */
+static void
+jump(int k, int r, unsigned to)
+{
+	unsigned        from = (J->start + k / 2) << 16;
+
+	mem(0, 0, O_LD, RCX, M(jhbi));
+	if (r < 0) {
+		mem(0, 0, 0xc7, 0, RBX, RCX, 4, T(jhbuf));
+		d32(from | to);
+		mem(0x66, 0, 0xc7, 0, M(pc));
+		d16(to);
+	} else {
+		movi(RDX, from);
+		rr(0, 0, O_OR, r, RDX);
+		mem(0, 0, O_ST, RDX, RBX, RCX, 4, T(jhbuf));
+		mem(0x66, 0, O_ST, r, M(pc));
+	}
+	alui(G_ADDI, RCX, 1);
+	alui(G_ANDI, RCX, JHBSZ - 1);
+	mem(0, 0, O_ST, RCX, M(jhbi));
+	exit_to(JUMP, X_DONE, k);
+}
+
+/* on past instruction k, without a jump */
+static void
+go_on(int k)
+{
+	if (k & 1) {
+		mem(0x66, 0, 0xc7, 0, M(pc));
+		d16(ADDR(J->start + k / 2 + 1));
+		exit_to(JUMP, X_DONE, k);
+	} else {
+		rr(0, 0, 0x31, RAX, RAX);
+		exit_to(JUMP, X_AFTER, k);
+	}
+}
+
+/*
+ * What run() checks at each word of a block.  The page the block
+ * starts on has been checked on entering it, and only a store can
+ * have made it stale since.
+ */
+static void
+check_word(int k)
+{
+	unsigned        w = J->start + k / 2;
+
+	mem(0, 0, 0x80, G_CMPI, M(goahead));
+	B(0);
+	exit_to(CC_NE, X_BEFORE, k);
+	mem(0, 0, 0x83, G_CMPI, M(breakflg));
+	B(0);
+	exit_to(CC_NE, X_BEFORE, k);
+	if (J->wrote || PAGE(w) != PAGE(J->start)) {
+		mem(0, 1, O_LD, RAX, M(pagegen[PAGE(w)]));
+		mem(0, 1, 0x3b, RAX, M(codegen[PAGE(w)]));      /* cmp rax, */
+		exit_to(CC_NE, X_BEFORE, k);
+	}
+	mem(0, 0, 0xf6, 0, R13, NOIDX, 1,
+		w * sizeof(shadow_t) + offsetof(shadow_t, s_flags));
+	B(C_UNPACKED);
+	exit_to(CC_E, X_BEFORE, k);
+}
+
+/*
+ * Translate instruction k of the block; dyn if its address is to be
+ * modified.  Returns 0 to leave it to run(), 1 to go on to the next
+ * one, 2 if the code has left the block.
+ */
+static int
+insn(int k, uinstr_t ui, int dyn)
+{
+	optab_t         op = optab[ui.i_opcode];
+	int             (*f)(unsigned, unsigned, unsigned) = 0;
+	uchar           *p;
+
+	switch (op.o_inline) {
+	case I_XTA:
+		if (dyn && ui.i_reg == STACKREG) {
+			f = h_xta;
+			break;
+		}
+		get_addr(ui, dyn);
+		if (!dyn && !ui.i_addr && ui.i_reg == STACKREG)
+			stack(-1);
+		get_ea(ui);
+		load_word(1);
+		set_group(&op);
+		return 1;
+	case I_ATX:
+		if (dyn && ui.i_reg == STACKREG) {
+			f = h_atx;
+			break;
+		}
+		get_addr(ui, dyn);
+		get_ea(ui);
+		if (dyn || ui.i_reg) {
+			rr(0, 0, O_TEST, RAX, RAX);
+			p = jmp_fwd(CC_E);
+			store_acc(k);
+			patch(p, J->p);
+		} else if (ui.i_addr)
+			store_acc(k);
+		if (!dyn && !ui.i_addr && ui.i_reg == STACKREG)
+			stack(1);
+		return 1;
+	case I_XTS:
+		/* STK_PUSH, then as xta */
+		get_addr(ui, dyn);
+		mem(0, 0, O_MOVZW, RAX, M(reg[STACKREG]));
+		rr(0, 0, O_TEST, RAX, RAX);
+		p = jmp_fwd(CC_E);
+		store_acc(k);
+		patch(p, J->p);
+		stack(1);
+		get_ea(ui);
+		load_word(1);
+		set_group(&op);
+		return 1;
+	case I_UTC:
+		get_addr(ui, dyn);
+		get_ea(ui);
+		mem(0x66, 0, O_ST, RAX, M(reg[MODREG]));
+		mem(0, 0, 0xc6, 0, M(addrmod));
+		B(1);
+		return 1;
+	case I_VTM:
+		get_addr(ui, dyn);
+		if (ui.i_reg)
+			mem(0x66, 0, O_ST, RDI, M(reg[ui.i_reg]));
+		return 1;
+	case I_UTM:
+		get_addr(ui, dyn);
+		get_ea(ui);
+		if (ui.i_reg)
+			mem(0x66, 0, O_ST, RAX, M(reg[ui.i_reg]));
+		return 1;
+	case I_MTJ:
+		get_addr(ui, dyn);
+		rr(0, 0, O_ST, RDI, RCX);
+		alui(G_ANDI, RCX, 0xf);
+		mem(0, 0, O_MOVZW, RDX, M(reg[ui.i_reg]));
+		mem(0x66, 0, O_ST, RDX, RBX, RCX, 2, T(reg[0]));
+		mem(0x66, 0, 0xc7, 0, M(reg[0]));
+		d16(0);
+		return 1;
+	case I_MPJ:
+		get_addr(ui, dyn);
+		rr(0, 0, O_ST, RDI, RCX);
+		alui(G_ANDI, RCX, 0xf);
+		mem(0, 0, O_MOVZW, RDX, RBX, RCX, 2, T(reg[0]));
+		mem(0, 0, O_MOVZW, RAX, M(reg[ui.i_reg]));
+		rr(0, 0, O_ADD, RAX, RDX);
+		alui(G_ANDI, RDX, 077777);
+		mem(0x66, 0, O_ST, RDX, RBX, RCX, 2, T(reg[0]));
+		mem(0x66, 0, 0xc7, 0, M(reg[0]));
+		d16(0);
+		return 1;
+	case I_ATI:
+		get_addr(ui, dyn);
+		get_regno(ui);
+		mem(0, 0, O_LD, RDX, M(acc.r));
+		alui(G_ANDI, RDX, 077777);
+		mem(0x66, 0, O_ST, RDX, RBX, RCX, 2, T(reg[0]));
+		mem(0x66, 0, 0xc7, 0, M(reg[0]));
+		d16(0);
+		return 1;
+	case I_ITA:
+		get_addr(ui, dyn);
+		get_regno(ui);
+		mem(0, 0, O_MOVZW, RDX, RBX, RCX, 2, T(reg[0]));
+		mem(0, 0, 0xc7, 0, M(acc.l));
+		d32(0);
+		mem(0, 0, O_ST, RDX, M(acc.r));
+		set_group(&op);
+		return 1;
+	case I_UJ:
+		get_addr(ui, dyn);
+		if (!dyn && !ui.i_reg)
+			jump(k, -1, ui.i_addr);
+		else {
+			get_ea(ui);
+			jump(k, RAX, 0);
+		}
+		return 2;
+	case I_VJM:
+		get_addr(ui, dyn);
+		if (ui.i_reg) {
+			mem(0x66, 0, 0xc7, 0, M(reg[ui.i_reg]));
+			d16(ADDR(J->start + k / 2 + 1));
+		}
+		jump(k, dyn ? RDI : -1, ui.i_addr);
+		return 2;
+	case I_VLM:
+	case I_VZM:
+		get_addr(ui, dyn);
+		mem(0, 0, O_MOVZW, RAX, M(reg[ui.i_reg]));
+		rr(0, 0, O_TEST, RAX, RAX);
+		p = jmp_fwd(op.o_inline == I_VZM && ui.i_opcode != 0115 ?
+			CC_NE : CC_E);
+		if (op.o_inline == I_VLM) {
+			alui(G_ADDI, RAX, 1);
+			alui(G_ANDI, RAX, 077777);
+			mem(0x66, 0, O_ST, RAX, M(reg[ui.i_reg]));
+		}
+		jump(k, dyn ? RDI : -1, ui.i_addr);
+		patch(p, J->p);
+		go_on(k);
+		return 2;
+	case I_UZA:
+	case I_UIA:
+		get_addr(ui, dyn);
+		get_ea(ui);
+		rr(0, 0, O_ST, RAX, R15);
+		call(op.o_inline == I_UZA ? h_uza : h_u1a, ui);
+		p = jmp_fwd(CC_E);
+		jump(k, R15, 0);
+		patch(p, J->p);
+		go_on(k);
+		return 2;
+	case I_STX:     f = h_stx;      break;
+	case I_ITS:     f = h_its;      break;
+	case I_STI:     f = h_sti;      break;
+	case I_WTC:     f = h_wtc;      break;
+	case I_XTR:     f = h_xtr;      break;
+	case I_NTR:     f = h_ntr;      break;
+	case I_RTE:     f = h_rte;      break;
+	case I_YTA:     f = h_yta;      break;
+	case I_ADD:     f = h_add;      break;
+	case I_SUB:     f = h_sub;      break;
+	case I_RSUB:    f = h_rsub;     break;
+	case I_ASUB:    f = h_asub;     break;
+	case 0:
+		if (op.o_flags & F_PRIV)
+			break;
+		f = h_impl;
+		if ((op.o_flags & (F_OP | F_AR | F_AROP)) != F_OP ||
+		    (dyn && ui.i_reg == STACKREG))
+			break;
+		/* GET_IMPL_OP, then the routine itself */
+		get_addr(ui, dyn);
+		if (!dyn && !ui.i_addr && ui.i_reg == STACKREG &&
+		    (op.o_flags & F_STACK))
+			stack(-1);
+		get_ea(ui);
+		load_word(0);
+		if (!logic(op.o_impl)) {
+			call_c(op.o_impl);
+			rr(0, 0, O_TEST, RAX, RAX);
+			exit_to(CC_NE, X_FAIL, k);
+		}
+		set_group(&op);
+		return 1;
+	}
+	if (!f)
+		return 0;       /* extracodes, stop, privileged */
+	get_addr(ui, dyn);
+	call(f, ui);
+	if (f == h_atx || f == h_stx || f == h_its)
+		J->wrote = 1;
+	exit_to(CC_NE, X_FAIL, k);
+	return 1;
+}
+
+static void
+stub(int kind, int k)
+{
+	J->stub[kind][k] = J->p;
+	movi(RCX, kind == X_DONE ? k : kind << 8 | k |
+		(J->dyn >> k & 1 ? X_MOD : 0));
+	movi(RDX, J->start);
+	jmp_to(JUMP, kind == X_DONE ? J->done : J->out);
+}
+
+/*
+ * Translate the block at pcm, which run() has just checked and
+ * unpacked; returns 0 if its first instruction is left to run().
+ */
+static int
+jit_build(reg_t pcm)
+{
+	int             n = shadow[pcm].s_blen, k, i, dyn = 0, go = 1;
+	uchar           *code;
+
+	if (!J && (jit_broken || !jit_open()))
+		return 0;
+	if (JIT_BYTES - J->used < JIT_ROOM || J->nblocks == JIT_BLOCKS - 1) {
+		/* full: drop all of it, and have the blocks prove hot again */
+		for (i = 0; i < CORESZ; ++i)
+			if (shadow[i].s_jit) {
+				shadow[i].s_jit = 0;
+				shadow[i].s_heat = 0;
+			}
+		J->used = J->first;
+		J->nblocks = 0;
+	}
+	code = J->p = J->buf + J->used;
+	J->start = pcm;
+	J->nfix = 0;
+	J->dyn = 0;
+	J->wrote = 0;
+	memset(J->stub, 0, sizeof(J->stub));
+
+	for (k = 0; k < n && go == 1; ++k) {
+		uinstr_t        ui = shadow[pcm + k / 2].s_insn[k & 1];
+
+		if (k && !(k & 1))
+			check_word(k);
+		if (dyn)
+			J->dyn |= (uint64_t) 1 << k;
+		go = insn(k, ui, dyn);
+		if (!go && !k)
+			return 0;
+		if (!go)
+			exit_to(JUMP, X_BEFORE, k);
+		dyn = optab[ui.i_opcode].o_inline == I_UTC ||
+			optab[ui.i_opcode].o_inline == I_WTC;
+	}
+	if (go == 1)
+		go_on(n - 1);
+	for (i = 0; i < J->nfix; ++i)
+		if (!J->stub[J->fix[i].kind][J->fix[i].k])
+			stub(J->fix[i].kind, J->fix[i].k);
+	for (i = 0; i < J->nfix; ++i)
+		patch(J->fix[i].at, J->stub[J->fix[i].kind][J->fix[i].k]);
+
+	J->used = (J->p - J->buf + JIT_ALIGN - 1) & -JIT_ALIGN;
+	J->entry[++J->nblocks] = code;
+	shadow[pcm].s_jit = J->nblocks;
+	return 1;
+}
+
+/*
+ * Run the block at *pcm translated, translating it first if it is
+ * hot enough by now.  Returns JIT_NONE if it is not translated; else
+ * 0 when the code has left the block and those it went on to, an
+ * error, or JIT_STAY with *pcm set to the block it stopped in.
+ */
+int
+jit_run(reg_t *pcm, ulong *icountp)
+{
+	shadow_t        *sp = &shadow[*pcm];
+	int             r, kind, k;
+	reg_t           w;
+
+	if (!sp->s_jit) {
+		if (++sp->s_heat < JIT_HOT)
+			return JIT_NONE;
+		if (!jit_build(*pcm)) {
+			sp->s_heat = 0;
+			return JIT_NONE;
+		}
+	}
+	jit_at = X_NONE;
+	r = ((int (*)(ulong *, uchar *, reg_t *)) J->buf)(icountp,
+		J->entry[sp->s_jit], reg);
+	if (jit_at == X_NONE) {
+		/* on from a block, into one run() is to check */
+		right = 0;
+		return r;
+	}
+	kind = jit_at >> 8;
+	k = jit_at & 0x7f;
+	w = jit_from + k / 2;
+	if (kind == X_FAIL)
+		kind = r == JIT_STAY ? X_BEFORE : X_AFTER;
+	if (kind == X_BEFORE) {
+		/* in front of k: run() is to run it, modified or not */
+		if (jit_at & X_MOD)
+			addrmod = 1;
+		if (k) {
+			pc = w;
+			right = k & 1;
+			abpc = right ? w : w - 1;
+			abright = !right;
+			*icountp += k;
+		}
+		*pcm = jit_from;
+		r = JIT_STAY;
+	} else {
+		/* past k, r its result */
+		pc = k & 1 ? ADDR(w + 1) : w;
+		right = !(k & 1);
+		abpc = w;
+		abright = k & 1;
+		*icountp += k + 1;
+	}
+	icnt = *icountp;
+	return r;
+}
+
+#endif  /* JIT */
@@ -0,0 +1,434 @@
+/*
+ * BESM-6 emulator as a library.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this program and/or modify it under the terms of
+ * the GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "COPYING" for more details.
+ */
+#define _GNU_SOURCE             /* fopencookie() */
+#include <stdio.h>
+#include <stdlib.h>
+#include "defs.h"
+#include "disk.h"
+#include "encoding.h"
+#include "gost10859.h"
+#include "libdispak.h"
+#ifdef HAVE_LIBPTHREAD
+#include <pthread.h>
+#endif
+
+static struct   {
+	int     dsk;
+	ushort  zone;
+	ushort  sz;
+	reg_t   caddr;
+}       sv_disk[] = {
+	{2099,   0100,   3,      0,		},	/* disp99       */
+	{2099,   0103,   3,      010000,	},	/* e64, ekdisp, spe66  */
+	{0,      0,      0,      0,		},
+};
+
+static __thread struct timeval stopped;
+
+void
+stopwatch(void)
+{
+	gettimeofday(&stopped, NULL);
+}
+
+void
+startwatch(void)
+{
+	struct timeval  curr;
+
+	gettimeofday(&curr, NULL);
+	excuse += TIMEDIFF(stopped, curr);
+}
+
+int
+sv_load(void)
+{
+	void            *dh;
+	ushort          z;
+	reg_t           cp;
+	int             i;
+
+	for (i = 0; sv_disk[i].sz; ++i) {
+		dh = disk_open(sv_disk[i].dsk, DISK_READ_ONLY);
+		if (!dh)
+			return 0;
+
+		for (z = sv_disk[i].zone, cp = sv_disk[i].caddr + 0100000;
+				z < sv_disk[i].zone + sv_disk[i].sz;
+				++z, cp += 1024)
+			if (disk_read(dh, z, (char *) (core + cp)) != DISK_IO_OK)
+				return 0;
+		disk_close(dh);
+	}
+	return 1;
+}
+
+/* builds the blocks of the supervisor loaded by sv_load() in advance */
+void
+sv_decode(void)
+{
+	int             i;
+
+	for (i = 0; sv_disk[i].sz; ++i)
+		core_decode(sv_disk[i].caddr + 0100000, sv_disk[i].sz * 1024);
+}
+
+/*
+ * The first machine to need the supervisor loads and decodes it and
+ * leaves an image of it behind; the machines after it map the image,
+ * and share its pages until they write into them.
+ */
+#ifdef HAVE_LIBPTHREAD
+static pthread_mutex_t sv_lock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+static int      sv_image = -1;
+
+static int
+sv_share(void)
+{
+	int             ok;
+
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_lock(&sv_lock);
+#endif
+	if (sv_image >= 0)
+		ok = core_map(sv_image) == 0;
+	else if ((ok = sv_load())) {
+		sv_decode();
+		sv_image = core_image();
+	}
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&sv_lock);
+#endif
+	return ok;
+}
+
+/*
+ * Runs the task that is in core, with the supervisor loaded: the drum
+ * takes its place in the volume table, and disk 2053 is opened unless
+ * it already is.  Returns the error code the machine stopped with, or
+ * -1 if a volume cannot be opened.
+ */
+int
+run_loaded(void)
+{
+	int             i;
+	void            *nh;
+	sigset_t        set;
+
+	if (notty) {
+		/* Batch task. */
+		pout_enable = ! pout_disable;
+	} else {
+		/* TELE task. */
+		pout_disable = ! pout_enable;
+	}
+
+	for (i = 00; i < 030; ++i) {
+		disks[i].diskh = drumh;
+		disks[i].offset = i * 040;
+	}
+	for (i = 070; i < 0100; ++i) {
+		disks[i].diskh = drumh;
+		disks[i].offset = i * 040;
+	}
+	nh = disk_open(0, DISK_READ_WRITE);
+	if (! nh)
+		return -1;
+	disks[OSD_NOMML3].diskh = nh;
+
+	if (! disks[OSD_NOMML1].diskh &&
+	    ! (disks[OSD_NOMML1].diskh = disk_open(2053, DISK_READ_ONLY)))
+		return -1;
+
+	/* the alarm of the machine goes to this thread, which may not block it */
+	(void) signal(SIGALRM, alrm_handler);
+	sigemptyset(&set);
+	sigaddset(&set, SIGALRM);
+	pthread_sigmask(SIG_UNBLOCK, &set, NULL);
+	gettimeofday(&start_time, NULL);
+	icnt = run();
+	gettimeofday(&stop_time, NULL);
+	return stoperr;
+}
+
+/*
+ * The embedding interface.  The machine state is thread-local, so
+ * dispak_run() starts a thread for the task, which begins with a
+ * clean machine and leaves nothing behind for the next one.  The
+ * printing and the punched cards go through streams of their own,
+ * which hand what is written to the callbacks, or keep it.
+ */
+typedef struct {
+	dispak_out_t    *o_fn;
+	void            *o_arg;
+	char            *o_data;        /* kept, without a callback     */
+	size_t          o_len, o_size;
+} outbuf_t;
+
+struct dispak {
+	char            *m_task;        /* passport, zero-padded        */
+	size_t          m_tasklen;
+	outbuf_t        m_print, m_punch;
+	ulong           m_budget;       /* instructions, 0 - no limit   */
+	ulong           m_count;
+	int             m_status;
+};
+
+static __thread uchar *task_ptr, *task_end;
+
+void
+dispak_path(const char *path)
+{
+	disk_set_path(path);
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_lock(&sv_lock);
+#endif
+	/* the supervisor is to be read from there */
+	if (sv_image >= 0)
+		close(sv_image);
+	sv_image = -1;
+#ifdef HAVE_LIBPTHREAD
+	pthread_mutex_unlock(&sv_lock);
+#endif
+}
+
+void
+dispak_native(int on)
+{
+	xnative = on;
+}
+
+/* as --bootstrap: the supervisor is not loaded, native E64 is off */
+void
+dispak_bootstrap(int on)
+{
+	bootstrap = on;
+	if (on)
+		xnative = 0;
+}
+
+dispak_t *
+dispak_new(void)
+{
+	return calloc(1, sizeof(dispak_t));
+}
+
+void
+dispak_free(dispak_t *m)
+{
+	if (! m)
+		return;
+	free(m->m_task);
+	free(m->m_print.o_data);
+	free(m->m_punch.o_data);
+	free(m);
+}
+
+/* takes a copy of the task text, in UTF-8 */
+int
+dispak_submit(dispak_t *m, const char *task, size_t len)
+{
+	char    *t;
+
+	/* utf8_to_gost() may read two bytes past a cut character */
+	if (! (t = calloc(1, len + 3)))
+		return -1;
+	memcpy(t, task, len);
+	free(m->m_task);
+	m->m_task = t;
+	m->m_tasklen = len;
+	return 0;
+}
+
+void
+dispak_printer(dispak_t *m, dispak_out_t *fn, void *arg)
+{
+	m->m_print.o_fn = fn;
+	m->m_print.o_arg = arg;
+}
+
+void
+dispak_puncher(dispak_t *m, dispak_out_t *fn, void *arg)
+{
+	m->m_punch.o_fn = fn;
+	m->m_punch.o_arg = arg;
+}
+
+unsigned long
+dispak_count(dispak_t *m)
+{
+	return m->m_count;
+}
+
+const char *
+dispak_printing(dispak_t *m, size_t *len)
+{
+	*len = m->m_print.o_len;
+	return m->m_print.o_data;
+}
+
+const char *
+dispak_punching(dispak_t *m, size_t *len)
+{
+	*len = m->m_punch.o_len;
+	return m->m_punch.o_data;
+}
+
+/* the text of a dispak_run() status, in UTF-8 */
+const char *
+dispak_message(int status)
+{
+	if (status < 0 || status > E_MAX)
+		status = 0;
+	return _(errtxt[status]);
+}
+
+static ssize_t
+out_write(void *cookie, const char *buf, size_t len)
+{
+	outbuf_t        *o = cookie;
+	char            *p;
+	size_t          size;
+
+	if (o->o_fn) {
+		o->o_fn(o->o_arg, buf, len);
+		return len;
+	}
+	if (o->o_len + len > o->o_size) {
+		size = o->o_size ? o->o_size : 4096;
+		while (size < o->o_len + len)
+			size *= 2;
+		if (! (p = realloc(o->o_data, size)))
+			return 0;
+		o->o_data = p;
+		o->o_size = size;
+	}
+	memcpy(o->o_data + o->o_len, buf, len);
+	o->o_len += len;
+	return len;
+}
+
+#ifdef __GLIBC__
+static FILE *
+out_open(outbuf_t *o)
+{
+	cookie_io_functions_t io = { 0, out_write, 0, 0 };
+
+	return fopencookie(o, "w", io);
+}
+#else
+static int
+out_writeb(void *cookie, const char *buf, int len)
+{
+	return out_write(cookie, buf, len);
+}
+
+static FILE *
+out_open(outbuf_t *o)
+{
+	return funopen(o, 0, out_writeb, 0, 0);
+}
+#endif
+
+/* reads the task from memory, as cget() in dispak.c from the file */
+static unsigned
+task_getc(void)
+{
+	if (task_ptr >= task_end)
+		return GOST_EOF;
+	if (*task_ptr == '\\') {
+		if (++task_ptr >= task_end)
+			return GOST_EOF;
+		return escape_to_gost(*task_ptr++);
+	}
+	return utf8_to_gost(&task_ptr);
+}
+
+static void
+task_diag(char *s)
+{
+	utf8_puts(s, lpout);
+}
+
+static void *
+machine(void *arg)
+{
+	dispak_t        *m = arg;
+	size_t          len;
+
+	m->m_status = DISPAK_FAILED;
+	lpout = out_open(&m->m_print);
+	punchout = out_open(&m->m_punch);
+	if (! lpout || ! punchout || core_map(-1) < 0)
+		goto done;
+	task_ptr = (uchar *) m->m_task;
+	task_end = task_ptr + m->m_tasklen;
+	ilimit = m->m_budget;
+	if (vsinput(task_getc, task_diag, 1, 1) < 0)
+		goto done;
+	if (!bootstrap && !sv_share()) {
+		utf8_puts(_("Error loading supervisor.\n"), lpout);
+		goto done;
+	}
+	if (! (drumh = disk_open(0, DISK_READ_WRITE)))
+		goto done;
+	if (input(0) < 0) {
+		utf8_puts(_(" ОШ ВВД "), lpout);
+		putc('\n', lpout);
+		goto done;
+	}
+	m->m_status = run_loaded();
+	m->m_count = icnt;
+done:
+	terminate();
+	ib_cleanup();
+	free(vsinput_take(&len));
+	disk_release();
+	core_unmap();
+	if (lpout)
+		fclose(lpout);
+	if (punchout)
+		fclose(punchout);
+	lpout = punchout = 0;
+	return 0;
+}
+
+/*
+ * Runs the task submitted, for budget instructions at most (0 for
+ * no limit); returns the error code the machine stopped with.
+ */
+int
+dispak_run(dispak_t *m, unsigned long budget)
+{
+#ifdef HAVE_LIBPTHREAD
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+	pthread_t       t;
+#endif
+
+	if (! m->m_task)
+		return DISPAK_FAILED;
+	m->m_budget = budget;
+	m->m_count = 0;
+	m->m_print.o_len = m->m_punch.o_len = 0;
+#ifdef HAVE_LIBPTHREAD
+	pthread_once(&once, init_local_encoding);
+	if (pthread_create(&t, 0, machine, m) != 0)
+		return DISPAK_FAILED;
+	pthread_join(t, 0);
+#else
+	/* no threads: the process has a single machine, run once */
+	machine(m);
+#endif
+	return m->m_status;
+}
@@ -0,0 +1,49 @@
+/*
+ * BESM-6 emulator as a library.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this program and/or modify it under the terms of
+ * the GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "COPYING" for more details.
+ */
+#ifndef libdispak_h_included
+#define libdispak_h_included
+
+#include <stddef.h>
+
+/*
+ * A machine runs one task, given as the text of its passport, the
+ * same as a task file for dispak.  The printing and the punched cards
+ * go to the callbacks set, or are kept by the machine until it is
+ * freed.  Each run takes a thread of its own, so that any number of
+ * machines may run side by side; the settings below are shared by
+ * all of them and are made before the first run.
+ */
+typedef struct dispak dispak_t;
+typedef void dispak_out_t(void *arg, const char *data, size_t len);
+
+extern  void        dispak_path(const char *path);          /* disk images, 0 - default */
+extern  void        dispak_native(int on);                  /* native E64 */
+extern  void        dispak_bootstrap(int on);               /* no disk 2099 */
+
+extern  dispak_t    *dispak_new(void);                      /* NULL if failure */
+extern  void        dispak_free(dispak_t *m);
+extern  int         dispak_submit(dispak_t *m, const char *task, size_t len);
+extern  void        dispak_printer(dispak_t *m, dispak_out_t *fn, void *arg);
+extern  void        dispak_puncher(dispak_t *m, dispak_out_t *fn, void *arg);
+extern  int         dispak_run(dispak_t *m, unsigned long budget);
+extern  unsigned long dispak_count(dispak_t *m);            /* instructions run */
+extern  const char  *dispak_printing(dispak_t *m, size_t *len);
+extern  const char  *dispak_punching(dispak_t *m, size_t *len);
+extern  const char  *dispak_message(int status);
+
+/* what dispak_run() returns, besides the other machine errors */
+#define DISPAK_FAILED   (-1)    /* task or volumes could not be read */
+#define DISPAK_END      1       /* normal termination */
+#define DISPAK_BUDGET   38      /* out of instructions */
+
+#endif
@@ -6,8 +6,8 @@ typedef struct  {
 	int     (*o_impl)();
 	char    o_inline;
 	ushort  o_flags;
-	uint    o_count;
-	uint    o_ticks;
+	ulong   o_count;
+	ulong   o_ticks;
 }       optab_t;
 
 extern optab_t  optab[];
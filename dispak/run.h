@@ -0,0 +1,835 @@
+/*
+ * BESM-6 processor control unit.
+ * Instruction loop template, included by cu.c once per variant.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You can redistribute this program and/or modify it under the terms of
+ * the GNU General Public License as published by the Free Software Foundation;
+ * either version 2 of the License, or (at your discretion) any later version.
+ * See the accompanying file "COPYING" for more details.
+ */
+
+/*
+ * RUN_NAME is the name of the function to define.  With RUN_DEBUG set
+ * the loop checks breakpoints, single stepping, instruction tracing and
+ * statistics on every instruction; without it only an interrupt from
+ * the terminal is noticed, and the block cache is used.  Either variant
+ * returns V_FAST or V_DEBUG when the other one has to take over, or the
+ * error code when the machine stops.
+ */
+#if RUN_DEBUG
+#define THIS_VARIANT    V_DEBUG
+#define TRACING         (trace >= 2)
+#define DEBUGGER        goto dbg
+#else
+#define THIS_VARIANT    V_FAST
+#define TRACING         0
+#define DEBUGGER        { --icount; VARIANT(V_DEBUG); }
+#endif
+#define VARIANT(v)      { *icountp = icount; return (v); }
+
+static int
+RUN_NAME(icountp)
+	ulong   *icountp;
+{
+	optab_t        op;
+	ushort         addr;
+	ushort                  cf;
+	uinstr_t                ui;
+	reg_t                   nextpc, pcm = 0;
+	ushort                  err = 0;
+	int                     i;
+	ulong                   icount = icountp ? *icountp : 0;
+	uchar                   mem;
+#if RUN_DEBUG
+	uchar                   last_op = 0, prev_op = 0;
+	reg_t                   last_pcm = 0;
+	int                     ecode = -1;
+	uint64_t		tsc = rdtsc(), dt;
+	int                     recheck = 0;
+#else
+	unsigned                bstart = 0, bi = 0, blen = 0;
+#endif
+
+#ifdef THREADED_CODE
+	static void *inline_lbl[] = {
+		&&L_default,    &&L_I_ATX,      &&L_I_STX,      &&L_I_XTS,
+		&&L_I_XTA,      &&L_I_RTE,      &&L_I_XTR,      &&L_I_ATI,
+		&&L_I_ITA,      &&L_I_MTJ,      &&L_I_MPJ,      &&L_I_TRAP,
+		&&L_I_UTC,      &&L_I_WTC,      &&L_I_VTM,      &&L_I_UZA,
+		&&L_I_UJ,       &&L_I_VJM,      &&L_I_STOP,     &&L_I_VZM,
+		&&L_I_VLM,      &&L_I_SUB,      &&L_I_RSUB,     &&L_I_ASUB,
+		&&L_I_UIA,      &&L_I_ADD,      &&L_I_ITS,      &&L_I_NTR,
+		&&L_I_UTM,      &&L_I_STI,      &&L_I_YTA,      &&L_I_IRET,
+		&&L_I_MOD,
+	};
+	static struct {
+		int     (*f)();
+		void    *lbl;
+	} impl_lbl[] = {
+		{ aax, &&L_aax },       { aex, &&L_aex },       { arx, &&L_arx },
+		{ avx, &&L_avx },       { aox, &&L_aox },       { b6div, &&L_b6div },
+		{ mul, &&L_mul },       { apx, &&L_apx },       { aux, &&L_aux },
+		{ acx, &&L_acx },       { anx, &&L_anx },       { epx, &&L_epx },
+		{ emx, &&L_emx },       { asx, &&L_asx },       { priv, &&L_priv },
+		{ 0, 0 },
+	};
+#if !RUN_DEBUG
+	static struct {
+		uchar   inl;
+		void    *lbl;
+	} abs_lbl[] = {
+		{ I_XTA, &&L_xta0 },    { I_ATX, &&L_atx0 },
+		{ I_ADD, &&L_add0 },    { I_SUB, &&L_sub0 },
+		{ 0, 0 },
+	};
+	static struct {
+		uchar   first, second;
+		void    *lbl;
+	} fuse_lbl[] = {
+		{ I_UTC, I_XTA, &&L_UTC_XTA },  { I_UTC, I_ATX, &&L_UTC_ATX },
+		{ I_UTC, I_XTS, &&L_UTC_XTS },  { I_UTC, I_ADD, &&L_UTC_ADD },
+		{ I_WTC, I_XTA, &&L_WTC_XTA },  { I_WTC, I_ATX, &&L_WTC_ATX },
+		{ I_WTC, I_XTS, &&L_WTC_XTS },  { I_XTA, I_ATX, &&L_XTA_ATX },
+		{ I_XTA, I_XTS, &&L_XTA_XTS },  { I_XTS, I_XTA, &&L_XTS_XTA },
+		{ I_XTS, I_ATX, &&L_XTS_ATX },  { I_XTS, I_ADD, &&L_XTS_ADD },
+		{ I_XTS, I_SUB, &&L_XTS_SUB },  { I_STX, I_XTS, &&L_STX_XTS },
+		{ I_ITA, I_ATI, &&L_ITA_ATI },  { I_VTM, I_VTM, &&L_VTM_VTM },
+		{ I_VTM, I_VLM, &&L_VTM_VLM },  { I_UTM, I_VTM, &&L_UTM_VTM },
+		{ 0, 0, 0 },
+	};
+#endif
+	static __thread int handlers[0120], ready;
+
+	if (!ready) {
+		int     k;
+
+		ready = 1;
+		for (i = 0; i < 0120; ++i) {
+			handlers[i] = (char *) inline_lbl[(int) optab[i].o_inline] -
+				(char *) &&L_default;
+			for (k = 0; impl_lbl[k].f; ++k)
+				if (optab[i].o_impl == impl_lbl[k].f)
+					handlers[i] = (char *) impl_lbl[k].lbl -
+						(char *) &&L_default;
+		}
+#if !RUN_DEBUG
+		for (k = 0; abs_lbl[k].lbl; ++k)
+			for (i = 0; i < 0120; ++i)
+				if (optab[i].o_inline == abs_lbl[k].inl)
+					dispatch_abs[i] = (char *) abs_lbl[k].lbl -
+						(char *) &&L_default;
+		for (k = 0; fuse_lbl[k].lbl; ++k)
+			for (i = 0; i < 0120; ++i) {
+				int     j;
+
+				if (optab[i].o_inline != fuse_lbl[k].first)
+					continue;
+				for (j = 0; j < 0120; ++j)
+					if (optab[j].o_inline == fuse_lbl[k].second)
+						dispatch_fuse[i][j] =
+							(char *) fuse_lbl[k].lbl -
+							(char *) &&L_default;
+			}
+#endif
+	}
+	dispatch = handlers;
+#if RUN_DEBUG
+	fusing = 0;
+#else
+	fusing = dispatch_fuse;
+#endif
+	if (bound != THIS_VARIANT) {
+		/* unpacked with the labels of the other variant */
+		bound = THIS_VARIANT;
+		for (i = 0; i < CORESZ * 2; ++i) {
+			uinstr_t *ip = shadow[i].s_insn;
+
+			if (!(shadow[i].s_flags & C_UNPACKED))
+				continue;
+			ip[0].i_handler = dispatch[ip[0].i_opcode];
+			ip[1].i_handler = dispatch[ip[1].i_opcode];
+			fuse(i);
+		}
+	}
+#endif
+	if (!icountp)
+		return THIS_VARIANT;    /* only to bind the handlers */
+
+FOREVER
+
+#if RUN_DEBUG
+	if (recheck) {
+		recheck = 0;
+		if (!need_debug())
+			VARIANT(V_FAST);
+	}
+#else
+	if (bi < blen) {
+		/* inside a cached block, as long as control flows straight */
+		pcm = pc | supmode;
+		if (((pcm << 1) | right) == bstart + bi && (right ||
+		    (!goahead && !breakflg && !PAGE_STALE(pcm) &&
+		    (shadow[pcm].s_flags & C_UNPACKED)))) {
+			nextpc = ADDR(pc + 1);
+			mem = 0;
+			cf = shadow[pcm].s_flags;
+			ui = shadow[pcm].s_insn[right];
+			++bi;
+			op = optab[ui.i_opcode];
+			icnt = ++icount;
+			goto decoded;
+		}
+		blen = 0;
+	}
+	if (breakflg)
+		VARIANT(V_DEBUG);
+#endif
+	/* blocks end at jumps, so a loop comes here on every turn */
+	if (ilimit && icount >= ilimit) {
+		err = E_TIME;
+		STOP;
+	}
+	if (goahead && !right) {
+		goahead = 0;
+		STORE(acc, ehandler - 11);
+		enreg.o = 0;
+		if (dis_exc)
+			enreg.o = 040;
+		if (G_LOG)
+			enreg.o |= 004;
+		if (G_MUL)
+			enreg.o |= 010;
+		if (G_ADD)
+			enreg.o |= 020;
+		if (dis_round)
+			enreg.o |= 002;
+		if (dis_norm)
+			enreg.o |= 001;
+		enreg.l = (long) enreg.o << 17;
+		enreg.r = 0;
+		STORE(enreg, ehandler - 10);
+		STORE(accex, ehandler - 9);
+		enreg.l = 0;
+		enreg.r = pc;
+		STORE(enreg, ehandler - 8);
+		enreg.r = reg[TRAPRETREG];
+		STORE(enreg, ehandler - 7);
+		enreg.r = (addrmod << 1) | right;
+		STORE(enreg, ehandler - 6);
+		enreg.r = reg[MODREG];
+		STORE(enreg, ehandler - 5);
+		enreg.r = reg[017];
+		STORE(enreg, ehandler - 4);
+		enreg.r = reg[016];
+		STORE(enreg, ehandler - 3);
+		enreg.r = reg[015];
+		STORE(enreg, ehandler - 2);
+		enreg.r = 0;
+		STORE(enreg, ehandler - 1);
+
+		eenab = 0;
+		reg[016] = pc = ehandler;
+		right = 0;
+		acc.l = emask;
+		acc.r = events;
+		events = 0;
+	}
+	nextpc = ADDR(pc + 1);
+	pcm = pc | supmode;
+	mem = 0;
+
+	if (!right) {
+		if (PAGE_STALE(pcm))
+			page_sync(pcm);
+		if (!(shadow[pcm].s_flags & C_UNPACKED))
+			unpack(pcm);
+	}
+	cf = shadow[pcm].s_flags;
+
+	if (!pcm || (!no_insn_check && (shadow[pcm].s_convol & CV_NUMBER)))
+		ABORT(E_CHECK);
+
+	ui = shadow[pcm].s_insn[right];
+	op = optab[ui.i_opcode];
+
+#if RUN_DEBUG
+	if ((cf & (C_NEXT|C_BPT) && !right) | (stepflg == 1) | breakflg) {
+dbg:
+		if (sync_rq) {
+			sync_rq = 0;
+			disk_sync();
+		}
+		pcm_dbg = pcm;
+		stepflg = breakflg = quitflg = 0;
+		shadow[pcm].s_flags &= ~C_NEXT;
+		where();
+		for (cmdflg = 1; cmdflg; command());
+		if (quitflg) STOP;
+		bpts = breakpoints();
+		recheck = 1;
+	} else if (stepflg)
+		 --stepflg;
+	icnt = ++icount;
+
+	if (stats || stats_file) {
+		/* the time since the last one goes to the previous insn */
+		dt = rdtsc() - tsc;
+		tsc += dt;
+		optab[last_op].o_ticks += dt;
+		addr_ticks[last_pcm] += dt;
+		/* and to the extracode until back in user mode */
+		if (ecode >= 0)
+			ecode_ticks[ecode] += dt;
+		if (!supmode)
+			ecode = -1;
+		if (op.o_inline == I_TRAP && !supmode)
+			++ecode_count[ecode = ui.i_opcode - 050];
+		++optab[ui.i_opcode].o_count;
+		++addr_count[pcm];
+		++op_pairs[last_op * 0120 + ui.i_opcode];
+		++op_triples[(prev_op * 0120 + last_op) * 0120 + ui.i_opcode];
+		prev_op = last_op;
+		last_op = ui.i_opcode;
+		last_pcm = pcm;
+	} else {
+		tsc = rdtsc();
+	}
+#else
+#ifdef JIT
+	if (!right && !supmode && !addrmod && !no_jit && shadow[pcm].s_blen) {
+		ulong   n = icount;
+
+		i = jit_run(&pcm, &n);
+		icount = n;
+		if (i != JIT_NONE) {
+			/* the translation has run the block, or part of it */
+			blen = 0;
+			if (i == JIT_STAY) {
+				/* go on at pc in the block at pcm */
+				blen = shadow[pcm].s_blen;
+				bstart = pcm << 1;
+				bi = ((pc << 1) | right) - bstart;
+			} else if (i) {
+				pcm = abpc;
+				ABORT(i);
+			}
+			NEXT;
+		}
+	}
+#endif
+	icnt = ++icount;
+
+	if (!right) {
+		blen = shadow[pcm].s_blen;
+		if (!blen && ++shadow[pcm].s_heat >= BLOCK_HOT)
+			blen = block_build(pcm);
+		if (blen) {
+			bstart = pcm << 1;
+			bi = 1;
+		}
+	}
+decoded:
+#endif
+	abpc = pc;
+	abright = right;
+	pc = ADDR(pc + right);
+	right ^= 1;
+
+	if (addrmod) {
+		addrmod = 0;
+		addr = ADDR(ui.i_addr + reg[MODREG]);
+	} else
+		addr = ui.i_addr;
+
+	if (TRACING) {
+		char str [40] = "";
+		LOAD(enreg, XADDR(addr + reg[ui.i_reg]));
+		fprintf(stderr, "%05o: %-4s", abpc, op.o_name);
+		if (addr >= 077700) {
+			if (ui.i_reg)
+				sprintf (str, "-%o(%o)", (addr ^ 077777) + 1, ui.i_reg);
+			else
+				sprintf (str, "-%o", (addr ^ 077777) + 1);
+		} else if (addr) {
+			if (ui.i_reg)
+				sprintf (str, "%o(%o)", addr, ui.i_reg);
+			else
+				sprintf (str, "%o", addr);
+		} else {
+			if (ui.i_reg) {
+				sprintf (str, "(%o)", ui.i_reg);
+			}
+		}
+		fprintf(stderr, "%-16s (=%08o%08o) acc=%08o%08o",
+			str, (uint)enreg.l, (uint)enreg.r,
+			(uint)acc.l, (uint)acc.r);
+		if (ui.i_reg)
+			fprintf(stderr, " r[%o]=%05o",
+				ui.i_reg, reg[ui.i_reg]);
+		fprintf(stderr, "\n");
+		fflush(stderr);
+	}
+
+	DISPATCH {
+	CASE(I_ATX):
+		STORE(acc, XADDR(addr + reg[ui.i_reg]));
+		if (TRACING)
+			fprintf(stderr, "       %05o: store %08o%08o\n",
+				XADDR(addr + reg[ui.i_reg]), acc.l, acc.r);
+		if (!addr && (ui.i_reg == STACKREG))
+			reg[STACKREG] = ADDR(reg[STACKREG] + 1);
+		NEXT;
+	CASE(I_STX):
+		DO_STX;
+		BREAK;
+	CASE(I_XTS): /* Major ISA change: swapping next 2 lines */
+		DO_XTS;
+		BREAK;
+	CASE(I_XTA):
+		DO_XTA;
+		BREAK;
+	CASE(I_VTM):
+		DO_VTM;
+		NEXT;
+	CASE(I_UTM):
+		DO_UTM;
+		NEXT;
+	CASE(I_VLM):
+		if (!reg[ui.i_reg])
+			BREAK;
+		reg[ui.i_reg] = ADDR(reg[ui.i_reg] + 1);
+		JMP(addr);
+		NEXT;
+	CASE(I_UJ):
+		JMP(ADDR(addr + reg[ui.i_reg]));
+		NEXT;
+	CASE(I_STOP):
+		if (!(cf & C_STOPPED)) {
+			cf |= C_STOPPED;
+			pc = abpc;
+			pcm = pc | supmode;
+			right = abright;
+			DEBUGGER;
+		}
+		NEXT;
+	CASE(I_ITS):
+		STK_PUSH;
+		/*      fall    thru    */
+	CASE(I_ITA):
+		DO_ITA;
+		BREAK;
+	CASE(I_XTR):
+		CHK_STACK;
+		GET_OP;
+set_mode:
+		dis_exc = (enreg.o & 040) != 0;
+		G_ADD = (enreg.o & 020) != 0;
+		G_MUL = (enreg.o & 010) != 0;
+		G_LOG = (enreg.o & 004) != 0;
+		dis_round = (enreg.o & 002) != 0;
+		dis_norm = (enreg.o & 001) != 0;
+		NEXT;
+	CASE(I_NTR):
+		GET_NAI_OP;
+		goto set_mode;
+	CASE(I_RTE):
+		GET_NAI_OP;
+		acc.o = 0;
+		if (dis_exc)
+			acc.o = 040;
+		if (G_LOG)
+			acc.o |= 004;
+		if (G_MUL)
+			acc.o |= 010;
+		if (G_ADD)
+			acc.o |= 020;
+		if (dis_round)
+			acc.o |= 002;
+		if (dis_norm)
+			acc.o |= 001;
+		acc.l = (long) (acc.o & enreg.o) << 17;
+		acc.r = 0;
+		BREAK;
+	CASE(I_ASUB):
+		CHK_STACK;
+		GET_OP;
+		if (NEGATIVE(acc))
+			NEGATE(acc);
+		if (!NEGATIVE(enreg))
+			NEGATE(enreg);
+		err = add();
+		if (err)
+			ABORT(err);
+		BREAK;
+	CASE(I_RSUB):
+		CHK_STACK;
+		GET_OP;
+		NEGATE(acc);
+		err = add();
+		if (err)
+			ABORT(err);
+		BREAK;
+	CASE(I_SUB):
+		CHK_STACK;
+		GET_OP;
+		NEGATE(enreg);
+		err = add();
+		if (err)
+			ABORT(err);
+		BREAK;
+	CASE(I_ADD):
+		CHK_STACK;
+		GET_OP;
+		err = add();
+		if (err)
+			ABORT(err);
+		BREAK;
+	CASE(I_YTA):
+		if (G_LOG) {
+			acc = accex;
+			BREAK;
+		}
+		UNPCK(accex);
+		UNPCK(acc);
+		acc.mr = accex.mr;
+		acc.ml = accex.ml & 0xffff;
+		acc.o += ((addr + reg[ui.i_reg]) & 0x7f) - 64;
+		op.o_flags |= F_AR;
+		enreg = accex;
+		accex = zeroword;
+		PACK(enreg);
+		BREAK;
+	CASE(I_UZA):
+		accex = acc;
+		if (G_ADD) {
+			if (acc.l & 0x10000)
+					NEXT;
+		} else if (G_MUL) {
+			if (!(acc.l & 0x800000))
+					NEXT;
+		} else if (G_LOG) {
+			if (acc.l | acc.r)
+					NEXT;
+		} else
+			NEXT;
+		JMP(ADDR(addr + reg[ui.i_reg]));
+		NEXT;
+	CASE(I_UIA):
+		accex = acc;
+		if (G_ADD) {
+			if (!(acc.l & 0x10000))
+					NEXT;
+		} else if (G_MUL) {
+			if (acc.l & 0x800000)
+					NEXT;
+		} else if (G_LOG) {
+			if (!(acc.l | acc.r))
+					NEXT;
+		} else
+			/* fall thru, i.e. branch */;
+		JMP(ADDR(addr + reg[ui.i_reg]));
+		NEXT;
+	CASE(I_UTC):
+		DO_UTC;
+		NEXT;
+	CASE(I_WTC):
+		DO_WTC;
+		NEXT;
+	CASE(I_VZM):
+		if (ui.i_opcode == 0115) {
+			if (reg[ui.i_reg]) {
+				JMP(addr);
+			}
+		} else {
+			if (!reg[ui.i_reg]) {
+				JMP(addr);
+			}
+		}
+		NEXT;
+	CASE(I_VJM):
+		reg[ui.i_reg] = nextpc;
+		reg[0] = 0;
+		JMP(addr);
+		NEXT;
+	CASE(I_ATI):
+		if (supmode) {
+			reg[i = (addr + reg[ui.i_reg]) & 0x1f] = ADDR(acc.r);
+			if (i == PSREG)
+				sup_mmap = (reg[PSREG] & 1) << 15;
+		} else
+			reg[(addr + reg[ui.i_reg]) & 0xf] = ADDR(acc.r);
+		reg[0] = 0;
+		NEXT;
+	CASE(I_STI): {
+		uchar   rg = (addr + reg[ui.i_reg]) & (supmode ? 0x1f : 0xf);
+		ushort  ad = ADDR(acc.r);
+
+		reg[rg] = ad;
+		reg[0] = 0;
+		if (rg != STACKREG)
+			reg[STACKREG] = ADDR(reg[STACKREG] - 1);
+		LOAD(acc, reg[STACKREG] | (supmode & sup_mmap));
+		if (rg == PSREG)
+			sup_mmap = (reg[PSREG] & 1) << 15;
+		BREAK;
+	}
+	CASE(I_MTJ):
+		if (supmode) {
+mtj:
+			reg[addr & 0x1f] = reg[ui.i_reg];
+			if ((addr & 0x1f) == PSREG)
+				sup_mmap = (reg[PSREG] & 1) << 15;
+		} else
+			reg[addr & 0xf] = reg[ui.i_reg];
+		reg[0] = 0;
+		NEXT;
+	CASE(I_MPJ):
+		i = addr & 0xf;
+		if (i & 020 && supmode)
+			goto mtj;
+		reg[i] = ADDR(reg[i] + reg[ui.i_reg]);
+		reg[0] = 0;
+		NEXT;
+	CASE(I_MOD):
+		if (supmode)
+			NEXT;
+		else
+			ABORT(E_PRIV);
+	CASE(I_IRET):
+		if (!supmode)
+			ABORT(E_PRIV);
+		if (ui.i_reg == 016) {
+			err = emu_call();
+			if (err) {
+				ninter = 0;     /* can't be intercepted */
+				ABORT(err);
+			}
+			/* it may have switched tracing or statistics */
+#if RUN_DEBUG
+			recheck = 1;
+#else
+			if (need_debug())
+				VARIANT(V_DEBUG);
+#endif
+			NEXT;
+		}
+		reg[PSREG] = reg[PSSREG] & 02003;
+		JMP(reg[(ui.i_reg & 3) | 030]);
+		right = !!(reg[PSSREG] & 0400);
+		sup_mmap = reg[PSSREG] & 1 ? 0100000 : 0;
+		supmode = reg[PSSREG] & 014 ? 0100000 : 0;
+		abpc = pc;
+		abright = right;
+		pcm = pc | supmode;
+		spec = spec_saved | supmode;
+		err = reg[TRAPNREG];
+		reg[TRAPNREG] = 0;
+		if (err)
+			ABORT(err);
+		NEXT;
+	CASE(I_TRAP):
+		reg[TRAPRETREG] = nextpc;
+		if (!(cf & C_STOPPED) &&
+				((1 << (ui.i_opcode - 050)) & ecode_intr)) {
+			cf |= C_STOPPED;
+			pc = abpc;
+			right = abright;
+			DEBUGGER;
+		}
+		JMP(nextpc);
+		reg[016] = ADDR(addr + reg[ui.i_reg]);
+		reg[TRAPNREG] = ui.i_opcode - 050;
+		stopwatch();
+		if (trace == 1 && (ui.i_opcode != 075 || reg[016] < 2)) {
+			/* Do not trace e75, it's too verbose. */
+			LOAD(enreg, reg[016] | (supmode & sup_mmap));
+			fprintf(stderr, "%05o: %-4s%-5o (=%08o%08o) acc=%08o%08o\n",
+				abpc, op.o_name, reg[016], (uint)enreg.l, (uint)enreg.r,
+				(uint)acc.l, (uint)acc.r);
+			fflush(stderr);
+		}
+		switch (ui.i_opcode) {
+		case 050:
+			err = e50();
+			goto errchk;
+		case 051:
+			err = e51();
+			goto errchk;
+		case 052:
+			err = elfun(EF_COS);
+			goto errchk;
+		case 053:
+			err = e53();
+			goto errchk;
+		case 054:
+			err = elfun(EF_ARCSIN);
+			goto errchk;
+		case 055:
+			err = elfun (EF_ALOG);
+			goto errchk;
+		case 056:
+			err = elfun (EF_EXP);
+			goto errchk;
+		case 057:
+			err = elfun(EF_ENTIER);
+			goto errchk;
+		case 060:
+			err = e60();
+			goto errchk;
+		case 061:
+			err = e61();
+			goto errchk;
+		case 062:
+			err = e62();
+			if (err == E_TERM)
+				STOP;
+			goto errchk;
+		case 063:
+			err = e63();
+			goto errchk;
+		case 064:
+			err = print();
+			goto errchk;
+		case 065:
+			err = physaddr();
+			goto errchk;
+		case 067:
+			err = deb();
+			goto errchk;
+		case 070:
+			err = ddio();
+			goto errchk;
+		case 071:
+			err = term();
+			goto errchk;
+		case 072:
+			err = resources();
+			goto errchk;
+		case 074:
+			if ((acc.l == 0x737973) &&      /* "syscal" */
+					(acc.r = 0x63616c)) {
+				err = usyscall();
+				goto errchk;
+			}
+			if ((accex.l == 0x737973) &&      /* "syscal" */
+					(accex.r = 0x63616c)) {
+				accex = zeroword;
+				err = emu_call();
+				goto errchk;
+			}
+			err = eexit();
+			if (err == E_TERM)
+				STOP;
+			goto errchk;
+		case 075:
+			STORE(acc, reg[016]);
+			shadow[reg[016]].s_convol &= ~CV_NUMBER;
+			switch (reg[016]) {
+			/* undocumented trick (ВРЕМЕННО ФИРСОВ) */
+			case 0: spec = 1; break;
+			case 1: spec = 0; break;
+			}
+			break;
+		default:
+			err = E_UNIMP;
+errchk:
+			if (err == E_UNIMP) {
+				/* try the supervisor then */
+				spec_saved = spec;
+				reg[PSSREG] = reg[PSREG] & 02003;
+				if (supmode)
+					reg[PSSREG] |= 014;
+				supmode = 0100000;
+				sup_mmap = 0100000;
+				reg[PSREG] = 02007;
+ 				/* words formed by the kernel in user memory can be instructions */
+				spec = 1;
+				JMP(XCODE_ENTRYPT);
+			} else if (err) {
+				startwatch();
+				ABORT(err);
+			}
+			break;
+		}
+		startwatch();
+#if RUN_DEBUG
+		recheck = 1;
+#else
+		if (need_debug())
+			VARIANT(V_DEBUG);
+#endif
+		NEXT;
+	DEFAULT:
+		GET_IMPL_OP;
+		err = (*op.o_impl)();
+		if (err)
+			ABORT(err);
+		BREAK;
+#ifdef THREADED_CODE
+	IMPL(aax) IMPL(aex) IMPL(arx) IMPL(avx) IMPL(aox) IMPL(b6div)
+	IMPL(mul) IMPL(apx) IMPL(aux) IMPL(acx) IMPL(anx) IMPL(epx)
+	IMPL(emx) IMPL(asx) IMPL(priv)
+#if !RUN_DEBUG
+
+	/* register-0 forms bound by block_build() */
+L_xta0:
+	LOAD(enreg, XADDR(addr));
+	acc = enreg;
+	BREAK;
+L_atx0:
+	STORE(acc, XADDR(addr));
+	NEXT;
+L_sub0:
+	LOAD(enreg, XADDR(addr));
+	accex = zeroword;
+	UNPCK(enreg);
+	UNPCK(acc);
+	NEGATE(enreg);
+	goto add0;
+L_add0:
+	LOAD(enreg, XADDR(addr));
+	accex = zeroword;
+	UNPCK(enreg);
+	UNPCK(acc);
+add0:
+	if ((err = add()))
+		ABORT(err);
+	BREAK;
+
+	/* pairs bound by unpack() and block_build() */
+	FUSED(UTC, XTA) FUSED(UTC, ATX) FUSED(UTC, XTS) FUSED(UTC, ADD)
+	FUSED(WTC, XTA) FUSED(WTC, ATX) FUSED(WTC, XTS)
+	FUSED(XTA, ATX) FUSED(XTA, XTS)
+	FUSED(XTS, XTA) FUSED(XTS, ATX) FUSED(XTS, ADD) FUSED(XTS, SUB)
+	FUSED(STX, XTS) FUSED(ITA, ATI)
+	FUSED(VTM, VTM) FUSED(VTM, VLM) FUSED(UTM, VTM)
+#endif
+#endif
+	}
+_break:
+
+	if ((i = op.o_flags & F_GRP))
+		augroup.gl_au = aumodes[i];
+
+	if (op.o_flags & F_AR) {
+		if ((err = norm()))
+			ABORT(err);
+		if (op.o_inline == I_YTA)
+			accex = enreg;
+		rnd_rq = 0;
+	}
+
+ENDFOREVER
+	*icountp = icount;
+	pcm_dbg = pcm;
+	return err;
+}
+
+#undef THIS_VARIANT
+#undef TRACING
+#undef DEBUGGER
+#undef VARIANT
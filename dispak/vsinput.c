@@ -1,5 +1,6 @@
 /*
- * Processing input task file and writing it to input queue.
+ * Processing input task file into an input buffer, in memory or in the
+ * input queue.
  *
  * This program is distributed in the hope that it will be useful, but WITHOUT
  * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
@@ -12,6 +13,7 @@
  */
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -21,19 +23,20 @@
 #include "gost10859.h"
 #include "encoding.h"
 
-static unsigned                 lineno, pncline, pncsym;
-static unsigned                 level, array;
-static uchar			ch;
-static unsigned                 iaddr;
-static unsigned                 user_hi, user_lo;
-static unsigned                 (*_nextc[2])(void);
-static void                     (*diagftn)(char *);
-static uchar                    *stpsp;
-static struct passport          psp;
-static FILE                     *ibuf;
-static int                      ibufno;
-static char                     ibufname[MAXPATHLEN];
-static ushort                   chunk;
+static __thread unsigned        lineno, pncline, pncsym;
+static __thread unsigned        level, array;
+static __thread uchar		ch;
+static __thread unsigned        iaddr;
+static __thread unsigned        user_hi, user_lo;
+static __thread unsigned        (*_nextc[2])(void);
+static __thread void            (*diagftn)(char *);
+static __thread uchar           *stpsp;
+static __thread struct passport psp;
+static __thread uchar           *ibuf;          /* passport and words   */
+static __thread size_t          iblen, ibsize;
+static __thread uchar           *ibtaken;       /* left for input(0)    */
+static __thread size_t          ibtakenlen;
+static __thread ushort          chunk;
 
 static unsigned                 nextc(void);
 static int                      scan(int edit);
@@ -41,6 +44,7 @@ static void                     inperr(char *);
 static uchar                    *passload(char *src);
 static unsigned                 nextcp(void);
 static int                      dump(uchar tag, uint64_t w);
+static int                      ibwrite(void);
 static int                      prettycard(unsigned char * s, uint64_t w[]);
 extern uint64_t			nextw(void);
 
@@ -60,8 +64,13 @@ NEXT_NS()
 	return ch;
 }
 
+/*
+ * Reads a task: with mem set, the input buffer is left in memory for
+ * input(0) and 0 is returned, unless the passport asks to keep it;
+ * otherwise it goes to the input queue and its number is returned.
+ */
 int
-vsinput(unsigned (*cget)(void), void (*diag)(char *), int edit)
+vsinput(unsigned (*cget)(void), void (*diag)(char *), int edit, int mem)
 {
 	int     r;
 
@@ -76,25 +85,96 @@ vsinput(unsigned (*cget)(void), void (*diag)(char *), int edit)
 	_nextc[0] = cget;
 	_nextc[1] = nextcp;
 	diagftn = diag;
-	ibuf = NULL;
-	ibufno = 0;
+	ibsize = sizeof(psp) + 1024 * sizeof(struct ibword);
+	iblen = sizeof(psp);
+	if (! (ibuf = malloc(ibsize))) {
+		diagftn(_(" ОШ БУФ ВВД\n"));
+		return -1;
+	}
 
 	nextc();
 	r = scan(edit);
-	if (r < 0) {
-		if (ibuf) {
-			fclose(ibuf);
-			unlink(ibufname);
+	if (r >= 0) {
+		if (!psp.arr_end)
+			psp.arr_end = iblen;
+		memcpy(ibuf, &psp, sizeof(psp));
+		if (mem && ! psp.keep) {
+			free(ibtaken);
+			ibtaken = ibuf;
+			ibtakenlen = iblen;
+			return 0;
 		}
-		return r;
+		r = ibwrite();
+	}
+	free(ibuf);
+	return r;
+}
+
+/*
+ * The input buffer left by vsinput(), to be freed by the caller;
+ * NULL if there is none.
+ */
+uchar *
+vsinput_take(size_t *len)
+{
+	uchar   *p = ibtaken;
+
+	*len = ibtakenlen;
+	ibtaken = NULL;
+	return p;
+}
+
+/*
+ * Puts the input buffer into the input queue, returns its number.
+ * The buffer is written whole under a temporary name, then linked to
+ * the first free number: link() takes the number atomically, and no
+ * reader ever sees a buffer half written.  Each process starts
+ * looking at its own place, so that runs started together do not all
+ * race for the first free numbers.
+ */
+static int
+ibwrite(void)
+{
+	char    ibufname[MAXPATHLEN], tmpname[MAXPATHLEN];
+	int     i, n, fd, l;
+
+	input_queue_path (ibufname);
+	strcat(ibufname, "/");
+	l = strlen(ibufname);
+	strcpy(tmpname, ibufname);
+	strcat(tmpname, ".ibXXXXXX");
+
+	fd = mkstemp(tmpname);
+	if (fd < 0) {
+		perror(tmpname);
+		diagftn(_(" ОШ БУФ ВВД\n"));
+		return -1;
 	}
+	fchmod(fd, 0644);
+	if (write(fd, ibuf, iblen) != (ssize_t) iblen) {
+		close(fd);
+		unlink(tmpname);
+		diagftn(_(" ОШ БУФ ВВД\n"));
+		return -1;
+	}
+	close(fd);
 
-	if (!psp.arr_end)
-		psp.arr_end = ftell(ibuf);
-	rewind(ibuf);
-	fwrite(&psp, sizeof(psp), 1, ibuf);
-	fclose(ibuf);
-	return ibufno;
+	for (n = 0, i = getpid() % 0177; n < 0177; ++n, i = (i + 1) % 0177) {
+		sprintf(ibufname + l, "%03o", i + 1);
+		if (link(tmpname, ibufname) == 0) {
+			unlink(tmpname);
+			return i + 1;
+		}
+		if (errno != EEXIST) {
+			perror(ibufname);
+			unlink(tmpname);
+			diagftn(_(" ОШ БУФ ВВД\n"));
+			return -1;
+		}
+	}
+	unlink(tmpname);
+	diagftn(_(" БУФ ПЕРЕП\n"));
+	return -1;
 }
 
 static inline unsigned
@@ -361,10 +441,10 @@ mpar:				inperr(_("НЕТ ПАРАМ"));
 				while (*cp == GOST_SPACE) cp++;
 			}
 		} else {
-			printf ("Unknown passport entry: ");
+			fprintf (LPOUT, "Unknown passport entry: ");
 			for (cp = art; *cp != GOST_OVERLINE; ++cp)
-				gost_putc (*cp, stdout);
-			printf ("\n");
+				gost_putc (*cp, LPOUT);
+			fprintf (LPOUT, "\n");
 		}
 		while (ch != GOST_EOF && ch != GOST_OVERLINE)
 			nextc();
@@ -582,8 +662,7 @@ wrap:				if (ch != GOST_K) goto fs; nextc();
 			} else {
 				array = 1;
 				iaddr = 0;
-				if (! ibuf || (psp.arr_end = ftell(ibuf)) ==
-				    sizeof(psp)) {
+				if ((psp.arr_end = iblen) == sizeof(psp)) {
 					inperr(_("МАССИВ ПУСТ"));
 					return -1;
 				}
@@ -718,47 +797,29 @@ nextcp(void)
 static int
 dump(uchar tag, uint64_t w)
 {
-	int             i, fd, l;
+	int             i;
 	struct ibword   ibw;
+	uchar           *p;
 
 	if (! iaddr) {
 		diagftn(_(" НЕТ АВВД\n"));
 		return -1;
 	}
-	if (! ibuf) {
-		disk_local_path (ibufname);
-		strcat(ibufname, "/input_queue");
-		mkdir(ibufname, 0755);
-		strcat(ibufname, "/");
-
-		l = strlen(ibufname);
-		for (i = 1; i < 0200; ++i) {
-			sprintf(ibufname + l, "%03o", i);
-			fd = open(ibufname, O_CREAT | O_EXCL | O_RDWR, 0666);
-			if (fd < 0)
-				continue;
-			ibuf = fdopen(fd, "w");
-			if (!ibuf) {
-ioberr:
-				diagftn(_(" ОШ БУФ ВВД\n"));
-				return -1;
-			}
-			ibufno = i;
-			break;
-		}
-		if (!ibuf) {
-			diagftn(_(" БУФ ПЕРЕП\n"));
+	if (iblen + sizeof(struct ibword) > ibsize) {
+		if (! (p = realloc(ibuf, ibsize * 2))) {
+			diagftn(_(" ОШ БУФ ВВД\n"));
 			return -1;
 		}
-		fseek(ibuf, (long) sizeof(struct passport), SEEK_SET);
+		ibuf = p;
+		ibsize *= 2;
 	}
 
 	ibw.tag = tag;
 	ibw.spare = 0;
 	for (i = 0; i < 6; ++i)
 		ibw.w.w_b[i] = w >> (5 - i) * 8;
-	if (fwrite(&ibw, sizeof(struct ibword), 1, ibuf) != 1)
-		goto ioberr;
+	memcpy(ibuf + iblen, &ibw, sizeof(struct ibword));
+	iblen += sizeof(struct ibword);
 	++iaddr;
 	return 0;
 }